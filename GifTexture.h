@@ -0,0 +1,109 @@
+#ifndef GIF_TEXTURE_H
+#define GIF_TEXTURE_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+
+#include <string>
+#include <iostream>
+
+// An animated GIF played into an RGBA8 texture. Frames are decoded one at a
+// time with stbi_gif_stream and uploaded with glTexSubImage2D as they come
+// due, so memory stays at a few frames however long the animation is. Call
+// update once per tick with the current time; at the end the stream is
+// reopened and the animation loops.
+class GifTexture
+{
+public:
+    unsigned int ID;        // RGBA8 texture.
+    int width, height;      // image size.
+    bool loaded;
+    // constructor opens the stream and uploads the first frame.
+    // ------------------------------------------------------------------------
+    GifTexture(const char* path) : path(path), stream(NULL), frameEnd(0.0), started(false)
+    {
+        ID = 0;
+        width = height = 0;
+        loaded = open();
+        if (!loaded)
+        {
+            std::cout << "ERROR::TEXTURE::GIF_LOAD_FAILED: " << path << " (" << stbi_failure_reason() << ")" << std::endl;
+            return;
+        }
+        glGenTextures(1, &ID);
+        glBindTexture(GL_TEXTURE_2D, ID);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        // no mipmaps, they'd have to be rebuilt every frame.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        loaded = nextFrame();
+    }
+    ~GifTexture()
+    {
+        stbi_gif_stream_close(stream);
+        if (ID)
+            glDeleteTextures(1, &ID);
+    }
+    GifTexture(const GifTexture&) = delete;
+    GifTexture& operator=(const GifTexture&) = delete;
+    // advance to the frame showing at time (in seconds, like glfwGetTime()).
+    // ------------------------------------------------------------------------
+    void update(double time)
+    {
+        if (!loaded)
+            return;
+        // the first frame's delay counts from the first update.
+        if (!started)
+        {
+            frameEnd += time;
+            started = true;
+        }
+        // after a stall, pick up from now instead of racing through frames.
+        if (time - frameEnd > 1.0)
+            frameEnd = time;
+        while (loaded && frameEnd <= time)
+            loaded = nextFrame();
+    }
+    // bind the texture to texture unit unit.
+    // ------------------------------------------------------------------------
+    void bind(int unit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, ID);
+    }
+
+private:
+    std::string path;
+    stbi_gif_stream* stream;
+    double frameEnd;        // when the frame in the texture is done.
+    bool started;
+
+    bool open()
+    {
+        int channels;
+        stream = stbi_gif_stream_open(path.c_str(), &width, &height, &channels, 4);
+        return stream != NULL;
+    }
+
+    // upload the next frame, starting over after the last one.
+    bool nextFrame()
+    {
+        int delay = 0;
+        const unsigned char* frame = stbi_gif_stream_next(stream, &delay);
+        if (!frame)
+        {
+            stbi_gif_stream_close(stream);
+            if (!open() || !(frame = stbi_gif_stream_next(stream, &delay)))
+                return false;
+        }
+        glBindTexture(GL_TEXTURE_2D, ID);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frame);
+        // like browsers, treat tiny delays as 1/10 s.
+        frameEnd += (delay <= 10 ? 100 : delay) / 1000.0;
+        return true;
+    }
+};
+#endif
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <vector>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <Shader.h>
@@ -10,6 +11,7 @@
 // Function definitions.
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
+int loadTextures(const char* const* paths, const int* channels, const unsigned int* textures, int count);
 
 //Window Size Variables.
 const unsigned int resolution_x = 1080;
@@ -148,8 +150,6 @@ int main()
     // Generate textures from external file.
     //---------------------------------------------------------------------------
     unsigned int texture1, texture2;
-    int width, height, nrChannels;
-    unsigned char* data;
 
     // Flip textures on load.
     stbi_set_flip_vertically_on_load(true);
@@ -162,18 +162,6 @@ int main()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image and generate texture.
-    data = stbi_load("../Textures/container.jpg", &width, &height, &nrChannels, 0);
-    if (data)
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data);
 
     // Texture 2.
     glGenTextures(1, &texture2);
@@ -183,18 +171,12 @@ int main()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image and generate texture.
-    data = stbi_load("../Textures/Mable.png", &width, &height, &nrChannels, 0);
-    if (data)
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data);
+
+    // load images and generate textures, decoding all of them at the same time.
+    const char* texturePaths[] = { "../Textures/container.jpg", "../Textures/Mable.png" };
+    const int textureChannels[] = { 3, 4 };
+    const unsigned int textures[] = { texture1, texture2 };
+    loadTextures(texturePaths, textureChannels, textures, 2);
 
     ourShader.use(); // don't forget to activate/use the shader before setting uniforms!
     // either set it manually like so:
@@ -286,3 +268,108 @@ void processInput(GLFWwindow* window)
         }
     }
 }
+
+// Texture loading: decode a set of images at the same time, each straight into
+// a pixel unpack buffer, and upload them to their textures with 3 (RGB) or 4
+// (RGBA) channels. HDR images are uploaded as half floats instead. Returns the
+// number of textures loaded, and says what went wrong with the others.
+int loadTextures(const char* const* paths, const int* channels, const unsigned int* textures, int count)
+{
+    std::vector<stbi_batch_item> items(count, stbi_batch_item());
+    std::vector<unsigned int> PBOs(count, 0);
+
+    // Map a buffer for each image's pixels, so the decoder writes them where the driver wants them.
+    for (int i = 0; i < count; i++)
+    {
+        stbi_batch_item& item = items[i];
+        item.filename = paths[i];
+        item.desired_channels = channels[i];
+        if (stbi_is_hdr(paths[i]))
+        {
+            item.type = STBI_batch_half;
+            continue;
+        }
+        int width, height, nrChannels;
+        if (!stbi_info(paths[i], &width, &height, &nrChannels))
+        {
+            continue;   // the batch fails on it too, and says why.
+        }
+
+        // Rows start on 4 byte boundaries, the default GL_UNPACK_ALIGNMENT.
+        int pitch = (width * channels[i] + 3) & ~3;
+        glGenBuffers(1, &PBOs[i]);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOs[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)pitch * height, NULL, GL_STREAM_DRAW);
+        item.out = (unsigned char*)glMapBufferRange
+        (
+            GL_PIXEL_UNPACK_BUFFER,                             // buffer type.
+            0,                                                  // offset.
+            (GLsizeiptr)pitch * height,                         // size of mapping.
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT     // write only, old contents not needed.
+        );
+        item.out_w = width;
+        item.out_h = height;
+        item.out_stride = pitch;
+        // Without a mapping, decode into client memory instead.
+        if (!item.out)
+        {
+            glDeleteBuffers(1, &PBOs[i]);
+            PBOs[i] = 0;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Decode on the worker threads; the mapped buffers can be written from any thread.
+    stbi_load_batch(items.data(), count, NULL, NULL);
+
+    int loaded = 0;
+    for (int i = 0; i < count; i++)
+    {
+        stbi_batch_item& item = items[i];
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        if (PBOs[i])
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBOs[i]);
+            // Unmapping can fail if the buffer contents were lost, then upload nothing.
+            if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) && item.data)
+            {
+                item.data = NULL;
+                item.failure_reason = "pixel buffer contents lost";
+            }
+        }
+
+        if (!item.data)
+        {
+            std::cout << "Failed to load texture " << paths[i] << " (" << item.failure_reason << ")" << std::endl;
+        }
+        else
+        {
+            GLenum format = channels[i] == 4 ? GL_RGBA : GL_RGB;
+            if (item.type == STBI_batch_half)
+            {
+                // Half float RGB rows are only 2 byte aligned.
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                glTexImage2D(GL_TEXTURE_2D, 0, channels[i] == 4 ? GL_RGBA16F : GL_RGB16F, item.x, item.y, 0, format, GL_HALF_FLOAT, item.data);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            }
+            else
+            {
+                // With a pixel unpack buffer bound, the data pointer is an offset into it.
+                glTexImage2D(GL_TEXTURE_2D, 0, format, item.x, item.y, 0, format, GL_UNSIGNED_BYTE, PBOs[i] ? (void*)0 : item.data);
+            }
+            glGenerateMipmap(GL_TEXTURE_2D);
+            loaded++;
+        }
+
+        if (PBOs[i])
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glDeleteBuffers(1, &PBOs[i]);
+        }
+        else
+        {
+            stbi_image_free(item.data);
+        }
+    }
+    return loaded;
+}
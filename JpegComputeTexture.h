@@ -0,0 +1,352 @@
+#ifndef JPEG_COMPUTE_TEXTURE_H
+#define JPEG_COMPUTE_TEXTURE_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <Shader.h>
+
+#include <string>
+#include <iostream>
+
+// A JPEG decoded on the GPU: the CPU only does the Huffman decoding (with
+// stbi_jpeg_coefficients), and two GL 4.3 compute shaders dequantize, IDCT,
+// upsample and color-convert into an RGBA8 texture. They do it with the
+// same integer arithmetic as stb_image, so the texture holds exactly what
+// stbi_load(path, ..., 4) returns. YCbCr and greyscale JPEGs only, like
+// stbi_jpeg_coefficients; the texture binds like any other sampler2D.
+class JpegComputeTexture
+{
+public:
+    unsigned int ID;        // RGBA8 texture.
+    int width, height;      // image size.
+    bool loaded;
+    // constructor decodes the coefficients and runs the shaders. flipped says
+    // whether stbi_set_flip_vertically_on_load is on, the texture is flipped
+    // the same way.
+    // ------------------------------------------------------------------------
+    JpegComputeTexture(const char* path, bool flipped = true)
+    {
+        int planes;
+        stbi_jpeg_coeffs comp[3];
+        ID = 0;
+        width = height = 0;
+        loaded = false;
+        short* data = stbi_jpeg_coefficients(path, &width, &height, &planes, comp);
+        if (!data)
+        {
+            std::cout << "ERROR::TEXTURE::JPEG_LOAD_FAILED: " << path << " (" << stbi_failure_reason() << ")" << std::endl;
+            return;
+        }
+
+        // coefficients as decoded, and the planes the IDCT writes.
+        GLsizeiptr coeffSize = 0, planeSize = 0;
+        for (int k = 0; k < planes; k++)
+        {
+            coeffSize += (GLsizeiptr)comp[k].blocks_w * comp[k].blocks_h * 64 * sizeof(short);
+            planeSize += (GLsizeiptr)comp[k].blocks_w * comp[k].blocks_h * 64;
+        }
+        GLint64 maxSize = 0;
+        glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxSize);
+        if (coeffSize > maxSize)
+        {
+            std::cout << "ERROR::TEXTURE::JPEG_TOO_LARGE_FOR_GPU: " << path << std::endl;
+            stbi_image_free(data);
+            return;
+        }
+        unsigned int buffers[2];
+        glGenBuffers(2, buffers);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, coeffSize, data, GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, planeSize, NULL, GL_STREAM_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers[1]);
+
+        // 1. dequantize and IDCT every block into its plane.
+        unsigned int idct = compile(idctSource, "IDCT");
+        unsigned int color = compile(colorSource, "COLOR");
+        GLint planeOffset[3] = { 0, 0, 0 }, planeStride[3] = { 0, 0, 0 };
+        glUseProgram(idct);
+        for (int k = 0, offset = 0; k < planes; k++)
+        {
+            GLint quant[64];
+            for (int i = 0; i < 64; i++)
+            {
+                quant[i] = comp[k].quant[i];
+            }
+            int blocks = comp[k].blocks_w * comp[k].blocks_h;
+            int groups = (blocks + 63) / 64;
+            planeOffset[k] = offset;
+            planeStride[k] = comp[k].blocks_w * 8;
+            glUniform1iv(glGetUniformLocation(idct, "quant"), 64, quant);
+            glUniform1i(glGetUniformLocation(idct, "blocks"), blocks);
+            glUniform1i(glGetUniformLocation(idct, "blocksW"), comp[k].blocks_w);
+            glUniform1i(glGetUniformLocation(idct, "firstBlock"), (int)((comp[k].coeff - data) / 64));
+            glUniform1i(glGetUniformLocation(idct, "planeOffset"), offset / 4);
+            // more groups than one dimension allows go in rows.
+            glDispatchCompute(groups < 65535 ? groups : 65535, (groups + 65534) / 65535, 1);
+            offset += blocks * 64;
+        }
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        stbi_image_free(data);
+
+        // 2. upsample and color-convert straight into the texture.
+        int levels = 1;
+        while ((width | height) >> levels)
+        {
+            levels++;
+        }
+        glGenTextures(1, &ID);
+        glBindTexture(GL_TEXTURE_2D, ID);
+        glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindImageTexture(0, ID, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+        glUseProgram(color);
+        GLint compY[3] = { 0, 0, 0 }, wLores[3] = { 0, 0, 0 }, hs[3] = { 1, 1, 1 }, vs[3] = { 1, 1, 1 };
+        for (int k = 0; k < planes; k++)
+        {
+            compY[k] = comp[k].h;
+            hs[k] = comp[k].sx;
+            vs[k] = comp[k].sy;
+            wLores[k] = (width + hs[k] - 1) / hs[k];
+        }
+        glUniform1i(glGetUniformLocation(color, "width"), width);
+        glUniform1i(glGetUniformLocation(color, "height"), height);
+        glUniform1i(glGetUniformLocation(color, "planes"), planes);
+        glUniform1i(glGetUniformLocation(color, "flipped"), flipped ? 1 : 0);
+        glUniform1iv(glGetUniformLocation(color, "planeOffset"), 3, planeOffset);
+        glUniform1iv(glGetUniformLocation(color, "planeStride"), 3, planeStride);
+        glUniform1iv(glGetUniformLocation(color, "compY"), 3, compY);
+        glUniform1iv(glGetUniformLocation(color, "wLores"), 3, wLores);
+        glUniform1iv(glGetUniformLocation(color, "hs"), 3, hs);
+        glUniform1iv(glGetUniformLocation(color, "vs"), 3, vs);
+        glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        // GL keeps these around until the shaders are done with them.
+        glUseProgram(0);
+        glDeleteProgram(idct);
+        glDeleteProgram(color);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+        glDeleteBuffers(2, buffers);
+        loaded = true;
+    }
+    // bind the texture to texture unit unit and point the shader's sampler
+    // name at it
+    // ------------------------------------------------------------------------
+    void bind(const Shader& shader, const std::string& name, int unit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, ID);
+        shader.setInt(name, unit);
+    }
+
+private:
+    // compile a compute shader into a program.
+    unsigned int compile(const char* source, const std::string& type)
+    {
+        int success;
+        char infoLog[1024];
+        unsigned int shader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if (!success)
+        {
+            glGetShaderInfoLog(shader, 1024, NULL, infoLog);
+            std::cout << "ERROR::SHADER_COMPILATION_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
+        }
+        unsigned int program = glCreateProgram();
+        glAttachShader(program, shader);
+        glLinkProgram(program);
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glGetProgramInfoLog(program, 1024, NULL, infoLog);
+            std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
+        }
+        glDeleteShader(shader);
+        return program;
+    }
+
+    // one invocation per block: stbi__idct_block, constants and all. the
+    // coefficients are pairs of shorts in a uint, the planes 4 bytes in one.
+    static constexpr const char* idctSource = R"glsl(
+#version 430
+layout(local_size_x = 64) in;
+layout(std430, binding = 0) readonly buffer Coefficients { uint coeff[]; };
+layout(std430, binding = 1) writeonly buffer Planes { uint plane[]; };
+uniform int quant[64];
+uniform int blocks, blocksW, firstBlock, planeOffset;
+
+int v[64];
+
+// derived from jidctint -- DCT_ISLOW, with stbi__f2f constants
+void idct1d(int s0, int s1, int s2, int s3, int s4, int s5, int s6, int s7,
+            out int x0, out int x1, out int x2, out int x3,
+            out int t0, out int t1, out int t2, out int t3)
+{
+    int p1, p2, p3, p4, p5;
+    p2 = s2;
+    p3 = s6;
+    p1 = (p2 + p3) * 2217;
+    t2 = p1 + p3 * -7567;
+    t3 = p1 + p2 * 3135;
+    p2 = s0;
+    p3 = s4;
+    t0 = (p2 + p3) * 4096;
+    t1 = (p2 - p3) * 4096;
+    x0 = t0 + t3;
+    x3 = t0 - t3;
+    x1 = t1 + t2;
+    x2 = t1 - t2;
+    t0 = s7;
+    t1 = s5;
+    t2 = s3;
+    t3 = s1;
+    p3 = t0 + t2;
+    p4 = t1 + t3;
+    p1 = t0 + t3;
+    p2 = t1 + t2;
+    p5 = (p3 + p4) * 4816;
+    t0 = t0 * 1223;
+    t1 = t1 * 8410;
+    t2 = t2 * 12586;
+    t3 = t3 * 6149;
+    p1 = p5 + p1 * -3685;
+    p2 = p5 + p2 * -10497;
+    p3 = p3 * -8034;
+    p4 = p4 * -1597;
+    t3 += p1 + p4;
+    t2 += p2 + p3;
+    t1 += p2 + p4;
+    t0 += p1 + p3;
+}
+
+uint pack4(int a, int b, int c, int d)
+{
+    return uint(clamp(a, 0, 255)) | (uint(clamp(b, 0, 255)) << 8) | (uint(clamp(c, 0, 255)) << 16) | (uint(clamp(d, 0, 255)) << 24);
+}
+
+void main()
+{
+    int b = int(gl_GlobalInvocationID.x + gl_GlobalInvocationID.y * gl_NumWorkGroups.x * 64u);
+    if (b >= blocks)
+        return;
+    int c = (firstBlock + b) * 32;
+    for (int i = 0; i < 64; i += 2) {
+        // dequantized to a short, like the decoder does
+        int w = int(coeff[c + i / 2]);
+        v[i]     = bitfieldExtract(bitfieldExtract(w, 0, 16) * quant[i], 0, 16);
+        v[i + 1] = bitfieldExtract(bitfieldExtract(w, 16, 16) * quant[i + 1], 0, 16);
+    }
+
+    int x0, x1, x2, x3, t0, t1, t2, t3;
+    for (int i = 0; i < 8; ++i) {
+        idct1d(v[i], v[i + 8], v[i + 16], v[i + 24], v[i + 32], v[i + 40], v[i + 48], v[i + 56], x0, x1, x2, x3, t0, t1, t2, t3);
+        x0 += 512; x1 += 512; x2 += 512; x3 += 512;
+        v[i]      = (x0 + t3) >> 10;
+        v[i + 56] = (x0 - t3) >> 10;
+        v[i + 8]  = (x1 + t2) >> 10;
+        v[i + 48] = (x1 - t2) >> 10;
+        v[i + 16] = (x2 + t1) >> 10;
+        v[i + 40] = (x2 - t1) >> 10;
+        v[i + 24] = (x3 + t0) >> 10;
+        v[i + 32] = (x3 - t0) >> 10;
+    }
+
+    int stride = blocksW * 2;
+    int o = planeOffset + (b / blocksW) * 8 * stride + (b % blocksW) * 2;
+    for (int i = 0; i < 64; i += 8, o += stride) {
+        idct1d(v[i], v[i + 1], v[i + 2], v[i + 3], v[i + 4], v[i + 5], v[i + 6], v[i + 7], x0, x1, x2, x3, t0, t1, t2, t3);
+        x0 += 65536 + (128 << 17);
+        x1 += 65536 + (128 << 17);
+        x2 += 65536 + (128 << 17);
+        x3 += 65536 + (128 << 17);
+        plane[o]     = pack4((x0 + t3) >> 17, (x1 + t2) >> 17, (x2 + t1) >> 17, (x3 + t0) >> 17);
+        plane[o + 1] = pack4((x3 - t0) >> 17, (x2 - t1) >> 17, (x1 - t2) >> 17, (x0 - t3) >> 17);
+    }
+}
+)glsl";
+
+    // one invocation per pixel: the stbi__resample_row_* filter of each
+    // plane at that pixel, then stbi__YCbCr_to_RGB_row.
+    static constexpr const char* colorSource = R"glsl(
+#version 430
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(std430, binding = 1) readonly buffer Planes { uint plane[]; };
+layout(rgba8, binding = 0) writeonly uniform image2D result;
+uniform int width, height, planes, flipped;
+uniform int planeOffset[3], planeStride[3], compY[3], wLores[3], hs[3], vs[3];
+
+int at(int k, int row, int x)
+{
+    int i = planeOffset[k] + row * planeStride[k] + x;
+    return int(bitfieldExtract(plane[i >> 2], (i & 3) * 8, 8));
+}
+
+// the sample of plane k at pixel (x,j), as upsampled by stb_image
+int upsample(int k, int x, int j)
+{
+    int h = hs[k], v = vs[k], w = wLores[k];
+    // the rows stbi__resample_seek picks
+    int t = j + (v >> 1), q = t / v;
+    int line1 = min(q, compY[k] - 1);
+    int line0 = q == 0 ? 0 : min(q - 1, compY[k] - 1);
+    bool bot = t % v >= (v >> 1);
+    int near = bot ? line1 : line0, far = bot ? line0 : line1;
+
+    if (h == 1 && v == 1)
+        return at(k, near, x);
+    if (h == 1 && v == 2)
+        return (3 * at(k, near, x) + at(k, far, x) + 2) >> 2;
+    if (h == 2 && v == 1) {
+        int i = x >> 1;
+        if (w == 1 || x == 0)
+            return at(k, near, 0);
+        if (x == 2 * w - 1)
+            return at(k, near, w - 1);
+        if (x == 2 * w - 2)
+            return (3 * at(k, near, w - 2) + at(k, near, w - 1) + 2) >> 2;
+        return (3 * at(k, near, i) + at(k, near, (x & 1) != 0 ? i + 1 : i - 1) + 2) >> 2;
+    }
+    if (h == 2 && v == 2) {
+        int i = x >> 1;
+        int t1 = 3 * at(k, near, i) + at(k, far, i);
+        if (w == 1 || x == 0 || x == 2 * w - 1)
+            return (t1 + 2) >> 2;
+        int n = (x & 1) != 0 ? i + 1 : i - 1;
+        int t0 = 3 * at(k, near, n) + at(k, far, n);
+        return (3 * t1 + t0 + 8) >> 4;
+    }
+    // stbi__resample_row_generic
+    return at(k, near, x / h);
+}
+
+void main()
+{
+    int x = int(gl_GlobalInvocationID.x), j = int(gl_GlobalInvocationID.y);
+    if (x >= width || j >= height)
+        return;
+    int y = upsample(0, x, j);
+    ivec3 rgb = ivec3(y);
+    if (planes == 3) {
+        // stbi__YCbCr_to_RGB_row
+        int cb = upsample(1, x, j) - 128, cr = upsample(2, x, j) - 128;
+        int yFixed = (y << 20) + (1 << 19);
+        rgb.r = yFixed + cr * 1470208;
+        rgb.g = yFixed + cr * -748800 + ((cb * -360960) & int(0xffff0000u));
+        rgb.b = yFixed + cb * 1858048;
+        rgb = clamp(rgb >> 20, 0, 255);
+    }
+    imageStore(result, ivec2(x, flipped != 0 ? height - 1 - j : j), vec4(vec3(rgb), 255.0) / 255.0);
+}
+)glsl";
+};
+#endif
@@ -0,0 +1,114 @@
+#ifndef YCBCR_TEXTURE_H
+#define YCBCR_TEXTURE_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <Shader.h>
+
+#include <string>
+#include <iostream>
+
+// A JPEG uploaded as its Y, Cb and Cr planes, one R8 texture each, so the
+// upsampling and color conversion happen in the fragment shader. For 4:2:0
+// images that is half the upload of RGB. The fragment shader declares, for
+// a texture bound with name "texture1":
+//
+//     uniform sampler2D texture1Y;
+//     uniform sampler2D texture1Cb;
+//     uniform sampler2D texture1Cr;
+//     uniform vec4 texture1Chroma;   // chroma coordinates = uv * xy + zw
+//
+//     vec4 sampleYCbCr(sampler2D y, sampler2D cb, sampler2D cr, vec4 chroma, vec2 uv)
+//     {
+//         vec2 c = uv * chroma.xy + chroma.zw;
+//         float Y  = texture(y, uv).r;
+//         float Cb = texture(cb, c).r - 0.5;
+//         float Cr = texture(cr, c).r - 0.5;
+//         return vec4(Y + 1.40200 * Cr, Y - 0.34414 * Cb - 0.71414 * Cr, Y + 1.77200 * Cb, 1.0);
+//     }
+//
+// and samples it with sampleYCbCr(texture1Y, texture1Cb, texture1Cr, texture1Chroma, TexCoord).
+// Greyscale JPEGs get flat chroma planes, so the same shader works for them.
+class YCbCrTexture
+{
+public:
+    unsigned int ID[3];     // Y, Cb and Cr textures.
+    int width, height;      // image size.
+    bool loaded;
+    // constructor decodes the planes and uploads them. flipped says whether
+    // stbi_set_flip_vertically_on_load is on.
+    // ------------------------------------------------------------------------
+    YCbCrTexture(const char* path, bool flipped = true)
+    {
+        int planes;
+        stbi_jpeg_plane plane[3];
+        width = height = 0;
+        chromaScale[0] = chromaScale[1] = 1.0f;
+        chromaScale[2] = chromaScale[3] = 0.0f;
+        glGenTextures(3, ID);
+        unsigned char* data = stbi_jpeg_planes(path, &width, &height, &planes, plane);
+        loaded = data != NULL;
+        if (!loaded)
+        {
+            std::cout << "ERROR::TEXTURE::YCBCR_LOAD_FAILED: " << path << " (" << stbi_failure_reason() << ")" << std::endl;
+            return;
+        }
+        // plane rows are packed, not 4 byte aligned.
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        upload(ID[0], plane[0].w, plane[0].h, plane[0].data);
+        if (planes == 3)
+        {
+            upload(ID[1], plane[1].w, plane[1].h, plane[1].data);
+            upload(ID[2], plane[2].w, plane[2].h, plane[2].data);
+            // odd sized images have chroma planes a bit bigger than the image.
+            chromaScale[0] = (float)width / (plane[1].w * plane[1].sx);
+            chromaScale[1] = (float)height / (plane[1].h * plane[1].sy);
+            // flipping puts the extra at the top.
+            if (flipped)
+            {
+                chromaScale[3] = 1.0f - chromaScale[1];
+            }
+        }
+        else
+        {
+            // greyscale: no color.
+            unsigned char neutral = 128;
+            upload(ID[1], 1, 1, &neutral);
+            upload(ID[2], 1, 1, &neutral);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        stbi_image_free(data);
+    }
+    // bind the planes to texture units unit, unit+1 and unit+2 and point
+    // the shader's samplers for name at them
+    // ------------------------------------------------------------------------
+    void bind(const Shader& shader, const std::string& name, int unit) const
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit + i);
+            glBindTexture(GL_TEXTURE_2D, ID[i]);
+        }
+        shader.setInt(name + "Y", unit);
+        shader.setInt(name + "Cb", unit + 1);
+        shader.setInt(name + "Cr", unit + 2);
+        glUniform4fv(glGetUniformLocation(shader.ID, (name + "Chroma").c_str()), 1, chromaScale);
+    }
+
+private:
+    float chromaScale[4];   // chroma coordinates = uv * xy + zw.
+
+    // upload one plane as an R8 texture.
+    void upload(unsigned int texture, int w, int h, const unsigned char* pixels)
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        // clamped, so filtering at the edges doesn't pull in the other side.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, pixels);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+};
+#endif
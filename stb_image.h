@@ -32,8 +32,8 @@
       PIC (Softimage PIC)
       PNM (PPM and PGM binary only)
 
-      Animated GIF still needs a proper API, but here's one way to do it:
-          http://gist.github.com/urraka/685d9a6340b26b830d49
+      Animated GIF: all frames at once with stbi_load_gif_from_memory, or
+          one at a time with stbi_gif_stream_*
 
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
@@ -268,12 +268,292 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// On x86/x64 builds that use SSE2, the JPEG IDCT, color conversion and 2x2
+// upsampling also come in AVX2 and AVX-512 versions, and the widest one the
+// CPU and OS support is picked on the first JPEG load. These are compiled
+// with per-function target attributes, so no extra compiler flags are
+// needed, but they do need GCC 5+, clang or VC++ 2012+ (2017 15.3+ for
+// AVX-512). Define STBI_NO_AVX2 or STBI_NO_AVX512 to leave them out.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
 // ===========================================================================
 //
+// Multithreading
+//
+// Large images are decoded on a small pool of worker threads (Win32 threads
+// or pthreads) that is started the first time it is needed. The calling
+// thread always takes part in the work, and the loaders still return only
+// once the image is complete, so the API is unchanged. Currently this splits
+// JPEG entropy decoding at restart markers (when the file has them and is
+// decoded from memory), the progressive JPEG IDCT, and JPEG upsampling and
+// color conversion, which all run in row bands. Large non-interlaced PNGs are
+// inflated on one thread while another unfilters the finished scanlines,
+// which also avoids keeping the whole inflated image in memory. The HDR to
+// LDR and LDR to HDR conversions run in row bands too. The output is
+// bit-identical to a single-threaded decode.
+//
+// By default one thread per CPU is used. Call
+//
+//     stbi_set_thread_count(n);
+//
+// to use at most n threads (n=1 decodes on the calling thread only and stops
+// any running workers; n=0 restores the default). Define STBI_NO_THREADS to
+// compile out all of the threading code.
+//
+// ===========================================================================
+//
+// Loading many images at once
+//
+// To load a whole set of images, like the textures of a scene, fill in an
+// stbi_batch_item for each and hand them over together:
+//
+//     stbi_batch_item item[2];
+//     memset(item, 0, sizeof(item));
+//     item[0].filename = "wood.jpg";
+//     item[0].desired_channels = 3;
+//     item[1].buffer = png_data;    // or from memory
+//     item[1].len = png_len;
+//     item[1].desired_channels = 4;
+//     int loaded = stbi_load_batch(item, 2, done_func, done_user);
+//
+// The images are decoded at the same time, one per thread of the pool from
+// "Multithreading"; threads that run out of images help with the ones still
+// going, as they would for a single image. stbi_load_batch returns once all
+// of them are done, with the number that loaded. Each item's data, x, y and
+// channels_in_file are then what the matching stbi_load* function would
+// have returned, and if data is NULL, failure_reason says why; the images
+// are decoded on other threads, so stbi_failure_reason can't.
+//
+// type says which function that is: STBI_batch_8bit (the default) for
+// stbi_load, or STBI_batch_16bit, STBI_batch_float or STBI_batch_half for
+// stbi_load_16, stbi_loadf or stbi_loadh. Free data with stbi_image_free.
+// An 8-bit image can also go into your own memory as with stbi_load_into,
+// by setting out, out_w, out_h and out_stride; data is then out.
+//
+// done_func, if not NULL, is called with each item as soon as it has loaded
+// or failed, on the thread that decoded it, so it can be called from
+// several threads at once.
+//
+// The images are loaded with the settings of the thread that calls
+// stbi_load_batch, including the _thread ones and stbi_set_allocator_thread.
+// Without thread-local variables (or with STBI_NO_THREADS), they're loaded
+// one after the other on that thread.
+//
+// ===========================================================================
+//
+// Streaming PNG
+//
+// stbi_load returns the whole image in one buffer. To decode a PNG in a
+// small, fixed amount of memory, have it handed to you a row at a time
+// instead:
+//
+//     int row_func(void *user, int y, stbi_uc const *row)
+//     {
+//        // ... row is *x pixels of N 8-bit components, like a row of
+//        // ... stbi_load's output; y counts from the top (from the bottom
+//        // ... with stbi_set_flip_vertically_on_load). return 0 to stop
+//        return 1;
+//     }
+//
+//     ok = stbi_png_rows(filename, &x, &y, &n, 0, row_func, user);
+//
+// x, y and n are set before the first row arrives, and ok is 1 only if the
+// whole image was decoded (and no row_func returned 0). The rows come out in
+// file order; the row pointer is only good until row_func returns. The
+// compressed data is inflated as it's read, so this needs memory for about
+// 96K plus a few rows, and STBI_FILE_BUFFER_SIZE more when reading through
+// callbacks or a FILE. Interlaced PNGs are still decoded as a whole before the rows come out, so
+// they take as much memory as with stbi_load.
+//
+// ===========================================================================
+//
+// Streaming GIF frames
+//
+// stbi_load_gif_from_memory returns every frame of an animated GIF in one
+// buffer, which gets big for long animations. To decode the frames one at a
+// time instead, like to update a texture every tick:
+//
+//     stbi_gif_stream *st = stbi_gif_stream_open(filename, &x, &y, &n, 4);
+//     stbi_uc const *frame;
+//     int delay;
+//     while ((frame = stbi_gif_stream_next(st, &delay)) != NULL) {
+//        // ... frame is x*y pixels, like a layer of stbi_load_gif_from_memory;
+//        // ... show it for delay milliseconds
+//     }
+//     stbi_gif_stream_close(st);
+//
+// The first frame is decoded by stbi_gif_stream_open (or _from_memory,
+// _from_callbacks, _from_file), which returns NULL if the file isn't a GIF
+// or that frame is corrupt. stbi_gif_stream_next returns NULL after the
+// last frame, and also if a frame is corrupt; the frame pointer is only
+// good until the next call. To loop, close the stream and open it again.
+// However many frames there are, the stream holds three frames of RGBA
+// (the current one, the one it was drawn over, and the one before that for
+// GIF's "restore previous" disposal), plus one more if req_comp isn't 4 or
+// the frames are flipped.
+// stbi_set_flip_vertically_on_load applies as it was when the stream was
+// opened.
+//
+// ===========================================================================
+//
+// Decoding into your own memory
+//
+// If the pixels are going somewhere you already have, like a mapped pixel
+// buffer or a spot in a texture atlas, skip stbi_load's buffer and the copy
+// out of it:
+//
+//     ok = stbi_load_into(filename, dest, dest_w, dest_h, dest_stride, &x, &y, &n, 4);
+//
+// dest holds dest_h rows of dest_w pixels, dest_stride bytes apart (at least
+// dest_w*desired_channels). desired_channels has to be 1..4 here. The image
+// goes in the top left corner, flipped with stbi_set_flip_vertically_on_load;
+// the rest of dest is not touched. If the image is bigger than dest_w by
+// dest_h, it fails with "too large", and nothing is written for PNGs and
+// JPEGs. ok is 1 on success and 0 on failure.
+//
+// JPEGs and non-interlaced PNGs are decoded straight into dest and don't
+// need a buffer for the whole image. Other formats are loaded as usual and
+// copied in. Only 8-bit output is supported.
+//
+// ===========================================================================
+//
+// Downscaled JPEG decoding
+//
+// When a smaller version of a JPEG will do, like for a thumbnail, a low mip
+// level or a placeholder while the real image streams in, have it decoded
+// at that size directly:
+//
+//     stbi_set_jpeg_downscale(4);   // 1/4 of the width and height
+//     data = stbi_load(filename, &x, &y, &n, 0);
+//
+// The factor is 1 (full size, the default), 2, 4 or 8; others are rounded
+// down to one of those. The image comes out (w+f-1)/f by (h+f-1)/f pixels,
+// and stbi_info reports that size too, so it can be used to size the
+// memory for stbi_load_into. Each 8x8 block is turned into 4x4, 2x2 or 1x1
+// pixels by a smaller inverse DCT of its lowest frequencies, so the IDCT,
+// upsampling and color conversion only do the work for the smaller image,
+// and the memory for the decoded planes shrinks by the square of the
+// factor. The entropy decoding still has to go through all of the data
+// (the coefficients that aren't needed are just skipped). Progressive
+// JPEGs have to keep their coefficients until the last scan, but only keep
+// the ones the smaller IDCT uses, and a bit for each of the others saying
+// whether it is zero. Other formats are not affected.
+//
+// ===========================================================================
+//
+// Decoding part of an image
+//
+// To get just a rectangle out of a big image, like one tile of it:
+//
+//     data = stbi_load_region(filename, rx, ry, rw, rh, &x, &y, &n, 0);
+//
+// This returns the rw by rh pixels with (rx,ry) in the top left corner,
+// counted from the top left of the image as stbi_load would return it
+// (downscaled JPEGs count in their smaller pixels). A rectangle that hangs
+// over the right or bottom edge is cut off there, and x and y say what is
+// left; one that starts outside the image fails. With
+// stbi_set_flip_vertically_on_load, the rectangle comes out bottom row first.
+//
+// JPEGs only do the IDCT, upsampling and color conversion for the MCUs that
+// touch the rectangle (plus one more around it for subsampled chroma), and
+// only keep planes that size; progressive JPEGs only keep the coefficients
+// of those MCUs, and a bit per coefficient for the others. Entropy decoding
+// still has to go through everything up to the last row of MCUs that is
+// needed, but stops there.
+// Non-interlaced PNGs are only inflated up to the last row needed, and only
+// the rows and pixels in the rectangle are converted. Other formats, and
+// interlaced PNGs, are loaded as a whole and cropped.
+//
+// ===========================================================================
+//
+// JPEG planes
+//
+// To do a JPEG's upsampling and color conversion on the GPU, get its planes
+// as they are stored instead of RGB:
+//
+//     stbi_jpeg_plane plane[3];
+//     data = stbi_jpeg_planes(filename, &x, &y, &n, plane);
+//     // ... upload plane[i].data, plane[i].w by plane[i].h bytes with rows
+//     // ... plane[i].w bytes apart, e.g. as one-channel textures
+//     stbi_image_free(data);
+//
+// n is 3 for YCbCr JPEGs, with the Y, Cb and Cr planes in plane[0..2], and
+// 1 for greyscale ones, which only have plane[0] (the others are zeroed).
+// x and y are the size stbi_load would return. Subsampled planes are
+// smaller, e.g. 4:2:0 chroma is (x+1)/2 by (y+1)/2 with sx = sy = 2, so
+// such an image takes 1.5 bytes per pixel instead of 3. All the planes are
+// in the one block that is returned.
+//
+// Each sample sits in the middle of the sx by sy pixels it covers, like a
+// texel does, so bilinear filtering upsamples the planes. For odd sizes a
+// plane covers a bit more than the image (8 pixels for a 4 samples wide
+// plane of a 7 pixel wide image), so scale the coordinates into it by
+// x / (w * sx) and y / (h * sy). The extra is on the right and at the
+// bottom, or at the top with stbi_set_flip_vertically_on_load, where
+// v = 1 - (1 - v) * y / (h * sy) instead. With everything 0..1,
+//
+//     r = y                       + 1.40200 * (cr - 0.5)
+//     g = y - 0.34414 * (cb - 0.5) - 0.71414 * (cr - 0.5)
+//     b = y + 1.77200 * (cb - 0.5)
+//
+// stbi_set_flip_vertically_on_load and stbi_set_jpeg_downscale apply to
+// the planes as they do to stbi_load. JPEGs in RGB, CMYK or YCCK fail with
+// "not YCbCr".
+//
+// To leave the IDCT to the GPU as well, get the coefficients instead, just
+// as they were Huffman decoded:
+//
+//     stbi_jpeg_coeffs comp[3];
+//     data = stbi_jpeg_coefficients(filename, &x, &y, &n, comp);
+//
+// n, x and y are as for the planes. comp[i].coeff has comp[i].blocks_w by
+// comp[i].blocks_h blocks, row by row, of 64 coefficients each, also row
+// by row (not zigzag). They are still quantized: dequantize coefficient k
+// like the decoder does, as (short) (coeff[k] * quant[k]). The blocks cover
+// whole MCUs, so there are more of them than the comp[i].w by comp[i].h
+// samples of the plane need. With the IDCT, upsampling and color conversion
+// stb_image uses, the result is exactly stbi_load's; see stbi__idct_block,
+// stbi__resample_row_* and stbi__YCbCr_to_RGB_row. Neither the flip nor
+// the downscale apply here, and the coefficients take 2 bytes per sample.
+//
+// ===========================================================================
+//
+// Custom allocators
+//
+// Loads allocate their working memory (and the image they return) with
+// STBI_MALLOC, STBI_REALLOC and STBI_FREE, which are the same for the whole
+// program. To serve a thread's loads from somewhere else, like an arena that
+// is reset after every image, hand it an allocator:
+//
+//     void *arena_alloc(void *user, size_t size)
+//     {
+//        // ... return size bytes from the arena in user, aligned like malloc
+//     }
+//
+//     stbi_allocator arena_allocator = { arena_alloc, NULL, NULL, &arena };
+//     stbi_set_allocator_thread(&arena_allocator);
+//     ...
+//     ok = stbi_load_into(filename, dest, w, h, stride, &x, &y, &n, 4);
+//     arena_reset(&arena);
+//
+// Everything stb_image allocates on that thread goes through it until you
+// set NULL again; the allocator must still be alive then. realloc_func gets
+// the old size, and if it is NULL, a new block is allocated and the old one
+// copied and freed instead. If free_func is NULL, nothing is freed. The
+// worker threads from "Multithreading" never allocate, so the allocator is
+// only ever called from the thread that set it and needs no locking.
+//
+// An image returned while an allocator is set comes from it too: give it
+// back to that allocator (stbi_image_free does so while it is still set),
+// or use stbi_load_into or stbi_png_rows so only working memory is
+// allocated. If your compiler doesn't support thread-local variables, the
+// allocator applies to all threads.
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -286,7 +566,9 @@ RECENT REVISION HISTORY:
 //     stbi_hdr_to_ldr_scale(1.0f);
 //
 // (note, do not use _inverse_ constants; stbi_image will invert them
-// appropriately).
+// appropriately). The gamma is applied with a fast approximation of pow()
+// rather than pow() itself; about one value in a million comes out one
+// step off in the 8-bit result.
 //
 // Additionally, there is a new, parallel interface for loading files as
 // (linear) floats to preserve the full dynamic range:
@@ -300,6 +582,16 @@ RECENT REVISION HISTORY:
 //     stbi_ldr_to_hdr_scale(1.0f);
 //     stbi_ldr_to_hdr_gamma(2.2f);
 //
+// To keep half the memory, stbi_loadh returns the same values as IEEE 754
+// half floats instead, rounded to nearest even, ready for a GL_RGBA16F
+// texture with GL_HALF_FLOAT data:
+//
+//    stbi_us *data = stbi_loadh(filename, &x, &y, &n, 4);
+//
+// .hdr files are converted a scanline at a time, so the floats are never
+// all in memory. Values above 65504 become infinity. CPUs with F16C do the
+// conversion in hardware, with the same results.
+//
 // Finally, given a filename (or an open file or memory block--see header
 // file for details) containing image data, you can query for the "most
 // appropriate" interface to use (that is, whether the image is HDR or
@@ -356,6 +648,18 @@ RECENT REVISION HISTORY:
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
+//  - If you define STBI_NO_THREADS, all decoding happens on the calling
+//    thread and no worker threads are ever created.
+//
+//  - stbi_load and the other functions that load a whole file by name map
+//    the file into memory where the OS supports it (Linux and other Unixes)
+//    and decode it like stbi_load_from_memory, which avoids the many small
+//    reads of the FILE* path and lets JPEGs with restart markers decode in
+//    parallel. Elsewhere, or if mapping fails, the file is read through a
+//    buffer of STBI_FILE_BUFFER_SIZE bytes (default 64K), which you can
+//    #define to something else. #define STBI_NO_MMAP to never map files;
+//    a mapped file that is truncated while it is being loaded may crash.
+//
 //  - If you define STBI_MAX_DIMENSIONS, stb_image will reject images greater
 //    than that size (in either width or height) without further processing.
 //    This is to let programs in the wild set an upper bound to prevent
@@ -427,8 +731,76 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+// decode into your own memory instead, see "Decoding into your own memory"
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into          (char const *filename, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_into_from_file(FILE *f,              stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// decode just a rectangle of the image, see "Decoding part of an image"
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region          (char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f,              int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+#ifndef STBI_NO_PNG
+// PNG only: decode a row at a time instead of into one buffer, see "Streaming PNG"
+typedef int stbi_png_row_func(void *user, int y, stbi_uc const *row);
+STBIDEF int stbi_png_rows_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_png_row_func *func, void *func_user);
+STBIDEF int stbi_png_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_png_row_func *func, void *func_user);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_png_rows          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_png_row_func *func, void *func_user);
+STBIDEF int stbi_png_rows_from_file(FILE *f,              int *x, int *y, int *channels_in_file, int desired_channels, stbi_png_row_func *func, void *func_user);
+#endif
+#endif
+
+#ifndef STBI_NO_JPEG
+// JPEG only: the Y, Cb and Cr planes without upsampling or color conversion, see "JPEG planes"
+typedef struct
+{
+   stbi_uc *data;   // w*h bytes, in the block that was returned
+   int w, h;
+   int sx, sy;      // each sample covers sx by sy pixels of the image
+} stbi_jpeg_plane;
+STBIDEF stbi_uc *stbi_jpeg_planes_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *planes, stbi_jpeg_plane plane[3]);
+STBIDEF stbi_uc *stbi_jpeg_planes_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *planes, stbi_jpeg_plane plane[3]);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_jpeg_planes          (char const *filename, int *x, int *y, int *planes, stbi_jpeg_plane plane[3]);
+STBIDEF stbi_uc *stbi_jpeg_planes_from_file(FILE *f,              int *x, int *y, int *planes, stbi_jpeg_plane plane[3]);
+#endif
+// or their quantized DCT coefficients, without the IDCT either
+typedef struct
+{
+   short *coeff;             // blocks_w*blocks_h blocks of 64, in the block that was returned
+   stbi_us quant[64];        // dequantization table, in the same order as each block
+   int blocks_w, blocks_h;
+   int w, h;                 // samples in the image, like stbi_jpeg_plane
+   int sx, sy;
+} stbi_jpeg_coeffs;
+STBIDEF short *stbi_jpeg_coefficients_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3]);
+STBIDEF short *stbi_jpeg_coefficients_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3]);
+#ifndef STBI_NO_STDIO
+STBIDEF short *stbi_jpeg_coefficients          (char const *filename, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3]);
+STBIDEF short *stbi_jpeg_coefficients_from_file(FILE *f,              int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3]);
+#endif
+#endif
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
+// or one frame at a time, see "Streaming GIF frames"
+typedef struct stbi_gif_stream stbi_gif_stream;
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, int req_comp);
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, int req_comp);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_stream *stbi_gif_stream_open     (char const *filename, int *x, int *y, int *comp, int req_comp);
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_file(FILE *f,              int *x, int *y, int *comp, int req_comp);
+#endif
+STBIDEF stbi_uc const   *stbi_gif_stream_next (stbi_gif_stream *st, int *delay);
+STBIDEF void             stbi_gif_stream_close(stbi_gif_stream *st);
 #endif
 
 #ifdef STBI_WINDOWS_UTF8
@@ -460,6 +832,15 @@ STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_i
    STBIDEF float *stbi_loadf            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
    STBIDEF float *stbi_loadf_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
    #endif
+
+   // the same as IEEE half floats (the bits of each), see stbi_loadh
+   STBIDEF stbi_us *stbi_loadh_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+   STBIDEF stbi_us *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y,  int *channels_in_file, int desired_channels);
+
+   #ifndef STBI_NO_STDIO
+   STBIDEF stbi_us *stbi_loadh          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+   STBIDEF stbi_us *stbi_loadh_from_file(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
+   #endif
 #endif
 
 #ifndef STBI_NO_HDR
@@ -515,12 +896,62 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// decode JPEGs at 1/factor of their size; factor is 1, 2, 4 or 8. see
+// "Downscaled JPEG decoding"
+STBIDEF void stbi_set_jpeg_downscale(int factor);
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
 STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+STBIDEF void stbi_set_jpeg_downscale_thread(int factor);
+
+// use at most this many threads (including the calling one) to decode an
+// image; 0 means one per CPU, which is the default. see "Multithreading"
+STBIDEF void stbi_set_thread_count(int count);
+
+// load many images at once on those threads, see "Loading many images at once"
+enum
+{
+   STBI_batch_8bit = 0,   // stbi_load, or stbi_load_into if out is set
+   STBI_batch_16bit,      // stbi_load_16
+   STBI_batch_float,      // stbi_loadf
+   STBI_batch_half        // stbi_loadh
+};
+
+typedef struct
+{
+   // set by you: a file name, or if that's NULL, the file in memory
+   char const    *filename;
+   stbi_uc const *buffer;
+   int            len;
+   int            type;              // STBI_batch_*
+   int            desired_channels;
+   stbi_uc       *out;               // STBI_batch_8bit only, NULL to allocate
+   int            out_w, out_h, out_stride;
+
+   // set by stbi_load_batch
+   void          *data;              // NULL if the image didn't load
+   int            x, y, channels_in_file;
+   char const    *failure_reason;    // NULL if it did
+} stbi_batch_item;
+
+typedef void stbi_batch_done_func(void *user, stbi_batch_item *item);
+STBIDEF int stbi_load_batch(stbi_batch_item *items, int count, stbi_batch_done_func *done_func, void *done_user);
+
+// get all memory for loads on the calling thread from your own allocator
+// instead of STBI_MALLOC etc.; NULL goes back to those. see "Custom allocators"
+typedef struct
+{
+   void *(*malloc_func) (void *user, size_t size);
+   void *(*realloc_func)(void *user, void *p, size_t old_size, size_t new_size); // optional
+   void  (*free_func)   (void *user, void *p);                                     // optional
+   void *user;
+} stbi_allocator;
+
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator);
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -588,14 +1019,35 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <string.h>
 #include <limits.h>
 
-#if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
-#include <math.h>  // ldexp, pow
+#ifndef STBI_NO_LINEAR
+#include <math.h>  // pow
 #endif
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif
 
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__unix) || defined(__APPLE__))
+#define STBI__MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef STBI_NO_THREADS
+   #if defined(_WIN32)
+      #define STBI__WIN32_THREADS
+      #include <windows.h>
+   #elif defined(__unix__) || defined(__unix) || defined(__APPLE__)
+      #define STBI__PTHREADS
+      #include <pthread.h>
+      #include <unistd.h> // sysconf
+   #else
+      #define STBI_NO_THREADS
+   #endif
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -618,6 +1070,16 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #define stbi_inline __forceinline
 #endif
 
+// for the small pieces the SIMD kernels are built from, which only pay off
+// inlined, where their constants can be hoisted out of the loops
+#if defined(_MSC_VER)
+   #define stbi__forceinline __forceinline
+#elif defined(__GNUC__)
+   #define stbi__forceinline __inline__ __attribute__((always_inline))
+#else
+   #define stbi__forceinline stbi_inline
+#endif
+
 #ifndef STBI_NO_THREAD_LOCALS
    #if defined(__cplusplus) &&  __cplusplus >= 201103L
       #define STBI_THREAD_LOCAL       thread_local
@@ -641,12 +1103,18 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__uint64;
+#else
+typedef unsigned long long stbi__uint64;
+#endif
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -658,16 +1126,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (-(y) & 31)))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -748,7 +1206,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -759,7 +1217,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -772,6 +1230,88 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 / AVX-512 (F+BW) versions of some kernels are built next to the SSE2
+// ones and picked at run time from cpuid, so a plain x86/x64 build can use
+// them. This needs a compiler that can target them per function rather than
+// through -mavx2 etc.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if defined(__clang__) || defined(__GNUC__)
+#if (defined(__clang__) && ((defined(__apple_build_version__) && __clang_major__ >= 9) || (!defined(__apple_build_version__) && __clang_major__ >= 4))) \
+    || (!defined(__clang__) && __GNUC__ >= 5)
+#define STBI__AVX2
+#define STBI__TARGET_AVX2    __attribute__((target("avx2")))
+#define STBI__TARGET_F16C    __attribute__((target("avx,f16c")))
+#ifndef STBI_NO_AVX512
+#define STBI__AVX512
+#define STBI__TARGET_AVX512  __attribute__((target("avx2,avx512f,avx512bw")))
+#endif
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#elif defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI__AVX2
+#define STBI__TARGET_AVX2
+#define STBI__TARGET_F16C
+#if _MSC_VER >= 1911 && !defined(STBI_NO_AVX512)
+#define STBI__AVX512
+#define STBI__TARGET_AVX512
+#endif
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(STBI__AVX2) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_LINEAR))
+static void stbi__cpuidex(int leaf, int subleaf, int info[4])
+{
+#ifdef _MSC_VER
+   __cpuidex(info, leaf, subleaf);
+#else
+   unsigned int a,b,c,d;
+   __cpuid_count(leaf, subleaf, a, b, c, d);
+   info[0] = (int) a;
+   info[1] = (int) b;
+   info[2] = (int) c;
+   info[3] = (int) d;
+#endif
+}
+
+// XCR0, i.e. which register sets the OS saves on context switches
+static unsigned int stbi__xgetbv0(void)
+{
+#ifdef _MSC_VER
+   return (unsigned int) _xgetbv(0);
+#else
+   unsigned int a,d;
+   __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0" : "=a"(a), "=d"(d) : "c"(0));
+   return a;
+#endif
+}
+#endif
+
+#if defined(STBI__AVX2) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG))
+// 0 = neither, 1 = AVX2, 2 = AVX2 and AVX-512 (F+BW)
+static int stbi__avx_level(void)
+{
+   int info[4], ecx1, ebx7, level = 0;
+   unsigned int xcr0;
+   stbi__cpuidex(0, 0, info);
+   if (info[0] < 7) return 0;
+   stbi__cpuidex(1, 0, info);
+   ecx1 = info[2];
+   if (!(ecx1 & (1<<27)) || !(ecx1 & (1<<28))) return 0; // OSXSAVE, AVX
+   stbi__cpuidex(7, 0, info);
+   ebx7 = info[1];
+   xcr0 = stbi__xgetbv0();
+   if ((xcr0 & 0x06) == 0x06 && (ebx7 & (1<<5)))
+      level = 1;
+#ifdef STBI__AVX512
+   if (level && (xcr0 & 0xe6) == 0xe6 && (ebx7 & (1<<16)) && (ebx7 & (1<<30)))
+      level = 2;
+#endif
+   return level;
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -794,22 +1334,42 @@ static int stbi__sse2_available(void)
 #define STBI_MAX_DIMENSIONS (1 << 24)
 #endif
 
+#ifndef STBI_FILE_BUFFER_SIZE
+#define STBI_FILE_BUFFER_SIZE (1 << 16)
+#endif
+
 ///////////////////////////////////////////////
 //
 //  stbi__context struct and start_xxx functions
 
+// caller memory to decode into, see stbi_load_into
+typedef struct
+{
+   stbi_uc *out;
+   int w, h, stride;
+} stbi__into;
+
+// the part of the image to decode, see stbi_load_region
+typedef struct
+{
+   int x, y, w, h;
+} stbi__region;
+
 // stbi__context structure is our basic context used by all images, so it
 // contains all the IO context, plus some basic image information
 typedef struct
 {
    stbi__uint32 img_x, img_y;
    int img_n, img_out_n;
+   stbi__into *into;   // if set, loaders that can write the final image here do
+   stbi__region *region; // if set, loaders that can decode just this part do
 
    stbi_io_callbacks io;
    void *io_user_data;
 
    int read_from_callbacks;
    int buflen;
+   stbi_uc *buffer;    // buffer_start, or a bigger one of buflen bytes
    stbi_uc buffer_start[128];
    int callback_already_read;
 
@@ -826,23 +1386,34 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->into = NULL;
+   s->region = NULL;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
 
-// initialize a callback-based context
-static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+// initialize a callback-based context that reads into 'buffer'
+static void stbi__start_callbacks_buffer(stbi__context *s, stbi_io_callbacks *c, void *user, stbi_uc *buffer, int buflen)
 {
    s->io = *c;
    s->io_user_data = user;
-   s->buflen = sizeof(s->buffer_start);
+   s->buffer = buffer;
+   s->buflen = buflen;
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
-   s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->into = NULL;
+   s->region = NULL;
+   s->img_buffer = s->img_buffer_original = s->buffer;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
 
+// initialize a callback-based context
+static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+{
+   stbi__start_callbacks_buffer(s, c, user, s->buffer_start, sizeof(s->buffer_start));
+}
+
 #ifndef STBI_NO_STDIO
 
 static int stbi__stdio_read(void *user, char *data, int size)
@@ -901,6 +1472,8 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped;   // the loader already applied stbi__vertically_flip_on_load
+   int cropped;   // the loader already cut the image down to s->region
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -911,7 +1484,7 @@ static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
 
 #ifndef STBI_NO_PNG
 static int      stbi__png_test(stbi__context *s);
-static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc);
 static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__png_is16(stbi__context *s);
 #endif
@@ -938,6 +1511,7 @@ static int      stbi__psd_is16(stbi__context *s);
 #ifndef STBI_NO_HDR
 static int      stbi__hdr_test(stbi__context *s);
 static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static void    *stbi__hdr_load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, int half);
 static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -980,11 +1554,51 @@ static int stbi__err(const char *str)
 }
 #endif
 
+// where the allocations of the calling thread go, see "Custom allocators"
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi_allocator const *stbi__g_allocator;
+
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator)
+{
+   stbi__g_allocator = allocator;
+}
+
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+   stbi_allocator const *a = stbi__g_allocator;
+   if (a) return a->malloc_func(a->user, size);
+   return STBI_MALLOC(size);
+}
+
+static void stbi__free(void *p)
+{
+   stbi_allocator const *a = stbi__g_allocator;
+   if (!a)
+      STBI_FREE(p);
+   else if (p && a->free_func)
+      a->free_func(a->user, p);
 }
 
+// only built if some decoder uses it
+#if !defined(STBI_NO_ZLIB) || !defined(STBI_NO_GIF)
+static void *stbi__realloc_sized(void *p, size_t old_size, size_t new_size)
+{
+   stbi_allocator const *a = stbi__g_allocator;
+   void *q;
+   if (!a) return STBI_REALLOC_SIZED(p, old_size, new_size);
+   if (a->realloc_func) return a->realloc_func(a->user, p, old_size, new_size);
+   q = a->malloc_func(a->user, new_size);
+   if (q && p) {
+      memcpy(q, p, old_size < new_size ? old_size : new_size);
+      stbi__free(p);
+   }
+   return q;
+}
+#endif
+
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
 // current code, even on 64-bit targets, is INT_MAX. this is not a
@@ -1017,7 +1631,7 @@ static int stbi__mul2sizes_valid(int a, int b)
    return a <= INT_MAX/b;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
 static int stbi__mad2sizes_valid(int a, int b, int add)
 {
@@ -1041,7 +1655,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1098,11 +1712,15 @@ static int stbi__mul2shorts_valid(short a, short b)
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
-   STBI_FREE(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_LINEAR
 static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+static void    *stbi__ldr_to_linear(stbi_uc *data, int x, int y, int comp, int half);
+#if defined(STBI__AVX2) && !defined(STBI_NO_HDR)
+static int      stbi__f16c_available(void);
+#endif
 #endif
 
 #ifndef STBI_NO_HDR
@@ -1132,6 +1750,29 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+static int stbi__jpeg_downscale_global = 1;
+
+STBIDEF void stbi_set_jpeg_downscale(int factor)
+{
+   stbi__jpeg_downscale_global = factor;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__jpeg_downscale  stbi__jpeg_downscale_global
+#else
+static STBI_THREAD_LOCAL int stbi__jpeg_downscale_local, stbi__jpeg_downscale_set;
+
+STBIDEF void stbi_set_jpeg_downscale_thread(int factor)
+{
+   stbi__jpeg_downscale_local = factor;
+   stbi__jpeg_downscale_set = 1;
+}
+
+#define stbi__jpeg_downscale  (stbi__jpeg_downscale_set                         \
+                                ? stbi__jpeg_downscale_local                    \
+                                : stbi__jpeg_downscale_global)
+#endif // STBI_THREAD_LOCAL
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1142,7 +1783,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    // test the formats with a very explicit header first (at least a FOURCC
    // or distinctive magic number first)
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri, bpc);
    #endif
    #ifndef STBI_NO_BMP
    if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
@@ -1197,7 +1838,7 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1213,10 +1854,40 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
+// clip r to a w by h image; fails if nothing of it is left
+static int stbi__clip_region(stbi__region *r, int w, int h)
+{
+   if (r->x >= w || r->y >= h) return stbi__err("bad region", "Region outside the image");
+   if (r->w > w - r->x) r->w = w - r->x;
+   if (r->h > h - r->y) r->h = h - r->y;
+   return 1;
+}
+
+// cut region r out of a w by h image with n bytes per pixel, which is freed.
+// if the image was flipped already, so is the region's place in it
+static stbi_uc *stbi__crop_region(stbi_uc *image, int *w, int *h, int n, stbi__region *r, int flipped)
+{
+   stbi_uc *out = NULL;
+   int j;
+   if (stbi__clip_region(r, *w, *h)) {
+      int y = flipped ? *h - r->y - r->h : r->y;
+      out = (stbi_uc *) stbi__malloc_mad3(r->w, r->h, n, 0);
+      if (out) {
+         for (j=0; j < r->h; ++j)
+            memcpy(out + (size_t) r->w * n * j, image + ((size_t) *w * (y + j) + r->x) * n, (size_t) r->w * n);
+         *w = r->w;
+         *h = r->h;
+      } else
+         stbi__err("outofmem", "Out of memory");
+   }
+   stbi__free(image);
+   return out;
+}
+
 static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
 {
    int row;
@@ -1263,6 +1934,10 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    if (result == NULL)
       return NULL;
 
+   // loaders that decode into caller memory do all of the below themselves
+   if (s->into && result == s->into->out)
+      return (unsigned char *) result;
+
    // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
    STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
@@ -1273,7 +1948,13 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   // for loaders that can't decode just part of the image
+   if (s->region && !ri.cropped) {
+      result = stbi__crop_region((stbi_uc *) result, x, y, req_comp ? req_comp : *comp, s->region, stbi__vertically_flip_on_load && ri.flipped);
+      if (result == NULL) return NULL;
+   }
+
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1300,7 +1981,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1318,6 +1999,52 @@ static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, in
 }
 #endif
 
+// JPEG and PNG decode straight into the caller's memory; everything else is
+// loaded as usual and copied
+static int stbi__load_into_main(stbi__context *s, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__into into;
+   stbi_uc *result;
+   int j, row_bytes;
+
+   if (req_comp < 1 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (out_w < 0 || out_h < 0 || !stbi__mul2sizes_valid(out_w, req_comp) || out_stride < out_w * req_comp)
+      return stbi__err("bad stride", "Destination row stride too small");
+   into.out = out;
+   into.w = out_w;
+   into.h = out_h;
+   into.stride = out_stride;
+   s->into = &into;
+
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result == NULL) return 0;
+   if (result == out) return 1;
+
+   if (*x > out_w || *y > out_h) {
+      stbi__free(result);
+      return stbi__err("too large", "Image bigger than the destination");
+   }
+   row_bytes = *x * req_comp;
+   for (j=0; j < *y; ++j)
+      memcpy(out + (size_t) out_stride * j, result + (size_t) row_bytes * j, row_bytes);
+   stbi__free(result);
+   return 1;
+}
+
+// JPEG and non-interlaced PNG only decode the region; everything else is
+// loaded as usual and cropped
+static stbi_uc *stbi__load_region_main(stbi__context *s, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__region region;
+   if (rx < 0 || ry < 0 || rw <= 0 || rh <= 0) return stbi__errpuc("bad region", "Region outside the image");
+   region.x = rx;
+   region.y = ry;
+   region.w = rw;
+   region.h = rh;
+   s->region = &region;
+   return stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+}
+
 #ifndef STBI_NO_STDIO
 
 #if defined(_WIN32) && defined(STBI_WINDOWS_UTF8)
@@ -1360,14 +2087,77 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+// a file opened by stbi__open_file
+typedef struct
+{
+   FILE *f;
+   stbi_uc *buffer;
+   void *map;
+   size_t map_len;
+} stbi__file;
+
+// start s on a whole file by name. where we can, the file is mapped and
+// decoded just like memory; otherwise it's read through a big buffer
+static int stbi__open_file(stbi__context *s, stbi__file *file, char const *filename)
+{
+   file->f = NULL;
+   file->buffer = NULL;
+   file->map = NULL;
+#ifdef STBI__MMAP
+   {
+      struct stat st;
+      int fd = open(filename, O_RDONLY);
+      if (fd >= 0) {
+         if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX) {
+            void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+               // the decoders read front to back, mostly through all of it
+               #ifdef MADV_SEQUENTIAL
+               madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+               madvise(p, (size_t) st.st_size, MADV_WILLNEED);
+               #endif
+               file->map = p;
+               file->map_len = (size_t) st.st_size;
+            }
+         }
+         close(fd);
+         if (file->map) {
+            stbi__start_mem(s, (stbi_uc *) file->map, (int) file->map_len);
+            return 1;
+         }
+      }
+   }
+#endif
+   file->f = stbi__fopen(filename, "rb");
+   if (!file->f) return 0;
+   // the format tests rewind within the first buffer, so it can't be smaller
+   if (STBI_FILE_BUFFER_SIZE > sizeof(s->buffer_start))
+      file->buffer = (stbi_uc *) stbi__malloc(STBI_FILE_BUFFER_SIZE);
+   if (file->buffer)
+      stbi__start_callbacks_buffer(s, &stbi__stdio_callbacks, (void *) file->f, file->buffer, STBI_FILE_BUFFER_SIZE);
+   else
+      stbi__start_file(s, file->f);
+   return 1;
+}
+
+static void stbi__close_file(stbi__file *file)
+{
+#ifdef STBI__MMAP
+   if (file->map) munmap(file->map, file->map_len);
+#endif
+   if (file->f) fclose(file->f);
+   stbi__free(file->buffer);
+}
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi__file file;
    unsigned char *result;
-   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
@@ -1384,12 +2174,12 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
-STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
+STBIDEF int stbi_load_into_from_file(FILE *f, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *comp, int req_comp)
 {
-   stbi__uint16 *result;
+   int result;
    stbi__context s;
    stbi__start_file(&s,f);
-   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   result = stbi__load_into_main(&s,out,out_w,out_h,out_stride,x,y,comp,req_comp);
    if (result) {
       // need to 'unget' all the characters in the IO buffer
       fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
@@ -1397,20 +2187,69 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
    return result;
 }
 
-STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
-   stbi__uint16 *result;
-   if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file_16(f,x,y,comp,req_comp);
-   fclose(f);
+   stbi__context s;
+   stbi__file file;
+   int result;
+   if (!stbi__open_file(&s, &file, filename)) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi__load_into_main(&s,out,out_w,out_h,out_stride,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
-
-#endif //!STBI_NO_STDIO
-
-STBIDEF stbi_us *stbi_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels)
+STBIDEF stbi_uc *stbi_load_region_from_file(FILE *f, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__file file;
+   unsigned char *result;
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__uint16 *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__file file;
+   stbi__uint16 *result;
+   if (!stbi__open_file(&s, &file, filename)) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_us *stbi_load_16_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels)
 {
    stbi__context s;
    stbi__start_mem(&s,buffer,len);
@@ -1438,6 +2277,34 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into_main(&s,out,out_w,out_h,out_stride,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_w, int out_h, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into_main(&s,out,out_w,out_h,out_stride,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region_main(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1446,8 +2313,8 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
    stbi__start_mem(&s,buffer,len);
 
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
-      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+   if (stbi__vertically_flip_on_load && result) {
+      stbi__vertical_flip_slices( result, *x, *y, *z, req_comp ? req_comp : *comp );
    }
 
    return result;
@@ -1490,11 +2357,12 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 #ifndef STBI_NO_STDIO
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
+   stbi__context s;
+   stbi__file file;
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
-   if (!f) return stbi__errpf("can't fopen", "Unable to open file");
-   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpf("can't fopen", "Unable to open file");
+   result = stbi__loadf_main(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
@@ -1506,6 +2374,62 @@ STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_
 }
 #endif // !STBI_NO_STDIO
 
+static stbi__uint16 *stbi__loadh_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *data;
+   #ifndef STBI_NO_HDR
+   if (stbi__hdr_test(s)) {
+      int half = 1;
+      stbi__uint16 *hdr_data;
+      #ifdef STBI__AVX2
+      if (stbi__f16c_available()) half = 2;
+      #endif
+      hdr_data = (stbi__uint16 *) stbi__hdr_load_main(s,x,y,comp,req_comp,half);
+      if (hdr_data && stbi__vertically_flip_on_load)
+         stbi__vertical_flip(hdr_data, *x, *y, (req_comp ? req_comp : 3) * 2);
+      return hdr_data;
+   }
+   #endif
+   data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (data)
+      return (stbi__uint16 *) stbi__ldr_to_linear(data, *x, *y, req_comp ? req_comp : *comp, 1);
+   return (stbi__uint16 *) stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
+}
+
+STBIDEF stbi_us *stbi_loadh_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__loadh_main(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_us *stbi_loadh_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__loadh_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_us *stbi_loadh(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__file file;
+   stbi_us *result;
+   if (!stbi__open_file(&s, &file, filename)) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__loadh_main(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF stbi_us *stbi_loadh_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_file(&s,f);
+   return stbi__loadh_main(&s,x,y,comp,req_comp);
+}
+#endif // !STBI_NO_STDIO
+
 #endif // !STBI_NO_LINEAR
 
 // these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
@@ -1589,23 +2513,24 @@ enum
 {
    STBI__SCAN_load=0,
    STBI__SCAN_type,
-   STBI__SCAN_header
+   STBI__SCAN_header,
+   STBI__SCAN_rows     // PNG only: load, handing the rows to a stbi__png_stream
 };
 
 static void stbi__refill_buffer(stbi__context *s)
 {
-   int n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
+   int n = (s->io.read)(s->io_user_data,(char*)s->buffer,s->buflen);
    s->callback_already_read += (int) (s->img_buffer - s->img_buffer_original);
    if (n == 0) {
       // at end of file, treat same as if from memory, but need to handle case
       // where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
       s->read_from_callbacks = 0;
-      s->img_buffer = s->buffer_start;
-      s->img_buffer_end = s->buffer_start+1;
+      s->img_buffer = s->buffer;
+      s->img_buffer_end = s->buffer+1;
       *s->img_buffer = 0;
    } else {
-      s->img_buffer = s->buffer_start;
-      s->img_buffer_end = s->buffer_start + n;
+      s->img_buffer = s->buffer;
+      s->img_buffer_end = s->buffer + n;
    }
 }
 
@@ -1750,9 +2675,39 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+// convert x pixels of img_n components to req_comp components; returns 0 if
+// the conversion isn't supported
+static int stbi__convert_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
+#if !defined(STBI_NO_PNG) || !defined(STBI_NO_PSD) || !defined(STBI_NO_GIF) || !defined(STBI_NO_PIC) || !defined(STBI_NO_PNM)
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1760,40 +2715,23 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+      if (!stbi__convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         stbi__free(data);
+         stbi__free(good);
+         return stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
+   }
+
+   stbi__free(data);
    return good;
 }
 #endif
+#endif
 
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
@@ -1807,9 +2745,36 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+static int stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1817,220 +2782,734 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
-   return good;
-}
-#endif
-
-#ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
-{
-   int i,k,n;
-   float *output;
-   if (!data) return NULL;
-   output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
-   // compute number of non-alpha components
-   if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+      if (!stbi__convert_row16(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         stbi__free(data);
+         stbi__free(good);
+         return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
    }
-   if (n < comp) {
-      for (i=0; i < x*y; ++i) {
-         output[i*comp + n] = data[i*comp + n]/255.0f;
-      }
-   }
-   STBI_FREE(data);
-   return output;
-}
-#endif
 
-#ifndef STBI_NO_HDR
-#define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
-{
-   int i,k,n;
-   stbi_uc *output;
-   if (!data) return NULL;
-   output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
-   // compute number of non-alpha components
-   if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
-      }
-      if (k < comp) {
-         float z = data[i*comp+k] * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
-      }
-   }
-   STBI_FREE(data);
-   return output;
+   stbi__free(data);
+   return good;
 }
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
 //
-//  "baseline" JPEG/JFIF decoder
+//  worker thread pool
 //
-//    simple implementation
-//      - doesn't support delayed output of y-dimension
-//      - simple interface (only one output format: 8-bit interleaved RGB)
-//      - doesn't try to recover corrupt jpegs
-//      - doesn't allow partial loading, loading multiple at once
-//      - still fast on x86 (copying globals into locals doesn't help x86)
-//      - allocates lots of intermediate memory (full size of all components)
-//        - non-interleaved case requires this anyway
-//        - allows good upsampling (see next)
-//    high-quality
-//      - upsampled channels are bilinearly interpolated, even across blocks
-//      - quality integer IDCT derived from IJG's 'slow'
-//    performance
-//      - fast huffman; reasonable integer IDCT
-//      - some SIMD kernels for common paths on targets with SSE2/NEON
-//      - uses a lot of intermediate memory, could cache poorly
+//    - workers are started lazily and live until stbi_set_thread_count
+//      asks for fewer of them
+//    - work is handed out as "groups" of numbered jobs; the thread that
+//      submits a group works on it too, so nested groups can't deadlock
+//    - jobs must not allocate; anything they need is set up by the
+//      submitting thread, and failures are passed back to it in the job
+//      data rather than through stbi__err (which is per-thread). the
+//      exception is stbi_load_batch, whose jobs are whole loads that take
+//      on the submitting thread's settings first
+//    - jobs of one group may wait for each other on stbi__pool_event, but
+//      only for a job that is already running and doesn't wait back
 
-#ifndef STBI_NO_JPEG
+#define STBI__MAX_THREADS  64
 
-// huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+typedef void (*stbi__job_func)(void *user, int index);
 
-typedef struct
-{
-   stbi_uc  fast[1 << FAST_BITS];
-   // weirdly, repacking this into AoS is a 10% speed loss, instead of a win
-   stbi__uint16 code[256];
-   stbi_uc  values[256];
-   stbi_uc  size[257];
-   unsigned int maxcode[18];
-   int    delta[17];   // old 'firstsymbol' - old 'firstcode'
-} stbi__huffman;
+#ifdef STBI_NO_THREADS
 
-typedef struct
+STBIDEF void stbi_set_thread_count(int count)
 {
-   stbi__context *s;
-   stbi__huffman huff_dc[4];
-   stbi__huffman huff_ac[4];
-   stbi__uint16 dequant[4][64];
-   stbi__int16 fast_ac[4][1 << FAST_BITS];
+   STBI_NOTUSED(count);
+}
 
-// sizes for components, interleaved MCUs
-   int img_h_max, img_v_max;
-   int img_mcu_x, img_mcu_y;
-   int img_mcu_w, img_mcu_h;
+static int stbi__thread_count(void)
+{
+   return 1;
+}
 
-// definition of jpeg image component
-   struct
-   {
-      int id;
-      int h,v;
-      int tq;
-      int hd,ha;
-      int dc_pred;
+static void stbi__parallel_for(stbi__job_func func, void *user, int count)
+{
+   int i;
+   for (i=0; i < count; ++i)
+      func(user, i);
+}
 
-      int x,y,w2,h2;
-      stbi_uc *data;
-      void *raw_data, *raw_coeff;
-      stbi_uc *linebuf;
-      short   *coeff;   // progressive only
-      int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
-   } img_comp[4];
+#else // !STBI_NO_THREADS
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
-   int            code_bits;   // number of valid bits
-   unsigned char  marker;      // marker seen while filling entropy buffer
-   int            nomore;      // flag if we saw a marker so must stop
+typedef struct stbi__job_group
+{
+   stbi__job_func func;
+   void *user;
+   int count;  // number of jobs
+   int next;   // next job to hand out
+   int done;   // number of jobs finished
+   struct stbi__job_group *queue_next;
+} stbi__job_group;
 
-   int            progressive;
-   int            spec_start;
-   int            spec_end;
-   int            succ_high;
-   int            succ_low;
-   int            eob_run;
-   int            jfif;
-   int            app14_color_transform; // Adobe APP14 tag
-   int            rgb;
+#ifdef STBI__WIN32_THREADS
+static SRWLOCK            stbi__pool_mutex = SRWLOCK_INIT;
+static CONDITION_VARIABLE stbi__pool_work  = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE stbi__pool_done  = CONDITION_VARIABLE_INIT;
+#ifndef STBI_NO_PNG // only the PNG pipeline waits on it
+static CONDITION_VARIABLE stbi__pool_event = CONDITION_VARIABLE_INIT;
+#endif
+#define stbi__pool_lock()    AcquireSRWLockExclusive(&stbi__pool_mutex)
+#define stbi__pool_unlock()  ReleaseSRWLockExclusive(&stbi__pool_mutex)
+#define stbi__pool_wait(cv)  SleepConditionVariableSRW(&(cv), &stbi__pool_mutex, INFINITE, 0)
+#define stbi__pool_wake(cv)  WakeAllConditionVariable(&(cv))
+#else
+static pthread_mutex_t stbi__pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  stbi__pool_work  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  stbi__pool_done  = PTHREAD_COND_INITIALIZER;
+#ifndef STBI_NO_PNG // only the PNG pipeline waits on it
+static pthread_cond_t  stbi__pool_event = PTHREAD_COND_INITIALIZER;
+#endif
+#define stbi__pool_lock()    pthread_mutex_lock(&stbi__pool_mutex)
+#define stbi__pool_unlock()  pthread_mutex_unlock(&stbi__pool_mutex)
+#define stbi__pool_wait(cv)  pthread_cond_wait(&(cv), &stbi__pool_mutex)
+#define stbi__pool_wake(cv)  pthread_cond_broadcast(&(cv))
+#endif
 
-   int scan_n, order[4];
-   int restart_interval, todo;
+// all of these are protected by stbi__pool_mutex
+static stbi__job_group *stbi__pool_queue;   // groups that still have jobs to hand out
+static int stbi__pool_workers;              // number of running worker threads
+static int stbi__pool_retire;               // number of workers asked to exit
 
-// kernels
-   void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
-   void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
-   stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
-} stbi__jpeg;
+static int stbi__thread_count_setting;      // 0 = one per CPU
+static int stbi__cpu_count;                 // cached, 0 = not queried yet
 
-static int stbi__build_huffman(stbi__huffman *h, int *count)
+// the caller holds the lock
+static int stbi__pool_thread_count(void)
 {
-   int i,j,k=0;
-   unsigned int code;
-   // build size list for each symbol (from JPEG spec)
-   for (i=0; i < 16; ++i) {
-      for (j=0; j < count[i]; ++j) {
-         h->size[k++] = (stbi_uc) (i+1);
-         if(k >= 257) return stbi__err("bad size list","Corrupt JPEG");
+   int n = stbi__thread_count_setting;
+   if (n == 0) {
+      if (stbi__cpu_count == 0) {
+      #ifdef STBI__WIN32_THREADS
+         SYSTEM_INFO info;
+         GetSystemInfo(&info);
+         n = (int) info.dwNumberOfProcessors;
+      #else
+         n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+      #endif
+         stbi__cpu_count = n < 1 ? 1 : n;
       }
+      n = stbi__cpu_count;
    }
-   h->size[k] = 0;
+   return n > STBI__MAX_THREADS ? STBI__MAX_THREADS : n;
+}
 
-   // compute actual symbols (from jpeg spec)
-   code = 0;
-   k = 0;
-   for(j=1; j <= 16; ++j) {
-      // compute delta to add to code to compute symbol id
-      h->delta[j] = k - code;
-      if (h->size[k] == j) {
-         while (h->size[k] == j)
-            h->code[k++] = (stbi__uint16) (code++);
-         if (code-1 >= (1u << j)) return stbi__err("bad code lengths","Corrupt JPEG");
-      }
-      // compute largest code + 1 for this size, preshifted as needed later
-      h->maxcode[j] = code << (16-j);
-      code <<= 1;
+static int stbi__thread_count(void)
+{
+   int n;
+   stbi__pool_lock();
+   n = stbi__pool_thread_count();
+   stbi__pool_unlock();
+   return n;
+}
+
+STBIDEF void stbi_set_thread_count(int count)
+{
+   int want;
+   stbi__pool_lock();
+   stbi__thread_count_setting = count < 0 ? 0 : count;
+   // ask any workers beyond the new limit to exit
+   want = stbi__pool_thread_count() - 1;
+   if (stbi__pool_workers - stbi__pool_retire > want) {
+      stbi__pool_retire = stbi__pool_workers - want;
+      stbi__pool_wake(stbi__pool_work);
    }
-   h->maxcode[j] = 0xffffffff;
+   stbi__pool_unlock();
+}
 
-   // build non-spec acceleration table; 255 is flag for not-accelerated
-   memset(h->fast, 255, 1 << FAST_BITS);
-   for (i=0; i < k; ++i) {
+// hand out the next job of group g, unlinking it once all jobs are out;
+// the caller holds the lock
+static int stbi__pool_take(stbi__job_group *g)
+{
+   int index = g->next++;
+   if (g->next == g->count) {
+      stbi__job_group **p = &stbi__pool_queue;
+      while (*p != g)
+         p = &(*p)->queue_next;
+      *p = g->queue_next;
+   }
+   return index;
+}
+
+// run one job with the lock released; the caller holds the lock
+static void stbi__pool_run(stbi__job_group *g, int index)
+{
+   stbi__pool_unlock();
+   g->func(g->user, index);
+   stbi__pool_lock();
+   if (++g->done == g->count)
+      stbi__pool_wake(stbi__pool_done);
+}
+
+#ifdef STBI__WIN32_THREADS
+static DWORD WINAPI stbi__pool_worker(LPVOID param)
+#else
+static void *stbi__pool_worker(void *param)
+#endif
+{
+   STBI_NOTUSED(param);
+   stbi__pool_lock();
+   for (;;) {
+      stbi__job_group *g = stbi__pool_queue;
+      if (stbi__pool_retire) {
+         --stbi__pool_retire;
+         --stbi__pool_workers;
+         break;
+      }
+      if (g)
+         stbi__pool_run(g, stbi__pool_take(g));
+      else
+         stbi__pool_wait(stbi__pool_work);
+   }
+   stbi__pool_unlock();
+   return 0;
+}
+
+// make sure the workers for the current thread count are running; returns
+// the number of workers available. the caller holds the lock
+static int stbi__pool_start(void)
+{
+   int want = stbi__pool_thread_count() - 1;
+   while (stbi__pool_workers - stbi__pool_retire < want) {
+      if (stbi__pool_retire) {
+         // a worker that hasn't exited yet can just keep going
+         --stbi__pool_retire;
+         continue;
+      } else {
+      #ifdef STBI__WIN32_THREADS
+         HANDLE h = CreateThread(NULL, 0, stbi__pool_worker, NULL, 0, NULL);
+         if (h == NULL) break;
+         CloseHandle(h);
+      #else
+         pthread_t t;
+         if (pthread_create(&t, NULL, stbi__pool_worker, NULL) != 0) break;
+         pthread_detach(t);
+      #endif
+         ++stbi__pool_workers;
+      }
+   }
+   return stbi__pool_workers - stbi__pool_retire;
+}
+
+// call func(user,i) for every i in [0,count), spread over the worker
+// threads; returns once all of them have finished
+static void stbi__parallel_for(stbi__job_func func, void *user, int count)
+{
+   stbi__job_group g, **p;
+   int i;
+
+   if (count > 1) {
+      stbi__pool_lock();
+      if (stbi__pool_start() > 0) {
+         g.func = func;
+         g.user = user;
+         g.count = count;
+         g.next = g.done = 0;
+         g.queue_next = NULL;
+         for (p = &stbi__pool_queue; *p; p = &(*p)->queue_next)
+            ;
+         *p = &g;
+         stbi__pool_wake(stbi__pool_work);
+         while (g.next < g.count)
+            stbi__pool_run(&g, stbi__pool_take(&g));
+         while (g.done < g.count)
+            stbi__pool_wait(stbi__pool_done);
+         stbi__pool_unlock();
+         return;
+      }
+      stbi__pool_unlock();
+   }
+
+   for (i=0; i < count; ++i)
+      func(user, i);
+}
+
+#endif // !STBI_NO_THREADS
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_HDR) || !defined(STBI_NO_LINEAR)
+// number of jobs to split 'items' units of work into, given that a job
+// shouldn't be smaller than 'min_items'
+static int stbi__parallel_jobs(int items, int min_items)
+{
+   int jobs = stbi__thread_count();
+   if (jobs > 1) jobs *= 4; // smaller jobs balance better
+   if (min_items < 1) min_items = 1;
+   if (jobs > items / min_items) jobs = items / min_items;
+   return jobs < 1 ? 1 : jobs;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  HDR <-> LDR conversion
+//
+//    - LDR to HDR only has 256 possible inputs per channel, so it's a table
+//      built with pow() per image
+//    - HDR to LDR raises every float to 1/gamma; that uses stbi__gamma_pow
+//      below instead of pow(), in SSE2 when available
+//    - both run in row bands on the thread pool, and each row is converted
+//      the same way whichever band it's in
+
+#ifndef STBI_NO_LINEAR
+// float to IEEE half float, rounding to nearest even like F16C's vcvtps2ph.
+// half denormals come from adding a float that puts the half's last bit
+// in the float's, so the FPU does the rounding
+static stbi__uint16 stbi__float_to_half(float f)
+{
+   stbi__uint32 b, sign, o;
+   memcpy(&b, &f, 4);
+   sign = (b >> 16) & 0x8000;
+   b &= 0x7fffffff;
+   if (b >= 0x47800000) { // 65536 or more, infinity or NaN
+      o = b > 0x7f800000 ? 0x7e00 : 0x7c00;
+   } else if (b < 0x38800000) { // below 2^-14
+      float magic = 0.5f; // 2^-1, so the half's 2^-24 lands in the float's 2^-24
+      memcpy(&f, &b, 4);
+      f += magic;
+      memcpy(&o, &f, 4);
+      o -= 0x3f000000;
+   } else {
+      // rebias, round (ties to even) and drop 13 mantissa bits. a carry out
+      // of the mantissa bumps the exponent, up to infinity past 65504
+      o = (b + 0xc8000fff + ((b >> 13) & 1)) >> 13;
+   }
+   return (stbi__uint16) (sign | o);
+}
+
+#ifndef STBI_NO_HDR
+// .hdr files are converted to halves a row at a time
+#ifdef STBI__AVX2
+static int stbi__f16c_available(void)
+{
+   int info[4], ecx1;
+   stbi__cpuidex(0, 0, info);
+   if (info[0] < 1) return 0;
+   stbi__cpuidex(1, 0, info);
+   ecx1 = info[2];
+   // OSXSAVE, AVX, F16C, and the OS saving the AVX registers
+   return (ecx1 & (1<<27)) && (ecx1 & (1<<28)) && (ecx1 & (1<<29)) && (stbi__xgetbv0() & 0x06) == 0x06;
+}
+
+STBI__TARGET_F16C static void stbi__float_to_half_row_f16c(stbi__uint16 *out, float const *in, int n)
+{
+   int i = 0;
+   for (; i+8 <= n; i += 8)
+      _mm_storeu_si128((__m128i *) (out+i), _mm256_cvtps_ph(_mm256_loadu_ps(in+i), 0)); // round to nearest
+   for (; i < n; ++i)
+      out[i] = stbi__float_to_half(in[i]);
+}
+#endif
+
+static void stbi__float_to_half_row(stbi__uint16 *out, float const *in, int n, int f16c)
+{
+   int i;
+#ifdef STBI__AVX2
+   if (f16c) {
+      stbi__float_to_half_row_f16c(out, in, n);
+      return;
+   }
+#endif
+   STBI_NOTUSED(f16c);
+   for (i=0; i < n; ++i)
+      out[i] = stbi__float_to_half(in[i]);
+}
+#endif
+
+typedef struct
+{
+   stbi_uc *data;
+   void *output;   // floats, or halves if half is set
+   int x, y, comp, rows, half;
+   float table[256], alpha[256];
+   stbi__uint16 htable[256], halpha[256];
+} stbi__ldr_to_hdr_job;
+
+static void stbi__ldr_to_hdr_rows(void *user, int index)
+{
+   stbi__ldr_to_hdr_job *c = (stbi__ldr_to_hdr_job *) user;
+   int j = index * c->rows, end = j + c->rows;
+   size_t i, first, last;
+   if (end > c->y) end = c->y;
+   first = (size_t) j * c->x;
+   last = (size_t) end * c->x;
+   if (c->half) {
+      stbi__uint16 *out = (stbi__uint16 *) c->output;
+      if (c->comp & 1) {
+         for (i=first*c->comp; i < last*c->comp; ++i)
+            out[i] = c->htable[c->data[i]];
+      } else {
+         int k, n = c->comp-1;
+         for (i=first; i < last; ++i) {
+            stbi_uc *d = c->data + i*c->comp;
+            stbi__uint16 *o = out + i*c->comp;
+            for (k=0; k < n; ++k)
+               o[k] = c->htable[d[k]];
+            o[n] = c->halpha[d[n]];
+         }
+      }
+   } else {
+      float *out = (float *) c->output;
+      if (c->comp & 1) {
+         for (i=first*c->comp; i < last*c->comp; ++i)
+            out[i] = c->table[c->data[i]];
+      } else {
+         // the last channel is alpha, which is linear
+         int k, n = c->comp-1;
+         for (i=first; i < last; ++i) {
+            stbi_uc *d = c->data + i*c->comp;
+            float *o = out + i*c->comp;
+            for (k=0; k < n; ++k)
+               o[k] = c->table[d[k]];
+            o[n] = c->alpha[d[n]];
+         }
+      }
+   }
+}
+
+// LDR to floats, or to half floats for stbi_loadh
+static void    *stbi__ldr_to_linear(stbi_uc *data, int x, int y, int comp, int half)
+{
+   stbi__ldr_to_hdr_job c;
+   int i, jobs;
+   void *output;
+   if (!data) return NULL;
+   output = stbi__malloc_mad4(x, y, comp, half ? 2 : sizeof(float), 0);
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   for (i=0; i < 256; ++i) {
+      c.table[i] = (float) (pow(i/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+      c.alpha[i] = i/255.0f;
+      c.htable[i] = stbi__float_to_half(c.table[i]);
+      c.halpha[i] = stbi__float_to_half(c.alpha[i]);
+   }
+   c.half = half;
+   c.data = data;
+   c.output = output;
+   c.x = x;
+   c.y = y;
+   c.comp = comp;
+   jobs = stbi__parallel_jobs(y, 1 + (1 << 16) / (x*comp));
+   c.rows = (y + jobs-1) / jobs;
+   stbi__parallel_for(stbi__ldr_to_hdr_rows, &c, (y + c.rows-1) / c.rows);
+   stbi__free(data);
+   return output;
+}
+
+static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+{
+   return (float *) stbi__ldr_to_linear(data, x, y, comp, 0);
+}
+#endif
+
+#ifndef STBI_NO_HDR
+// pow(x, g) as 2^(g*log2(x)), for the HDR to LDR gamma. x is split into
+// m*2^e with m in [sqrt(1/2), sqrt(2)); log2(m) is a series in
+// t = (m-1)/(m+1), and 2^(i+f) is 2^i times a polynomial in f-1/2. the
+// relative error is below 2e-6 where the result is within [2^-20, 256],
+// the range that matters for 8 bits. for gammas from 0.45 to 2.2, about
+// one float in a million in [2^-31, 512] converts to a byte 1 off from
+// pow()'s, and none further. x below FLT_MIN (or NaN) counts as FLT_MIN,
+// and g*log2(x) is clamped to [-126,9], which doesn't change the bytes
+#define STBI__GAMMA_LOG_C1  2.885390043f  // 2/ln(2), /3, /5, /7
+#define STBI__GAMMA_LOG_C3  0.961796701f
+#define STBI__GAMMA_LOG_C5  0.577078044f
+#define STBI__GAMMA_LOG_C7  0.412198573f
+#define STBI__GAMMA_EXP_C0  1.414213538f  // sqrt(2) * ln(2)^k / k!
+#define STBI__GAMMA_EXP_C1  0.980258167f
+#define STBI__GAMMA_EXP_C2  0.339731574f
+#define STBI__GAMMA_EXP_C3  0.078494661f
+#define STBI__GAMMA_EXP_C4  0.013602088f
+#define STBI__GAMMA_EXP_C5  0.001885650f
+#define STBI__GAMMA_EXP_C6  0.000217839f
+
+static float stbi__gamma_pow(float x, float g)
+{
+   stbi__uint32 b;
+   float m, t, t2, y, f, p;
+   int e, i;
+   if (!(x >= 1.17549435e-38f)) x = 1.17549435e-38f;
+   memcpy(&b, &x, 4);
+   e = (int) (b >> 23) - 127;
+   b = (b & 0x7fffff) | 0x3f800000;
+   memcpy(&m, &b, 4);
+   if (m > 1.41421356f) { m *= 0.5f; ++e; }
+   t = (m - 1) / (m + 1);
+   t2 = t*t;
+   y = g * ((float) e + t * (STBI__GAMMA_LOG_C1 + t2 * (STBI__GAMMA_LOG_C3 + t2 * (STBI__GAMMA_LOG_C5 + t2 * STBI__GAMMA_LOG_C7))));
+   if (!(y > -126.0f)) y = -126.0f;
+   if (y > 9.0f) y = 9.0f;
+   i = (int) y;
+   if ((float) i > y) --i;
+   f = y - (float) i - 0.5f;
+   p = STBI__GAMMA_EXP_C0 + f * (STBI__GAMMA_EXP_C1 + f * (STBI__GAMMA_EXP_C2 + f * (STBI__GAMMA_EXP_C3 + f * (STBI__GAMMA_EXP_C4 + f * (STBI__GAMMA_EXP_C5 + f * STBI__GAMMA_EXP_C6)))));
+   b = (stbi__uint32) (i + 127) << 23;
+   memcpy(&f, &b, 4);
+   return p * f;
+}
+
+#define stbi__float2int(x)   ((int) (x))
+
+static stbi_uc stbi__hdr_to_byte(float z)
+{
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return (stbi_uc) stbi__float2int(z);
+}
+
+#ifdef STBI_SSE2
+// stbi__gamma_pow for 4 floats
+static __m128 stbi__gamma_pow_sse2(__m128 x, __m128 g)
+{
+   __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+   __m128 m, t, t2, y, f, p, big, tooi;
+   __m128i e, i;
+   x = _mm_max_ps(x, _mm_set1_ps(1.17549435e-38f)); // NaN becomes FLT_MIN
+   e = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(x), 23), _mm_set1_epi32(127));
+   m = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7fffff))), one);
+   big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+   m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, half)));
+   e = _mm_sub_epi32(e, _mm_castps_si128(big));
+   t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+   t2 = _mm_mul_ps(t, t);
+   y = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_LOG_C5), _mm_mul_ps(t2, _mm_set1_ps(STBI__GAMMA_LOG_C7)));
+   y = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_LOG_C3), _mm_mul_ps(t2, y));
+   y = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_LOG_C1), _mm_mul_ps(t2, y));
+   y = _mm_mul_ps(g, _mm_add_ps(_mm_cvtepi32_ps(e), _mm_mul_ps(t, y)));
+   y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-126.0f)), _mm_set1_ps(9.0f));
+   i = _mm_cvttps_epi32(y);
+   tooi = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), y);
+   i = _mm_add_epi32(i, _mm_castps_si128(tooi));
+   f = _mm_sub_ps(_mm_sub_ps(y, _mm_cvtepi32_ps(i)), half);
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C5), _mm_mul_ps(f, _mm_set1_ps(STBI__GAMMA_EXP_C6)));
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C4), _mm_mul_ps(f, p));
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C3), _mm_mul_ps(f, p));
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C2), _mm_mul_ps(f, p));
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C1), _mm_mul_ps(f, p));
+   p = _mm_add_ps(_mm_set1_ps(STBI__GAMMA_EXP_C0), _mm_mul_ps(f, p));
+   return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23)));
+}
+
+// 4 floats to bytes, the ones in alpha lanes linearly; returns them in the
+// low 4 bytes of each 32-bit lane
+static __m128i stbi__hdr_to_ldr_sse2(__m128 v, __m128 alpha, __m128 scale, __m128 g)
+{
+   __m128 c = _mm_mul_ps(stbi__gamma_pow_sse2(_mm_mul_ps(v, scale), g), _mm_set1_ps(255.0f));
+   c = _mm_or_ps(_mm_andnot_ps(alpha, c), _mm_and_ps(alpha, _mm_mul_ps(v, _mm_set1_ps(255.0f))));
+   c = _mm_add_ps(c, _mm_set1_ps(0.5f));
+   c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(255.0f)); // NaN becomes 0
+   return _mm_cvttps_epi32(c);
+}
+#endif
+
+typedef struct
+{
+   float *data;
+   stbi_uc *output;
+   int x, y, comp, rows;
+   float scale, gamma;
+} stbi__hdr_to_ldr_job;
+
+static void stbi__hdr_to_ldr_rows(void *user, int index)
+{
+   stbi__hdr_to_ldr_job *c = (stbi__hdr_to_ldr_job *) user;
+   int j = index * c->rows, end = j + c->rows;
+   if (end > c->y) end = c->y;
+   for (; j < end; ++j) {
+      int i = 0, n = c->x * c->comp;
+      float *d = c->data + (size_t) j * n;
+      stbi_uc *o = c->output + (size_t) j * n;
+      #ifdef STBI_SSE2
+      if (stbi__sse2_available()) {
+         // rows start on a pixel, so with 2 or 4 channels every vector
+         // has alpha in the same lanes
+         __m128 scale = _mm_set1_ps(c->scale), g = _mm_set1_ps(c->gamma);
+         __m128 alpha = _mm_setzero_ps();
+         if (c->comp == 2) alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, -1, 0));
+         if (c->comp == 4) alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+         for (; i+16 <= n; i += 16) {
+            __m128i b0 = stbi__hdr_to_ldr_sse2(_mm_loadu_ps(d+i   ), alpha, scale, g);
+            __m128i b1 = stbi__hdr_to_ldr_sse2(_mm_loadu_ps(d+i+ 4), alpha, scale, g);
+            __m128i b2 = stbi__hdr_to_ldr_sse2(_mm_loadu_ps(d+i+ 8), alpha, scale, g);
+            __m128i b3 = stbi__hdr_to_ldr_sse2(_mm_loadu_ps(d+i+12), alpha, scale, g);
+            _mm_storeu_si128((__m128i *) (o+i), _mm_packus_epi16(_mm_packs_epi32(b0, b1), _mm_packs_epi32(b2, b3)));
+         }
+      }
+      #endif
+      for (; i < n; ++i) {
+         if ((c->comp & 1) == 0 && i % c->comp == c->comp-1)
+            o[i] = stbi__hdr_to_byte(d[i] * 255 + 0.5f);
+         else
+            o[i] = stbi__hdr_to_byte(stbi__gamma_pow(d[i] * c->scale, c->gamma) * 255 + 0.5f);
+      }
+   }
+}
+
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+{
+   stbi__hdr_to_ldr_job c;
+   int jobs;
+   stbi_uc *output;
+   if (!data) return NULL;
+   output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   c.data = data;
+   c.output = output;
+   c.x = x;
+   c.y = y;
+   c.comp = comp;
+   c.scale = stbi__h2l_scale_i;
+   c.gamma = stbi__h2l_gamma_i;
+   jobs = stbi__parallel_jobs(y, 1 + (1 << 14) / (x*comp));
+   c.rows = (y + jobs-1) / jobs;
+   stbi__parallel_for(stbi__hdr_to_ldr_rows, &c, (y + c.rows-1) / c.rows);
+   stbi__free(data);
+   return output;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  "baseline" JPEG/JFIF decoder
+//
+//    simple implementation
+//      - doesn't support delayed output of y-dimension
+//      - simple interface (only one output format: 8-bit interleaved RGB)
+//      - doesn't try to recover corrupt jpegs
+//      - doesn't allow partial loading, loading multiple at once
+//      - still fast on x86 (copying globals into locals doesn't help x86)
+//      - allocates lots of intermediate memory (full size of all components)
+//        - non-interleaved case requires this anyway
+//        - allows good upsampling (see next)
+//    high-quality
+//      - upsampled channels are bilinearly interpolated, even across blocks
+//      - quality integer IDCT derived from IJG's 'slow'
+//    performance
+//      - fast huffman; reasonable integer IDCT
+//      - some SIMD kernels for common paths on targets with SSE2/NEON
+//      - uses a lot of intermediate memory, could cache poorly
+
+#ifndef STBI_NO_JPEG
+
+// huffman decoding acceleration
+#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+
+typedef struct
+{
+   stbi_uc  fast[1 << FAST_BITS];
+   // weirdly, repacking this into AoS is a 10% speed loss, instead of a win
+   stbi__uint16 code[256];
+   stbi_uc  values[256];
+   stbi_uc  size[257];
+   unsigned int maxcode[18];
+   int    delta[17];   // old 'firstsymbol' - old 'firstcode'
+} stbi__huffman;
+
+typedef struct
+{
+   stbi__context *s;
+   stbi__huffman huff_dc[4];
+   stbi__huffman huff_ac[4];
+   stbi__uint16 dequant[4][64];
+   stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int16 fast_dc[4][1 << FAST_BITS];
+
+// sizes for components, interleaved MCUs
+   int img_h_max, img_v_max;
+   int img_mcu_x, img_mcu_y;
+   int img_mcu_w, img_mcu_h;
+
+// definition of jpeg image component
+   struct
+   {
+      int id;
+      int h,v;
+      int tq;
+      int hd,ha;
+      int dc_pred;
+
+      int x,y,w2,h2;
+      stbi_uc *data;
+      void *raw_data;
+      // progressive only: the first coeff_end coefficients of the blocks in
+      // the planes, in zigzag order. if that's not all of them, 'nonzero'
+      // has a bit per coefficient of every block for the refinement scans
+      short   *coeff;
+      stbi_uc *nonzero;
+      int      coeff_w, coeff_h; // number of 8x8 blocks in 'nonzero'
+   } img_comp[4];
+
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, first bit in the MSB
+   int            code_bits;   // number of valid bits
+   unsigned char  marker;      // marker seen while filling entropy buffer
+   int            nomore;      // flag if we saw a marker so must stop
+
+   int            progressive;
+   int            spec_start;
+   int            spec_end;
+   int            succ_high;
+   int            succ_low;
+   int            eob_run;
+   int            jfif;
+   int            app14_color_transform; // Adobe APP14 tag
+   int            rgb;
+
+   int scan_n, order[4];
+   int restart_interval, todo;
+   int scale;     // blocks decode to (8 >> scale) pixels square, see stbi_set_jpeg_downscale
+   int coeff_end; // zigzag index past the last coefficient the IDCT uses
+   int keep_coeff; // stbi_jpeg_coefficients: keep every block's coefficients as decoded, instead of pixels
+   // only MCUs [mcu_x0,mcu_x1) x [mcu_y0,mcu_y1) are decoded to pixels and
+   // have room in the planes; all of them, unless there's a stbi__region
+   int mcu_x0, mcu_y0, mcu_x1, mcu_y1;
+
+// kernels
+   void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   void (*YCbCr_h2_to_RGB_kernel)(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far,
+                                  stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step);
+} stbi__jpeg;
+
+static int stbi__build_huffman(stbi__huffman *h, int *count)
+{
+   int i,j,k=0;
+   unsigned int code;
+   // build size list for each symbol (from JPEG spec)
+   for (i=0; i < 16; ++i) {
+      for (j=0; j < count[i]; ++j) {
+         h->size[k++] = (stbi_uc) (i+1);
+         if(k >= 257) return stbi__err("bad size list","Corrupt JPEG");
+      }
+   }
+   h->size[k] = 0;
+
+   // compute actual symbols (from jpeg spec)
+   code = 0;
+   k = 0;
+   for(j=1; j <= 16; ++j) {
+      // compute delta to add to code to compute symbol id
+      h->delta[j] = k - code;
+      if (h->size[k] == j) {
+         while (h->size[k] == j)
+            h->code[k++] = (stbi__uint16) (code++);
+         if (code-1 >= (1u << j)) return stbi__err("bad code lengths","Corrupt JPEG");
+      }
+      // compute largest code + 1 for this size, preshifted as needed later
+      h->maxcode[j] = code << (16-j);
+      code <<= 1;
+   }
+   h->maxcode[j] = 0xffffffff;
+
+   // build non-spec acceleration table; 255 is flag for not-accelerated
+   memset(h->fast, 255, 1 << FAST_BITS);
+   for (i=0; i < k; ++i) {
       int s = h->size[i];
       if (s <= FAST_BITS) {
          int c = h->code[i] << (FAST_BITS-s);
@@ -2070,27 +3549,85 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
    }
 }
 
+// the same for DC differences: the huffman code for the number of bits
+// and the bits themselves, when they fit in FAST_BITS together. that's
+// every difference below 256 with a short enough code, which is most of
+// them in practice
+static void stbi__build_fast_dc(stbi__int16 *fast_dc, stbi__huffman *h)
+{
+   int i;
+   for (i=0; i < (1 << FAST_BITS); ++i) {
+      stbi_uc fast = h->fast[i];
+      fast_dc[i] = 0;
+      if (fast < 255) {
+         int magbits = h->values[fast];
+         int len = h->size[fast];
+
+         if (len + magbits <= FAST_BITS) {
+            int k = 0;
+            if (magbits) {
+               int m = 1 << (magbits - 1);
+               k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
+               if (k < m) k += (~0U << magbits) + 1;
+            }
+            fast_dc[i] = (stbi__int16) ((k * 16) + (len + magbits));
+         }
+      }
+   }
+}
+
+stbi_inline static stbi__uint64 stbi__jpeg_get64be(const stbi_uc *p)
+{
+#if defined(__GNUC__) && (defined(STBI__X64_TARGET) || defined(STBI__X86_TARGET))
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return __builtin_bswap64(v);
+#elif defined(_MSC_VER) && (defined(STBI__X64_TARGET) || defined(STBI__X86_TARGET))
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return _byteswap_uint64(v);
+#else
+   return ((stbi__uint64) ((stbi__uint32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) << 32)
+        | (stbi__uint32) ((stbi__uint32) p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]);
+#endif
+}
+
+// refill code_buffer to at least 57 bits. from memory, the next 5-7 bytes
+// go in at once when none of them is 0xff (which is either byte stuffing
+// or a marker); otherwise they're taken a byte at a time. once a marker is
+// reached, zeros are shifted in, so there are always enough bits for the
+// next code and the decoders don't have to check
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      int n = (63 - j->code_bits) >> 3; // 5 or more, see the callers
+      stbi__uint64 w = stbi__jpeg_get64be(s->img_buffer);
+      stbi__uint64 mask = ~(stbi__uint64) 0 << (64 - 8*n);
+      stbi__uint64 t = ~w | ~mask; // a zero byte where w has a 0xff to take
+      if (!((t - 0x0101010101010101ull) & ~t & 0x8080808080808080ull)) {
+         j->code_buffer |= (w & mask) >> j->code_bits;
+         j->code_bits += 8*n;
+         s->img_buffer += n;
+         return;
+      }
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
-            return;
+            b = 0;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -2101,12 +3638,10 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
-      if (s > j->code_bits)
-         return -1;
       j->code_buffer <<= s;
       j->code_bits -= s;
       return h->values[k];
@@ -2118,7 +3653,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2128,14 +3663,11 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
    }
 
-   if (k > j->code_bits)
-      return -1;
-
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
    if(c < 0 || c >= 256) // symbol id out of bounds!
        return -1;
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   STBI_ASSERT((int) (j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2150,15 +3682,12 @@ static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 // always extends everything it receives.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
-   unsigned int k;
-   int sgn;
+   int k, sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (negative), 1 if MSB set (positive)
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
@@ -2166,25 +3695,40 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   if (j->code_bits < 1) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
+}
+
+// decode a block's DC difference, through fast_dc when it's in there
+stbi_inline static int stbi__jpeg_decode_dc(stbi__jpeg *j, stbi__huffman *hdc, stbi__int16 *fdc, int *diff)
+{
+   int r, t;
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   r = fdc[j->code_buffer >> (64 - FAST_BITS)];
+   if (r) {
+      j->code_buffer <<= r & 15;
+      j->code_bits -= r & 15;
+      *diff = r >> 4;
+      return 1;
+   }
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0 || t > 15) return 0;
+   *diff = t ? stbi__extend_receive(j, t) : 0;
+   return 1;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2204,20 +3748,52 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
    63, 63, 63, 63, 63, 63, 63
 };
 
+// skip over the rest of a block's AC coefficients, from zigzag index k on
+static int stbi__jpeg_skip_ac(stbi__jpeg *j, stbi__huffman *hac, stbi__int16 *fac, int k)
+{
+   while (k < 64) {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
+      r = fac[c];
+      if (r) {
+         k += ((r >> 4) & 15) + 1;
+         s = r & 15;
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         if (s == 0) {
+            if (rs != 0xf0) return 1; // end block
+            k += 16;
+         } else {
+            k += (rs >> 4) + 1;
+            stbi__extend_receive(j,s);
+         }
+      }
+   }
+   return 1;
+}
+
+// for decoding blocks without dequantizing them
+static stbi__uint16 stbi__jpeg_unquantized[64] =
+{
+   1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
+   1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1
+};
+
 // decode one 64-entry block--
 static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
-   int t;
 
-   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-   t = stbi__jpeg_huff_decode(j, hdc);
-   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+   if (!stbi__jpeg_decode_dc(j, hdc, j->fast_dc[j->img_comp[b].hd], &diff)) return stbi__err("bad huffman code","Corrupt JPEG");
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
 
-   diff = t ? stbi__extend_receive(j, t) : 0;
    if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta","Corrupt JPEG");
    dc = j->img_comp[b].dc_pred + diff;
    j->img_comp[b].dc_pred = dc;
@@ -2230,12 +3806,11 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
          s = r & 15; // combined length
-         if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
          j->code_buffer <<= s;
          j->code_bits -= s;
          // decode into unzigzag'd location
@@ -2247,7 +3822,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
          s = rs & 15;
          r = rs >> 4;
          if (s == 0) {
-            if (rs != 0xf0) break; // end block
+            if (rs != 0xf0) return 1; // end block
             k += 16;
          } else {
             k += r;
@@ -2256,43 +3831,83 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
             data[zig] = (short) (stbi__extend_receive(j,s) * dequant[zig]);
          }
       }
-   } while (k < 64);
-   return 1;
+   } while (k < j->coeff_end);
+
+   // when decoding at reduced size, the IDCT doesn't use the rest, so they
+   // are just skipped over
+   return stbi__jpeg_skip_ac(j, hac, fac, k);
 }
 
-static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
+// decode a block that isn't needed: just keep track of the DC prediction
+static int stbi__jpeg_skip_block(stbi__jpeg *j, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b)
+{
+   int diff;
+   if (!stbi__jpeg_decode_dc(j, hdc, j->fast_dc[j->img_comp[b].hd], &diff)) return stbi__err("bad huffman code","Corrupt JPEG");
+   if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta","Corrupt JPEG");
+   j->img_comp[b].dc_pred += diff;
+   return stbi__jpeg_skip_ac(j, hac, fac, 1);
+}
+
+static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short *data, stbi__huffman *hdc, int b)
 {
    int diff,dc;
-   int t;
    if (j->spec_end != 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
 
-   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-
    if (j->succ_high == 0) {
       // first scan for DC coefficient, must be first
-      memset(data,0,64*sizeof(data[0])); // 0 all the ac values now
-      t = stbi__jpeg_huff_decode(j, hdc);
-      if (t < 0 || t > 15) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
-      diff = t ? stbi__extend_receive(j, t) : 0;
+      if (!stbi__jpeg_decode_dc(j, hdc, j->fast_dc[j->img_comp[b].hd], &diff)) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
 
       if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta", "Corrupt JPEG");
       dc = j->img_comp[b].dc_pred + diff;
       j->img_comp[b].dc_pred = dc;
       if (!stbi__mul2shorts_valid(dc, 1 << j->succ_low)) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
-      data[0] = (short) (dc * (1 << j->succ_low));
+      if (data)
+         data[0] = (short) (dc * (1 << j->succ_low));
    } else {
       // refinement scan for DC coefficient
-      if (stbi__jpeg_get_bit(j))
+      if (stbi__jpeg_get_bit(j) && data)
          data[0] += (short) (1 << j->succ_low);
    }
    return 1;
 }
 
+// progressive AC coefficient k (in zigzag order) of a block is kept in data
+// if k < end, which is 0 for blocks that aren't decoded to pixels, and as a
+// bit in nz if there is one
+
+stbi_inline static void stbi__jpeg_prog_put(short *data, stbi_uc *nz, int end, int k, int v)
+{
+   short sv = (short) v;
+   if (k > 63) k = 63; // corrupt input
+   if (k < end) data[k] = sv;
+   if (nz && sv) nz[k >> 3] |= (stbi_uc) (1 << (k & 7));
+}
+
+stbi_inline static int stbi__jpeg_prog_nonzero(short *data, stbi_uc *nz, int end, int k)
+{
+   if (k < end) return data[k] != 0;
+   return (nz[k >> 3] >> (k & 7)) & 1;
+}
+
+// a correction bit came in for nonzero coefficient k
+stbi_inline static void stbi__jpeg_prog_refine(short *data, int end, int k, short bit)
+{
+   if (k < end) {
+      short *p = &data[k];
+      if ((*p & bit)==0) {
+         if (*p > 0)
+            *p += bit;
+         else
+            *p -= bit;
+      }
+   }
+}
+
 // @OPTIMIZE: store non-zigzagged during the decode passes,
 // and only de-zigzag when dequantizing
-static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int16 *fac)
+static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short *data, stbi_uc *nz, stbi__huffman *hac, stbi__int16 *fac)
 {
-   int k;
+   int k, end = data ? j->coeff_end : 0;
    if (j->spec_start == 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
 
    if (j->succ_high == 0) {
@@ -2305,19 +3920,16 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
 
       k = j->spec_start;
       do {
-         unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
             s = r & 15; // combined length
-            if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
             j->code_buffer <<= s;
             j->code_bits -= s;
-            zig = stbi__jpeg_dezigzag[k++];
-            data[zig] = (short) ((r >> 8) * (1 << shift));
+            stbi__jpeg_prog_put(data, nz, end, k++, (r >> 8) * (1 << shift));
          } else {
             int rs = stbi__jpeg_huff_decode(j, hac);
             if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2334,8 +3946,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
                k += 16;
             } else {
                k += r;
-               zig = stbi__jpeg_dezigzag[k++];
-               data[zig] = (short) (stbi__extend_receive(j,s) * (1 << shift));
+               stbi__jpeg_prog_put(data, nz, end, k++, stbi__extend_receive(j,s) * (1 << shift));
             }
          }
       } while (k <= j->spec_end);
@@ -2346,17 +3957,10 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
 
       if (j->eob_run) {
          --j->eob_run;
-         for (k = j->spec_start; k <= j->spec_end; ++k) {
-            short *p = &data[stbi__jpeg_dezigzag[k]];
-            if (*p != 0)
+         for (k = j->spec_start; k <= j->spec_end; ++k)
+            if (stbi__jpeg_prog_nonzero(data, nz, end, k))
                if (stbi__jpeg_get_bit(j))
-                  if ((*p & bit)==0) {
-                     if (*p > 0)
-                        *p += bit;
-                     else
-                        *p -= bit;
-                  }
-         }
+                  stbi__jpeg_prog_refine(data, end, k, bit);
       } else {
          k = j->spec_start;
          do {
@@ -2387,18 +3991,13 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
 
             // advance by r
             while (k <= j->spec_end) {
-               short *p = &data[stbi__jpeg_dezigzag[k++]];
-               if (*p != 0) {
+               int kk = k++;
+               if (stbi__jpeg_prog_nonzero(data, nz, end, kk)) {
                   if (stbi__jpeg_get_bit(j))
-                     if ((*p & bit)==0) {
-                        if (*p > 0)
-                           *p += bit;
-                        else
-                           *p -= bit;
-                     }
+                     stbi__jpeg_prog_refine(data, end, kk, bit);
                } else {
                   if (r == 0) {
-                     *p = (short) s;
+                     stbi__jpeg_prog_put(data, nz, end, kk, s);
                      break;
                   }
                   --r;
@@ -2521,53 +4120,281 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
-#ifdef STBI_SSE2
-// sse2 integer IDCT. not the fastest possible implementation but it
-// produces bit-identical results to the generic C version so it's
-// fully "transparent".
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+// reduced inverse DCTs for decoding at 1/2, 1/4 and 1/8 size: an N-point
+// IDCT of the N x N lowest frequencies of a block gives the block scaled
+// down to N x N pixels. the constants include the 1/2 of the 8-point IDCT,
+// so a flat block comes out the same at every size
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   const int c0 = stbi__f2f(0.353553391f), c1 = stbi__f2f(0.461939766f), c3 = stbi__f2f(0.191341716f);
+
+   // columns; keep 2 extra bits, like stbi__idct_block
+   for (i=0; i < 4; ++i) {
+      short *d = data+i;
+      int e0 = (d[0] + d[16]) * c0 + 512;
+      int e1 = (d[0] - d[16]) * c0 + 512;
+      int o0 = d[ 8]*c1 + d[24]*c3;
+      int o1 = d[ 8]*c3 - d[24]*c1;
+      v[i   ] = (e0 + o0) >> 10;
+      v[i+ 4] = (e1 + o1) >> 10;
+      v[i+ 8] = (e1 - o1) >> 10;
+      v[i+12] = (e0 - o0) >> 10;
+   }
+
+   // rows; round, and add 128 so the results are 0..255
+   for (i=0; i < 4; ++i, v+=4, out+=out_stride) {
+      int e0 = (v[0] + v[2]) * c0 + (1 << 13) + (128 << 14);
+      int e1 = (v[0] - v[2]) * c0 + (1 << 13) + (128 << 14);
+      int o0 = v[1]*c1 + v[3]*c3;
+      int o1 = v[1]*c3 - v[3]*c1;
+      out[0] = stbi__clamp((e0 + o0) >> 14);
+      out[1] = stbi__clamp((e1 + o1) >> 14);
+      out[2] = stbi__clamp((e1 - o1) >> 14);
+      out[3] = stbi__clamp((e0 - o0) >> 14);
+   }
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   const int c0 = stbi__f2f(0.353553391f);
+   // columns
+   int a0 = ((data[0] + data[8]) * c0 + 512) >> 10;
+   int a1 = ((data[0] - data[8]) * c0 + 512) >> 10;
+   int b0 = ((data[1] + data[9]) * c0 + 512) >> 10;
+   int b1 = ((data[1] - data[9]) * c0 + 512) >> 10;
+   // rows
+   out[0] = stbi__clamp(((a0 + b0) * c0 + (1 << 13) + (128 << 14)) >> 14);
+   out[1] = stbi__clamp(((a0 - b0) * c0 + (1 << 13) + (128 << 14)) >> 14);
+   out += out_stride;
+   out[0] = stbi__clamp(((a1 + b1) * c0 + (1 << 13) + (128 << 14)) >> 14);
+   out[1] = stbi__clamp(((a1 - b1) * c0 + (1 << 13) + (128 << 14)) >> 14);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI__AVX2
+// AVX2 integer IDCT. Same structure as the SSE2 one, and bit-identical to
+// the generic C version, but the 32-bit intermediates for a row of 8 live
+// in a single register, which halves the multiply-add work. There is no
+// AVX-512 version; an 8x8 block doesn't fill the wider registers.
+static STBI__TARGET_AVX2 void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
 {
-   // This is constructed to match our regular (generic) integer IDCT exactly.
    __m128i row0, row1, row2, row3, row4, row5, row6, row7;
    __m128i tmp;
 
    // dot product constant: even elems=x, odd elems=y
-   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
-   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
-   // out(1) = c1[even]*x + c1[odd]*y
+   // out0 = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out1 = c1[even]*x + c1[odd]*y
    #define dct_rot(out0,out1, x,y,c0,c1) \
-      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
-      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
-      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
-      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
-      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
-      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
 
    // out = in << 12  (in 16-bit, out 32-bit)
    #define dct_widen(out, in) \
-      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
-      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
-
-   // wide add
-   #define dct_wadd(out, a, b) \
-      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
 
-   // wide sub
-   #define dct_wsub(out, a, b) \
-      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+   // wide add / sub
+   #define dct_wadd(out, a, b)  __m256i out = _mm256_add_epi32(a, b)
+   #define dct_wsub(out, a, b)  __m256i out = _mm256_sub_epi32(a, b)
 
    // butterfly a/b, add bias, then shift by "s" and pack
    #define dct_bfly32o(out0, out1, a,b,bias,s) \
       { \
-         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
-         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
-         dct_wadd(sum, abiased, b); \
-         dct_wsub(dif, abiased, b); \
-         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
-         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+         __m256i pck = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, dif), 0xd8); \
+         out0 = _mm256_castsi256_si128(pck); \
+         out1 = _mm256_extracti128_si256(pck, 1); \
       }
 
    // 8-bit interleave step (for transposes)
@@ -2610,18 +4437,18 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
 
-   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
-   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
-   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
-   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
-   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
 
    // rounding biases in column/row passes, see stbi__idct_block for explanation.
-   __m128i bias_0 = _mm_set1_epi32(512);
-   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
 
    // load
    row0 = _mm_load_si128((const __m128i *) (data + 0*8));
@@ -2699,8 +4526,7 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_interleave16
 #undef dct_pass
 }
-
-#endif // STBI_SSE2
+#endif // STBI__AVX2
 
 #ifdef STBI_NEON
 
@@ -2944,153 +4770,324 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+// where block (bx,by) of component n keeps its progressive coefficients; NULL
+// if it isn't decoded to pixels. *nz gets its nonzero bits, if there are any
+static short *stbi__jpeg_prog_block(stbi__jpeg *z, int n, int bx, int by, stbi_uc **nz)
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
+   int h = z->img_comp[n].h, v = z->img_comp[n].v;
+   if (nz)
+      *nz = z->img_comp[n].nonzero ? z->img_comp[n].nonzero + 8 * (bx + by * z->img_comp[n].coeff_w) : NULL;
+   if (bx < z->mcu_x0 * h || bx >= z->mcu_x1 * h || by < z->mcu_y0 * v || by >= z->mcu_y1 * v)
+      return NULL;
+   bx -= z->mcu_x0 * h;
+   by -= z->mcu_y0 * v;
+   return z->img_comp[n].coeff + z->coeff_end * (bx + by * (z->mcu_x1 - z->mcu_x0) * h);
+}
+
+// decode MCUs [first,last) of the current scan; in non-interleaved scans
+// every block is an MCU. returns 0 on error, 2 if we stopped early because
+// a restart marker was missing, and 1 otherwise
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int last)
+{
+   int i,j,m,total,bs = 8 >> z->scale;
+   STBI_SIMD_ALIGN(short, data[64]);
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int ha = z->img_comp[n].ha;
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      // blocks that have room in the plane
+      int bx0 = z->mcu_x0 * z->img_comp[n].h, bx1 = z->mcu_x1 * z->img_comp[n].h;
+      int by0 = z->mcu_y0 * z->img_comp[n].v, by1 = z->mcu_y1 * z->img_comp[n].v;
+      total = w*h;
+      i = first % w;
+      j = first / w;
+      for (m=first; m < last; ++m) {
+         if (z->keep_coeff && !z->progressive) {
+            if (!stbi__jpeg_decode_block(z, stbi__jpeg_prog_block(z, n, i, j, NULL), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, stbi__jpeg_unquantized)) return 0;
+         } else if (!z->progressive) {
+            if (i >= bx0 && i < bx1 && j >= by0 && j < by1) {
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*(j-by0)+i-bx0)*bs, z->img_comp[n].w2, data);
+            } else {
+               if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
             }
-         }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
+         } else {
+            stbi_uc *nz;
+            short *coeff = stbi__jpeg_prog_block(z, n, i, j, &nz);
+            if (z->spec_start == 0) {
+               if (!stbi__jpeg_decode_block_prog_dc(z, coeff, &z->huff_dc[z->img_comp[n].hd], n))
+                  return 0;
+            } else {
+               if (!stbi__jpeg_decode_block_prog_ac(z, coeff, nz, &z->huff_ac[ha], z->fast_ac[ha]))
+                  return 0;
             }
          }
-         return 1;
-      }
-   } else {
-      if (z->scan_n == 1) {
-         int i,j;
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               if (z->spec_start == 0) {
-                  if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                     return 0;
-               } else {
-                  int ha = z->img_comp[n].ha;
-                  if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
-                     return 0;
-               }
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+         if (++i == w) { i = 0; ++j; }
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) return m+1 < total ? 2 : 1;
+            stbi__jpeg_reset(z);
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x);
-                        int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
-                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                           return 0;
+      }
+   } else { // interleaved
+      int k,x,y;
+      total = z->img_mcu_x * z->img_mcu_y;
+      i = first % z->img_mcu_x;
+      j = first / z->img_mcu_x;
+      for (m=first; m < last; ++m) {
+         int in_planes = i >= z->mcu_x0 && i < z->mcu_x1 && j >= z->mcu_y0 && j < z->mcu_y1;
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            int ha = z->img_comp[n].ha;
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = i*z->img_comp[n].h + x;
+                  int y2 = j*z->img_comp[n].v + y;
+                  if (z->keep_coeff && !z->progressive) {
+                     if (!stbi__jpeg_decode_block(z, stbi__jpeg_prog_block(z, n, x2, y2, NULL), z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, stbi__jpeg_unquantized)) return 0;
+                  } else if (!z->progressive) {
+                     if (in_planes) {
+                        int x3 = x2 - z->mcu_x0 * z->img_comp[n].h;
+                        int y3 = y2 - z->mcu_y0 * z->img_comp[n].v;
+                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*y3+x3)*bs, z->img_comp[n].w2, data);
+                     } else {
+                        if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
                      }
+                  } else {
+                     stbi_uc *nz;
+                     short *coeff = stbi__jpeg_prog_block(z, n, x2, y2, &nz);
+                     if (!stbi__jpeg_decode_block_prog_dc(z, coeff, &z->huff_dc[z->img_comp[n].hd], n))
+                        return 0;
                   }
                }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
             }
          }
-         return 1;
+         if (++i == z->img_mcu_x) { i = 0; ++j; }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return m+1 < total ? 2 : 1;
+            stbi__jpeg_reset(z);
+         }
       }
    }
+   return 1;
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
+#ifndef STBI_NO_THREADS
+typedef struct
 {
-   int i;
-   for (i=0; i < 64; ++i)
-      data[i] *= dequant[i];
+   stbi__jpeg *z;       // decoder the jobs start from
+   stbi__jpeg *dec;     // per job: copy of the decoder
+   stbi__context *ctx;  // per job: memory context over its intervals
+   int *result;         // per job: stbi__jpeg_decode_mcus result
+   stbi_uc **seg;       // start of every restart interval, plus the end of the last
+   int nseg, njobs, total;
+} stbi__jpeg_scan_jobs;
+
+static void stbi__jpeg_scan_job(void *user, int index)
+{
+   stbi__jpeg_scan_jobs *jobs = (stbi__jpeg_scan_jobs *) user;
+   stbi__jpeg *z = &jobs->dec[index];
+   int q = jobs->nseg / jobs->njobs, r = jobs->nseg % jobs->njobs;
+   int a = index*q + (index < r ? index : r);
+   int b = a + q + (index < r);
+   int ri = jobs->z->restart_interval;
+
+   memcpy(z, jobs->z, sizeof(*z));
+   stbi__start_mem(&jobs->ctx[index], jobs->seg[a], (int) (jobs->seg[b] - jobs->seg[a]));
+   z->s = &jobs->ctx[index];
+   stbi__jpeg_reset(z);
+   jobs->result[index] = stbi__jpeg_decode_mcus(z, a*ri, b == jobs->nseg ? jobs->total : b*ri);
+}
+
+// every restart interval starts from a clean decoder state, so when the
+// whole scan is in memory we can find the intervals by looking for RST
+// markers and decode runs of them on the worker threads. if anything about
+// the markers or the decode looks off, we return 0 without having touched
+// the decoder state and the caller decodes the scan serially, so corrupt
+// files behave the same either way
+static int stbi__jpeg_decode_scan_parallel(stbi__jpeg *z, int total)
+{
+   stbi__jpeg_scan_jobs jobs;
+   stbi_uc *p, *end;
+   int ri = z->restart_interval, nrst = 0, i, ok = 1;
+
+   if (ri == 0 || z->s->io.read != NULL) return 0;
+   jobs.nseg = (total + ri-1) / ri;
+   // jobs should have a few dozen MCUs to be worth it
+   jobs.njobs = stbi__parallel_jobs(jobs.nseg, (32 + ri-1) / ri);
+   if (jobs.njobs < 2) return 0;
+
+   jobs.seg = (stbi_uc **) stbi__malloc(sizeof(stbi_uc *) * (jobs.nseg+1));
+   if (!jobs.seg) return 0;
+
+   // find the RST markers; anything other than the expected sequence of
+   // them followed by some other marker makes us fall back
+   jobs.seg[0] = p = z->s->img_buffer;
+   end = z->s->img_buffer_end;
+   for (;;) {
+      p = (stbi_uc *) memchr(p, 0xff, end - p);
+      if (p == NULL || p+1 >= end) { ok = 0; break; }
+      if (p[1] == 0x00 || p[1] == 0xff) { ++p; continue; } // stuffed zero or fill byte
+      if (!STBI__RESTART(p[1])) break; // end of scan
+      if (nrst == jobs.nseg || p[1] != 0xd0 + (nrst & 7)) { ok = 0; break; }
+      p += 2;
+      jobs.seg[++nrst] = p;
+   }
+   // a trailing RST after the last interval is harmless
+   if (ok && nrst == jobs.nseg-1)
+      jobs.seg[jobs.nseg] = p+2;
+   else if (nrst != jobs.nseg)
+      ok = 0;
+
+   if (ok) {
+      jobs.z = z;
+      jobs.total = total;
+      jobs.dec = (stbi__jpeg *) stbi__malloc(jobs.njobs * (sizeof(stbi__jpeg) + sizeof(stbi__context) + sizeof(int)));
+      if (jobs.dec) {
+         jobs.ctx = (stbi__context *) (jobs.dec + jobs.njobs);
+         jobs.result = (int *) (jobs.ctx + jobs.njobs);
+         stbi__parallel_for(stbi__jpeg_scan_job, &jobs, jobs.njobs);
+         for (i=0; i < jobs.njobs; ++i)
+            if (jobs.result[i] != 1)
+               ok = 0;
+         stbi__free(jobs.dec);
+      } else
+         ok = 0;
+   }
+   stbi__free(jobs.seg);
+
+   if (ok) {
+      // leave the stream at the marker after the scan, as if we'd just
+      // finished decoding it
+      z->s->img_buffer = p;
+      stbi__jpeg_reset(z);
+   }
+   return ok;
+}
+#endif
+
+// skip the rest of the current scan, up to the first marker that isn't a
+// restart marker
+static void stbi__jpeg_skip_scan(stbi__jpeg *z)
+{
+   while (z->marker == STBI__MARKER_none || STBI__RESTART(z->marker)) {
+      int x;
+      z->marker = STBI__MARKER_none;
+      if (stbi__at_eof(z->s)) return;
+      x = stbi__get8(z->s);
+      if (x == 0xff) {
+         do x = stbi__at_eof(z->s) ? 0 : stbi__get8(z->s); while (x == 0xff);
+         if (x != 0x00) z->marker = (unsigned char) x;
+      }
+   }
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   int total, last;
+   // anything below the MCUs that are decoded to pixels can be skipped
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3, h = (z->img_comp[n].y+7) >> 3;
+      total = w * h;
+      last  = w * (h < z->mcu_y1 * z->img_comp[n].v ? h : z->mcu_y1 * z->img_comp[n].v);
+   } else {
+      total = z->img_mcu_x * z->img_mcu_y;
+      last  = z->img_mcu_x * z->mcu_y1;
+   }
+   stbi__jpeg_reset(z);
+   #ifndef STBI_NO_THREADS
+   if (last == total && stbi__jpeg_decode_scan_parallel(z, total))
+      return 1;
+   #endif
+   if (!stbi__jpeg_decode_mcus(z, 0, last)) return 0;
+   if (last < total)
+      stbi__jpeg_skip_scan(z);
+   return 1;
+}
+
+// dequantize the first 'end' coefficients of a block, kept in zigzag order,
+// into a whole block in the usual order
+static void stbi__jpeg_dequantize(short *out, short *data, int end, stbi__uint16 *dequant)
+{
+   int k;
+   if (end < 64)
+      memset(out, 0, 64*sizeof(out[0]));
+   for (k=0; k < end; ++k) {
+      int zig = stbi__jpeg_dezigzag[k];
+      out[zig] = (short) (data[k] * dequant[zig]);
+   }
+}
+
+// blocks of a component with x (or y) pixels that have data, up to the
+// end of the plane at block 'end'
+static int stbi__jpeg_plane_blocks(int x, int end)
+{
+   x = (x+7) >> 3;
+   return x < end ? x : end;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   int band;      // block rows per job
+   int jobs[4];   // number of jobs for each component
+} stbi__jpeg_finish_jobs;
+
+static void stbi__jpeg_finish_job(void *user, int index)
+{
+   stbi__jpeg_finish_jobs *f = (stbi__jpeg_finish_jobs *) user;
+   stbi__jpeg *z = f->z;
+   int i,j,j1,w,n=0,bs = 8 >> z->scale;
+   int bx0, by0;
+   STBI_SIMD_ALIGN(short, data[64]);
+   while (index >= f->jobs[n])
+      index -= f->jobs[n++];
+   bx0 = z->mcu_x0 * z->img_comp[n].h;
+   by0 = z->mcu_y0 * z->img_comp[n].v;
+   w  = stbi__jpeg_plane_blocks(z->img_comp[n].x, z->mcu_x1 * z->img_comp[n].h);
+   j1 = stbi__jpeg_plane_blocks(z->img_comp[n].y, z->mcu_y1 * z->img_comp[n].v);
+   if (j1 > by0 + (index+1) * f->band) j1 = by0 + (index+1) * f->band;
+   for (j=by0 + index * f->band; j < j1; ++j) {
+      for (i=bx0; i < w; ++i) {
+         stbi__jpeg_dequantize(data, stbi__jpeg_prog_block(z, n, i, j, NULL), z->coeff_end, z->dequant[z->img_comp[n].tq]);
+         z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*(j-by0)+i-bx0)*bs, z->img_comp[n].w2, data);
+      }
+   }
 }
 
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
+      // dequantize and idct the data, in bands of block rows
+      stbi__jpeg_finish_jobs f;
+      int n, rows=0, count=0, comp_rows[4];
       for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
+         comp_rows[n] = stbi__jpeg_plane_blocks(z->img_comp[n].y, z->mcu_y1 * z->img_comp[n].v) - z->mcu_y0 * z->img_comp[n].v;
+         rows += comp_rows[n];
       }
+      f.z = z;
+      f.band = rows / stbi__parallel_jobs(rows, 4);
+      for (n=0; n < z->s->img_n; ++n) {
+         f.jobs[n] = (comp_rows[n] + f.band-1) / f.band;
+         count += f.jobs[n];
+      }
+      stbi__parallel_for(stbi__jpeg_finish_job, &f, count);
    }
 }
 
@@ -3147,6 +5144,8 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
                v[i] = stbi__get8(z->s);
             if (tc != 0)
                stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
+            else
+               stbi__build_fast_dc(z->fast_dc[th], z->huff_dc + th);
             L -= n;
          }
          return L==0;
@@ -3242,19 +5241,16 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
-      if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
-         z->img_comp[i].raw_coeff = 0;
-         z->img_comp[i].coeff = 0;
-      }
-      if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
-         z->img_comp[i].linebuf = NULL;
-      }
+      // with keep_coeff, the first component's block has them all
+      if (i == 0 || !z->keep_coeff)
+         stbi__free(z->img_comp[i].coeff);
+      stbi__free(z->img_comp[i].nonzero);
+      z->img_comp[i].coeff = NULL;
+      z->img_comp[i].nonzero = NULL;
    }
    return why;
 }
@@ -3263,6 +5259,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
    int Lf,p,i,q, h_max=1,v_max=1,c;
+   short *next_coeff = NULL;
    Lf = stbi__get16be(s);         if (Lf < 11) return stbi__err("bad SOF len","Corrupt JPEG"); // JPEG
    p  = stbi__get8(s);            if (p != 8) return stbi__err("only 8-bit","JPEG format not supported: 8-bit only"); // JPEG baseline
    s->img_y = stbi__get16be(s);   if (s->img_y == 0) return stbi__err("no header height", "JPEG format not supported: delayed height"); // Legal, but we don't handle it--but neither does IJG
@@ -3272,10 +5269,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    c = stbi__get8(s);
    if (c != 3 && c != 1 && c != 4) return stbi__err("bad component count","Corrupt JPEG");
    s->img_n = c;
-   for (i=0; i < c; ++i) {
+   for (i=0; i < c; ++i)
       z->img_comp[i].data = NULL;
-      z->img_comp[i].linebuf = NULL;
-   }
 
    if (Lf != 8+3*s->img_n) return stbi__err("bad SOF len","Corrupt JPEG");
 
@@ -3315,6 +5310,42 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    // these sizes can't be more than 17 bits
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->mcu_x0 = z->mcu_y0 = 0;
+   z->mcu_x1 = z->img_mcu_x;
+   z->mcu_y1 = z->img_mcu_y;
+   if (s->region) {
+      // the region is in output pixels, after scaling down. we decode the
+      // MCUs it touches, plus one more on each side where chroma gets
+      // upsampled, since that blends in the neighboring samples
+      stbi__region *r = s->region;
+      int round = (1 << z->scale) - 1;
+      int mw = z->img_mcu_w >> z->scale, mh = z->img_mcu_h >> z->scale;
+      if (!stbi__clip_region(r, (s->img_x + round) >> z->scale, (s->img_y + round) >> z->scale)) return 0;
+      z->mcu_x0 = r->x / mw - (h_max > 1);
+      z->mcu_y0 = r->y / mh - (v_max > 1);
+      z->mcu_x1 = (r->x + r->w + mw-1) / mw + (h_max > 1);
+      z->mcu_y1 = (r->y + r->h + mh-1) / mh + (v_max > 1);
+      if (z->mcu_x0 < 0) z->mcu_x0 = 0;
+      if (z->mcu_y0 < 0) z->mcu_y0 = 0;
+      if (z->mcu_x1 > z->img_mcu_x) z->mcu_x1 = z->img_mcu_x;
+      if (z->mcu_y1 > z->img_mcu_y) z->mcu_y1 = z->img_mcu_y;
+   }
+
+   if (z->keep_coeff) {
+      // stbi_jpeg_coefficients hands the coefficients out as they are, so
+      // all the components get theirs from one block
+      int blocks = 0;
+      for (i=0; i < s->img_n; ++i) {
+         int bw = z->img_mcu_x * z->img_comp[i].h, bh = z->img_mcu_y * z->img_comp[i].v;
+         if (!stbi__mad2sizes_valid(bw, bh, 0) || !stbi__addsizes_valid(blocks, bw * bh))
+            return stbi__err("too large", "Image too large to decode");
+         blocks += bw * bh;
+      }
+      next_coeff = (short *) stbi__malloc_mad2(blocks, 64 * sizeof(short), 0);
+      if (next_coeff == NULL)
+         return stbi__err("outofmem", "Out of memory");
+      memset(next_coeff, 0, (size_t) blocks * 64 * sizeof(short));
+   }
 
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
@@ -3327,24 +5358,43 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].coeff = 0;
-      z->img_comp[i].raw_coeff = 0;
-      z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-         if (z->img_comp[i].raw_coeff == NULL)
+      // when scaling down, blocks decode to fewer pixels
+      z->img_comp[i].w2 = (z->mcu_x1 - z->mcu_x0) * z->img_comp[i].h * (8 >> z->scale);
+      z->img_comp[i].h2 = (z->mcu_y1 - z->mcu_y0) * z->img_comp[i].v * (8 >> z->scale);
+      z->img_comp[i].coeff = NULL;
+      z->img_comp[i].nonzero = NULL;
+      if (!z->keep_coeff) {
+         z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+         if (z->img_comp[i].raw_data == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+         // align blocks for idct using mmx/sse
+         z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      }
+      if (z->progressive || z->keep_coeff) {
+         // the coefficients have to be kept until the last scan. we only keep
+         // the ones the IDCT will use, of the blocks in the planes; the
+         // refinement scans only need to know which of the rest are nonzero.
+         // nothing below the planes is decoded at all. with keep_coeff, that
+         // is all of them, also for baseline JPEGs
+         int bw = (z->mcu_x1 - z->mcu_x0) * z->img_comp[i].h;
+         int bh = (z->mcu_y1 - z->mcu_y0) * z->img_comp[i].v;
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->mcu_y1 * z->img_comp[i].v;
+         if (z->keep_coeff) {
+            z->img_comp[i].coeff = next_coeff;
+            next_coeff += bw * bh * 64;
+         } else {
+            z->img_comp[i].coeff = (short *) stbi__malloc_mad3(bw, bh, z->coeff_end * sizeof(short), 0);
+            if (z->img_comp[i].coeff == NULL)
+               return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+            memset(z->img_comp[i].coeff, 0, (size_t) bw * bh * z->coeff_end * sizeof(short));
+         }
+         if (z->coeff_end < 64 || z->mcu_x0 > 0 || z->mcu_x1 < z->img_mcu_x || z->mcu_y0 > 0) {
+            z->img_comp[i].nonzero = (stbi_uc *) stbi__malloc_mad3(z->img_comp[i].coeff_w, z->img_comp[i].coeff_h, 8, 0);
+            if (z->img_comp[i].nonzero == NULL)
+               return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+            memset(z->img_comp[i].nonzero, 0, (size_t) z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 8);
+         }
       }
    }
 
@@ -3412,7 +5462,8 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    int m;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
-      j->img_comp[m].raw_coeff = NULL;
+      j->img_comp[m].coeff = NULL;
+      j->img_comp[m].nonzero = NULL;
    }
    j->restart_interval = 0;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
@@ -3439,8 +5490,17 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          m = stbi__get_marker(j);
       }
    }
-   if (j->progressive)
+   if (j->progressive && !j->keep_coeff) {
       stbi__jpeg_finish(j);
+      // done with the coefficients; don't keep them around while the
+      // output image is allocated and converted
+      for (m=0; m < j->s->img_n; ++m) {
+         stbi__free(j->img_comp[m].coeff);
+         stbi__free(j->img_comp[m].nonzero);
+         j->img_comp[m].coeff = NULL;
+         j->img_comp[m].nonzero = NULL;
+      }
+   }
    return 1;
 }
 
@@ -3449,6 +5509,10 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
 typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
                                     int w, int hs);
 
+// 2x horizontally subsampled chroma, upsampled and converted in one go
+typedef void (*YCbCr_h2_to_RGB_func)(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far,
+                                     stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step);
+
 #define stbi__div4(x) ((stbi_uc) ((x) >> 2))
 
 static stbi_uc *resample_row_1(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
@@ -3525,98 +5589,106 @@ static stbi_uc *stbi__resample_row_hv_2(stbi_uc *out, stbi_uc *in_near, stbi_uc
 }
 
 #if defined(STBI_SSE2) || defined(STBI_NEON)
-static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
-{
-   // need to generate 2x2 samples for every one in input
-   int i=0,t0,t1;
+// 2x2 upsample input pixels i..i+7 to 16 output pixels, where t1 is the
+// vertically filtered value of pixel i-1 (or of pixel 0 when i is 0). reads
+// pixel i+8, so it can't do the last pixel of a row
+#if defined(STBI_SSE2)
+stbi__forceinline static __m128i stbi__resample_hv_2_8(stbi_uc const *in_near, stbi_uc const *in_far, int i, int t1)
+{
+   // load and perform the vertical filtering pass
+   // this uses 3*x + y = 4*x + (y - x)
+   __m128i zero  = _mm_setzero_si128();
+   __m128i farb  = _mm_loadl_epi64((__m128i *) (in_far + i));
+   __m128i nearb = _mm_loadl_epi64((__m128i *) (in_near + i));
+   __m128i farw  = _mm_unpacklo_epi8(farb, zero);
+   __m128i nearw = _mm_unpacklo_epi8(nearb, zero);
+   __m128i diff  = _mm_sub_epi16(farw, nearw);
+   __m128i nears = _mm_slli_epi16(nearw, 2);
+   __m128i curr  = _mm_add_epi16(nears, diff); // current row
+
+   // horizontal filter works the same based on shifted vers of current
+   // row. "prev" is current row shifted right by 1 pixel; we need to
+   // insert the previous pixel value (from t1).
+   // "next" is current row shifted left by 1 pixel, with first pixel
+   // of next block of 8 pixels added in.
+   __m128i prv0 = _mm_slli_si128(curr, 2);
+   __m128i nxt0 = _mm_srli_si128(curr, 2);
+   __m128i prev = _mm_insert_epi16(prv0, t1, 0);
+   __m128i next = _mm_insert_epi16(nxt0, 3*in_near[i+8] + in_far[i+8], 7);
+
+   // horizontal filter, polyphase implementation since it's convenient:
+   // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+   // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+   // note the shared term.
+   __m128i bias  = _mm_set1_epi16(8);
+   __m128i curs = _mm_slli_epi16(curr, 2);
+   __m128i prvd = _mm_sub_epi16(prev, curr);
+   __m128i nxtd = _mm_sub_epi16(next, curr);
+   __m128i curb = _mm_add_epi16(curs, bias);
+   __m128i even = _mm_add_epi16(prvd, curb);
+   __m128i odd  = _mm_add_epi16(nxtd, curb);
+
+   // interleave even and odd pixels, then undo scaling.
+   __m128i int0 = _mm_unpacklo_epi16(even, odd);
+   __m128i int1 = _mm_unpackhi_epi16(even, odd);
+   __m128i de0  = _mm_srli_epi16(int0, 4);
+   __m128i de1  = _mm_srli_epi16(int1, 4);
+
+   // pack
+   return _mm_packus_epi16(de0, de1);
+}
+#elif defined(STBI_NEON)
+stbi__forceinline static uint8x16_t stbi__resample_hv_2_8(stbi_uc const *in_near, stbi_uc const *in_far, int i, int t1)
+{
+   // load and perform the vertical filtering pass
+   // this uses 3*x + y = 4*x + (y - x)
+   uint8x8_t farb  = vld1_u8(in_far + i);
+   uint8x8_t nearb = vld1_u8(in_near + i);
+   int16x8_t diff  = vreinterpretq_s16_u16(vsubl_u8(farb, nearb));
+   int16x8_t nears = vreinterpretq_s16_u16(vshll_n_u8(nearb, 2));
+   int16x8_t curr  = vaddq_s16(nears, diff); // current row
+
+   // horizontal filter works the same based on shifted vers of current
+   // row. "prev" is current row shifted right by 1 pixel; we need to
+   // insert the previous pixel value (from t1).
+   // "next" is current row shifted left by 1 pixel, with first pixel
+   // of next block of 8 pixels added in.
+   int16x8_t prv0 = vextq_s16(curr, curr, 7);
+   int16x8_t nxt0 = vextq_s16(curr, curr, 1);
+   int16x8_t prev = vsetq_lane_s16(t1, prv0, 0);
+   int16x8_t next = vsetq_lane_s16(3*in_near[i+8] + in_far[i+8], nxt0, 7);
+
+   // horizontal filter, polyphase implementation since it's convenient:
+   // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+   // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+   // note the shared term.
+   int16x8_t curs = vshlq_n_s16(curr, 2);
+   int16x8_t prvd = vsubq_s16(prev, curr);
+   int16x8_t nxtd = vsubq_s16(next, curr);
+   int16x8_t even = vaddq_s16(curs, prvd);
+   int16x8_t odd  = vaddq_s16(curs, nxtd);
+
+   // undo scaling and round, then interleave the even/odd phases
+   uint8x8x2_t o = vzip_u8(vqrshrun_n_s16(even, 4), vqrshrun_n_s16(odd, 4));
+   return vcombine_u8(o.val[0], o.val[1]);
+}
+#endif
 
-   if (w == 1) {
-      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
-      return out;
-   }
+// the 8-at-a-time loop and the scalar tail of the SIMD versions, starting at
+// input pixel i, where t1 is the vertically filtered value of pixel i-1 (or
+// of pixel 0 when i is 0)
+static stbi_uc *stbi__resample_row_hv_2_from(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int i, int t1)
+{
+   int t0;
 
-   t1 = 3*in_near[0] + in_far[0];
    // process groups of 8 pixels for as long as we can.
    // note we can't handle the last pixel in a row in this loop
    // because we need to handle the filter boundary conditions.
    for (; i < ((w-1) & ~7); i += 8) {
 #if defined(STBI_SSE2)
-      // load and perform the vertical filtering pass
-      // this uses 3*x + y = 4*x + (y - x)
-      __m128i zero  = _mm_setzero_si128();
-      __m128i farb  = _mm_loadl_epi64((__m128i *) (in_far + i));
-      __m128i nearb = _mm_loadl_epi64((__m128i *) (in_near + i));
-      __m128i farw  = _mm_unpacklo_epi8(farb, zero);
-      __m128i nearw = _mm_unpacklo_epi8(nearb, zero);
-      __m128i diff  = _mm_sub_epi16(farw, nearw);
-      __m128i nears = _mm_slli_epi16(nearw, 2);
-      __m128i curr  = _mm_add_epi16(nears, diff); // current row
-
-      // horizontal filter works the same based on shifted vers of current
-      // row. "prev" is current row shifted right by 1 pixel; we need to
-      // insert the previous pixel value (from t1).
-      // "next" is current row shifted left by 1 pixel, with first pixel
-      // of next block of 8 pixels added in.
-      __m128i prv0 = _mm_slli_si128(curr, 2);
-      __m128i nxt0 = _mm_srli_si128(curr, 2);
-      __m128i prev = _mm_insert_epi16(prv0, t1, 0);
-      __m128i next = _mm_insert_epi16(nxt0, 3*in_near[i+8] + in_far[i+8], 7);
-
-      // horizontal filter, polyphase implementation since it's convenient:
-      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
-      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
-      // note the shared term.
-      __m128i bias  = _mm_set1_epi16(8);
-      __m128i curs = _mm_slli_epi16(curr, 2);
-      __m128i prvd = _mm_sub_epi16(prev, curr);
-      __m128i nxtd = _mm_sub_epi16(next, curr);
-      __m128i curb = _mm_add_epi16(curs, bias);
-      __m128i even = _mm_add_epi16(prvd, curb);
-      __m128i odd  = _mm_add_epi16(nxtd, curb);
-
-      // interleave even and odd pixels, then undo scaling.
-      __m128i int0 = _mm_unpacklo_epi16(even, odd);
-      __m128i int1 = _mm_unpackhi_epi16(even, odd);
-      __m128i de0  = _mm_srli_epi16(int0, 4);
-      __m128i de1  = _mm_srli_epi16(int1, 4);
-
-      // pack and write output
-      __m128i outv = _mm_packus_epi16(de0, de1);
-      _mm_storeu_si128((__m128i *) (out + i*2), outv);
+      _mm_storeu_si128((__m128i *) (out + i*2), stbi__resample_hv_2_8(in_near, in_far, i, t1));
 #elif defined(STBI_NEON)
-      // load and perform the vertical filtering pass
-      // this uses 3*x + y = 4*x + (y - x)
-      uint8x8_t farb  = vld1_u8(in_far + i);
-      uint8x8_t nearb = vld1_u8(in_near + i);
-      int16x8_t diff  = vreinterpretq_s16_u16(vsubl_u8(farb, nearb));
-      int16x8_t nears = vreinterpretq_s16_u16(vshll_n_u8(nearb, 2));
-      int16x8_t curr  = vaddq_s16(nears, diff); // current row
-
-      // horizontal filter works the same based on shifted vers of current
-      // row. "prev" is current row shifted right by 1 pixel; we need to
-      // insert the previous pixel value (from t1).
-      // "next" is current row shifted left by 1 pixel, with first pixel
-      // of next block of 8 pixels added in.
-      int16x8_t prv0 = vextq_s16(curr, curr, 7);
-      int16x8_t nxt0 = vextq_s16(curr, curr, 1);
-      int16x8_t prev = vsetq_lane_s16(t1, prv0, 0);
-      int16x8_t next = vsetq_lane_s16(3*in_near[i+8] + in_far[i+8], nxt0, 7);
-
-      // horizontal filter, polyphase implementation since it's convenient:
-      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
-      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
-      // note the shared term.
-      int16x8_t curs = vshlq_n_s16(curr, 2);
-      int16x8_t prvd = vsubq_s16(prev, curr);
-      int16x8_t nxtd = vsubq_s16(next, curr);
-      int16x8_t even = vaddq_s16(curs, prvd);
-      int16x8_t odd  = vaddq_s16(curs, nxtd);
-
-      // undo scaling and round, then store with even/odd phases interleaved
-      uint8x8x2_t o;
-      o.val[0] = vqrshrun_n_s16(even, 4);
-      o.val[1] = vqrshrun_n_s16(odd,  4);
-      vst2_u8(out + i*2, o);
+      vst1q_u8(out + i*2, stbi__resample_hv_2_8(in_near, in_far, i, t1));
 #endif
 
       // "previous" value for next iter
@@ -3635,9 +5707,144 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
    }
    out[w*2-1] = stbi__div4(t1+2);
 
+   return out;
+}
+
+static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
    STBI_NOTUSED(hs);
 
-   return out;
+   return stbi__resample_row_hv_2_from(out, in_near, in_far, w, 0, 3*in_near[0] + in_far[0]);
+}
+#endif
+
+#ifdef STBI__AVX2
+// same as the SSE2 version, 16 pixels at a time
+// input pixels i..i+15 to 32 output pixels, like stbi__resample_hv_2_8
+stbi__forceinline static STBI__TARGET_AVX2 __m256i stbi__resample_hv_2_16(stbi_uc const *in_near, stbi_uc const *in_far, int i, int t1)
+{
+   // vertical pass, 3*x + y = 4*x + (y - x)
+   __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+   __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+   __m256i diff  = _mm256_sub_epi16(farw, nearw);
+   __m256i nears = _mm256_slli_epi16(nearw, 2);
+   __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+   // "prev"/"next" are the current row shifted by one pixel across the
+   // two 128-bit lanes, with the neighbouring pixels inserted at the ends
+   __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+   __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+   __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+   __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+   // horizontal pass, polyphase as in the SSE2 version
+   __m256i bias = _mm256_set1_epi16(8);
+   __m256i curs = _mm256_slli_epi16(curr, 2);
+   __m256i prvd = _mm256_sub_epi16(prev, curr);
+   __m256i nxtd = _mm256_sub_epi16(next, curr);
+   __m256i curb = _mm256_add_epi16(curs, bias);
+   __m256i even = _mm256_add_epi16(prvd, curb);
+   __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+   // interleave even and odd pixels, then undo scaling; the in-lane
+   // unpacks and pack leave the bytes in order
+   __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+   __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+   __m256i de0  = _mm256_srli_epi16(int0, 4);
+   __m256i de1  = _mm256_srli_epi16(int1, 4);
+   return _mm256_packus_epi16(de0, de1);
+}
+
+static STBI__TARGET_AVX2 stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      _mm256_storeu_si256((__m256i *) (out + i*2), stbi__resample_hv_2_16(in_near, in_far, i, t1));
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   STBI_NOTUSED(hs);
+
+   return stbi__resample_row_hv_2_from(out, in_near, in_far, w, i, t1);
+}
+#endif
+
+#ifdef STBI__AVX512
+// lane-crossing shuffles for "prev" and "next" in the AVX-512 version
+static const short stbi__resample_prev_idx[32] = { 0,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30 };
+static const short stbi__resample_next_idx[32] = { 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,31 };
+
+// input pixels i..i+31 to 64 output pixels, like stbi__resample_hv_2_8
+stbi__forceinline static STBI__TARGET_AVX512 __m512i stbi__resample_hv_2_32(stbi_uc const *in_near, stbi_uc const *in_far, int i, int t1)
+{
+   __m512i prev_idx = _mm512_loadu_si512((void const *) stbi__resample_prev_idx);
+   __m512i next_idx = _mm512_loadu_si512((void const *) stbi__resample_next_idx);
+
+   // vertical pass, 3*x + y = 4*x + (y - x)
+   __m512i farw  = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_far + i)));
+   __m512i nearw = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_near + i)));
+   __m512i diff  = _mm512_sub_epi16(farw, nearw);
+   __m512i nears = _mm512_slli_epi16(nearw, 2);
+   __m512i curr  = _mm512_add_epi16(nears, diff); // current row
+
+   __m512i prv0 = _mm512_permutexvar_epi16(prev_idx, curr);
+   __m512i nxt0 = _mm512_permutexvar_epi16(next_idx, curr);
+   __m512i prev = _mm512_mask_mov_epi16(prv0, (__mmask32) 1, _mm512_set1_epi16((short) t1));
+   __m512i next = _mm512_mask_mov_epi16(nxt0, (__mmask32) 0x80000000u, _mm512_set1_epi16((short) (3*in_near[i+32] + in_far[i+32])));
+
+   // horizontal pass, polyphase as in the SSE2 version
+   __m512i bias = _mm512_set1_epi16(8);
+   __m512i curs = _mm512_slli_epi16(curr, 2);
+   __m512i prvd = _mm512_sub_epi16(prev, curr);
+   __m512i nxtd = _mm512_sub_epi16(next, curr);
+   __m512i curb = _mm512_add_epi16(curs, bias);
+   __m512i even = _mm512_add_epi16(prvd, curb);
+   __m512i odd  = _mm512_add_epi16(nxtd, curb);
+
+   // interleave even and odd pixels, then undo scaling
+   __m512i int0 = _mm512_unpacklo_epi16(even, odd);
+   __m512i int1 = _mm512_unpackhi_epi16(even, odd);
+   __m512i de0  = _mm512_srli_epi16(int0, 4);
+   __m512i de1  = _mm512_srli_epi16(int1, 4);
+   return _mm512_packus_epi16(de0, de1);
+}
+
+// same as the SSE2 version, 32 pixels at a time
+static STBI__TARGET_AVX512 stbi_uc *stbi__resample_row_hv_2_avx512(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~31); i += 32) {
+      _mm512_storeu_si512((void *) (out + i*2), stbi__resample_hv_2_32(in_near, in_far, i, t1));
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+31] + in_far[i+31];
+   }
+
+   STBI_NOTUSED(hs);
+
+   return stbi__resample_row_hv_2_from(out, in_near, in_far, w, i, t1);
 }
 #endif
 
@@ -3655,186 +5862,492 @@ static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_
 // this is a reduced-precision calculation of YCbCr-to-RGB introduced
 // to make sure the code produces the same results in both SIMD and scalar
 #define stbi__float2fixed(x)  (((int) ((x) * 4096.0f + 0.5f)) << 8)
+stbi__forceinline static void stbi__YCbCr_to_RGB_pixel(stbi_uc *out, int y, int cb, int cr)
+{
+   int y_fixed = (y << 20) + (1<<19); // rounding
+   int r,g,b;
+   cr -= 128;
+   cb -= 128;
+   r = y_fixed +  cr* stbi__float2fixed(1.40200f);
+   g = y_fixed + (cr*-stbi__float2fixed(0.71414f)) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+   b = y_fixed                                     +   cb* stbi__float2fixed(1.77200f);
+   r >>= 20;
+   g >>= 20;
+   b >>= 20;
+   if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+   if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+   if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+   out[0] = (stbi_uc)r;
+   out[1] = (stbi_uc)g;
+   out[2] = (stbi_uc)b;
+   out[3] = 255;
+}
+
 static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step)
 {
    int i;
    for (i=0; i < count; ++i) {
-      int y_fixed = (y[i] << 20) + (1<<19); // rounding
-      int r,g,b;
-      int cr = pcr[i] - 128;
-      int cb = pcb[i] - 128;
-      r = y_fixed +  cr* stbi__float2fixed(1.40200f);
-      g = y_fixed + (cr*-stbi__float2fixed(0.71414f)) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
-      b = y_fixed                                     +   cb* stbi__float2fixed(1.77200f);
-      r >>= 20;
-      g >>= 20;
-      b >>= 20;
-      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
-      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
-      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
-      out[0] = (stbi_uc)r;
-      out[1] = (stbi_uc)g;
-      out[2] = (stbi_uc)b;
-      out[3] = 255;
+      stbi__YCbCr_to_RGB_pixel(out, y[i], pcb[i], pcr[i]);
+      out += step;
+   }
+}
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// convert 8 pixels to RGBA
+#ifdef STBI_SSE2
+// y_bytes, cb_bytes and cr_bytes have them in their low 8 bytes
+stbi__forceinline static void stbi__YCbCr_to_RGBA_8(stbi_uc *out, __m128i y_bytes, __m128i cb_bytes, __m128i cr_bytes)
+{
+   // this is a fairly straightforward implementation and not super-optimized.
+   __m128i signflip  = _mm_set1_epi8(-0x80);
+   __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
+   __m128i xw = _mm_set1_epi16(255); // alpha channel
+
+   __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+   __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+   // unpack to short (and left-shift cr, cb by 8)
+   __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
+   __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
+   __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
+
+   // color transform
+   __m128i yws = _mm_srli_epi16(yw, 4);
+   __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+   __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+   __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+   __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+   __m128i rws = _mm_add_epi16(cr0, yws);
+   __m128i gwt = _mm_add_epi16(cb0, yws);
+   __m128i bws = _mm_add_epi16(yws, cb1);
+   __m128i gws = _mm_add_epi16(gwt, cr1);
+
+   // descale
+   __m128i rw = _mm_srai_epi16(rws, 4);
+   __m128i bw = _mm_srai_epi16(bws, 4);
+   __m128i gw = _mm_srai_epi16(gws, 4);
+
+   // back to byte, set up for transpose
+   __m128i brb = _mm_packus_epi16(rw, bw);
+   __m128i gxb = _mm_packus_epi16(gw, xw);
+
+   // transpose to interleave channels
+   __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
+   __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
+   __m128i o0 = _mm_unpacklo_epi16(t0, t1);
+   __m128i o1 = _mm_unpackhi_epi16(t0, t1);
+
+   // store
+   _mm_storeu_si128((__m128i *) (out + 0), o0);
+   _mm_storeu_si128((__m128i *) (out + 16), o1);
+}
+#endif
+
+#ifdef STBI_NEON
+stbi__forceinline static void stbi__YCbCr_to_RGBA_8(stbi_uc *out, uint8x8_t y_bytes, uint8x8_t cb_bytes, uint8x8_t cr_bytes)
+{
+   // this is a fairly straightforward implementation and not super-optimized.
+   uint8x8_t signflip = vdup_n_u8(0x80);
+   int16x8_t cr_const0 = vdupq_n_s16(   (short) ( 1.40200f*4096.0f+0.5f));
+   int16x8_t cr_const1 = vdupq_n_s16( - (short) ( 0.71414f*4096.0f+0.5f));
+   int16x8_t cb_const0 = vdupq_n_s16( - (short) ( 0.34414f*4096.0f+0.5f));
+   int16x8_t cb_const1 = vdupq_n_s16(   (short) ( 1.77200f*4096.0f+0.5f));
+
+   int8x8_t cr_biased = vreinterpret_s8_u8(vsub_u8(cr_bytes, signflip));
+   int8x8_t cb_biased = vreinterpret_s8_u8(vsub_u8(cb_bytes, signflip));
+
+   // expand to s16
+   int16x8_t yws = vreinterpretq_s16_u16(vshll_n_u8(y_bytes, 4));
+   int16x8_t crw = vshll_n_s8(cr_biased, 7);
+   int16x8_t cbw = vshll_n_s8(cb_biased, 7);
+
+   // color transform
+   int16x8_t cr0 = vqdmulhq_s16(crw, cr_const0);
+   int16x8_t cb0 = vqdmulhq_s16(cbw, cb_const0);
+   int16x8_t cr1 = vqdmulhq_s16(crw, cr_const1);
+   int16x8_t cb1 = vqdmulhq_s16(cbw, cb_const1);
+   int16x8_t rws = vaddq_s16(yws, cr0);
+   int16x8_t gws = vaddq_s16(vaddq_s16(yws, cb0), cr1);
+   int16x8_t bws = vaddq_s16(yws, cb1);
+
+   // undo scaling, round, convert to byte
+   uint8x8x4_t o;
+   o.val[0] = vqrshrun_n_s16(rws, 4);
+   o.val[1] = vqrshrun_n_s16(gws, 4);
+   o.val[2] = vqrshrun_n_s16(bws, 4);
+   o.val[3] = vdup_n_u8(255);
+
+   // store, interleaving r/g/b/a
+   vst4_u8(out, o);
+}
+#endif
+
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   // step == 3 is pretty ugly on the final interleave, and i'm not convinced
+   // it's useful in practice (you wouldn't use it for textures, for example).
+   // so just accelerate step == 4 case. (for NEON, step=3 support would be
+   // easy to add. but is there demand?)
+   if (step == 4) {
+      for (; i+7 < count; i += 8) {
+#ifdef STBI_SSE2
+         stbi__YCbCr_to_RGBA_8(out, _mm_loadl_epi64((__m128i *) (y+i)), _mm_loadl_epi64((__m128i *) (pcb+i)), _mm_loadl_epi64((__m128i *) (pcr+i)));
+#else
+         stbi__YCbCr_to_RGBA_8(out, vld1_u8(y + i), vld1_u8(pcb + i), vld1_u8(pcr + i));
+#endif
+         out += 32;
+      }
+   }
+
+   for (; i < count; ++i) {
+      stbi__YCbCr_to_RGB_pixel(out, y[i], pcb[i], pcr[i]);
       out += step;
    }
 }
+#endif
 
-#if defined(STBI_SSE2) || defined(STBI_NEON)
-static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+#ifdef STBI__AVX2
+// same as the SSE2 version, 16 pixels at a time
+stbi__forceinline static STBI__TARGET_AVX2 void stbi__YCbCr_to_RGBA_16(stbi_uc *out, __m128i y_bytes, __m128i cb_bytes, __m128i cr_bytes)
+{
+   __m128i signflip  = _mm_set1_epi8(-0x80);
+   __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m256i y_bias = _mm256_set1_epi16(128);
+   __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+   // widen to short with y as (y << 8) + 128 and cr, cb as (c - 128) << 8,
+   // just like the SSE2 unpacks do
+   __m256i y_w  = _mm256_cvtepu8_epi16(y_bytes);
+   __m256i cr_w = _mm256_cvtepu8_epi16(_mm_xor_si128(cr_bytes, signflip));
+   __m256i cb_w = _mm256_cvtepu8_epi16(_mm_xor_si128(cb_bytes, signflip));
+   __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(y_w, 8), y_bias);
+   __m256i crw = _mm256_slli_epi16(cr_w, 8);
+   __m256i cbw = _mm256_slli_epi16(cb_w, 8);
+
+   // color transform
+   __m256i yws = _mm256_srli_epi16(yw, 4);
+   __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+   __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+   __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+   __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+   __m256i rws = _mm256_add_epi16(cr0, yws);
+   __m256i gwt = _mm256_add_epi16(cb0, yws);
+   __m256i bws = _mm256_add_epi16(yws, cb1);
+   __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+   // descale
+   __m256i rw = _mm256_srai_epi16(rws, 4);
+   __m256i bw = _mm256_srai_epi16(bws, 4);
+   __m256i gw = _mm256_srai_epi16(gws, 4);
+
+   // back to byte, set up for transpose
+   __m256i brb = _mm256_packus_epi16(rw, bw);
+   __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+   // transpose to interleave channels; each 128-bit lane ends up with
+   // 4 pixels of the first half and 4 of the second half
+   __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+   __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+   __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+   __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+   // store
+   _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+   _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+}
+
+static STBI__TARGET_AVX2 void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
 {
    int i = 0;
 
-#ifdef STBI_SSE2
-   // step == 3 is pretty ugly on the final interleave, and i'm not convinced
-   // it's useful in practice (you wouldn't use it for textures, for example).
-   // so just accelerate step == 4 case.
    if (step == 4) {
-      // this is a fairly straightforward implementation and not super-optimized.
-      __m128i signflip  = _mm_set1_epi8(-0x80);
-      __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
-      __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
-      __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
-      __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
-      __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
-      __m128i xw = _mm_set1_epi16(255); // alpha channel
-
-      for (; i+7 < count; i += 8) {
-         // load
-         __m128i y_bytes = _mm_loadl_epi64((__m128i *) (y+i));
-         __m128i cr_bytes = _mm_loadl_epi64((__m128i *) (pcr+i));
-         __m128i cb_bytes = _mm_loadl_epi64((__m128i *) (pcb+i));
-         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
-         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
-
-         // unpack to short (and left-shift cr, cb by 8)
-         __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
-         __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
-         __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
-
-         // color transform
-         __m128i yws = _mm_srli_epi16(yw, 4);
-         __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
-         __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
-         __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
-         __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
-         __m128i rws = _mm_add_epi16(cr0, yws);
-         __m128i gwt = _mm_add_epi16(cb0, yws);
-         __m128i bws = _mm_add_epi16(yws, cb1);
-         __m128i gws = _mm_add_epi16(gwt, cr1);
-
-         // descale
-         __m128i rw = _mm_srai_epi16(rws, 4);
-         __m128i bw = _mm_srai_epi16(bws, 4);
-         __m128i gw = _mm_srai_epi16(gws, 4);
-
-         // back to byte, set up for transpose
-         __m128i brb = _mm_packus_epi16(rw, bw);
-         __m128i gxb = _mm_packus_epi16(gw, xw);
-
-         // transpose to interleave channels
-         __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
-         __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
-         __m128i o0 = _mm_unpacklo_epi16(t0, t1);
-         __m128i o1 = _mm_unpackhi_epi16(t0, t1);
-
-         // store
-         _mm_storeu_si128((__m128i *) (out + 0), o0);
-         _mm_storeu_si128((__m128i *) (out + 16), o1);
-         out += 32;
+      for (; i+15 < count; i += 16) {
+         stbi__YCbCr_to_RGBA_16(out, _mm_loadu_si128((__m128i *) (y+i)), _mm_loadu_si128((__m128i *) (pcb+i)), _mm_loadu_si128((__m128i *) (pcr+i)));
+         out += 64;
       }
    }
+
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
 #endif
 
-#ifdef STBI_NEON
-   // in this version, step=3 support would be easy to add. but is there demand?
+#ifdef STBI__AVX512
+// same as the SSE2 version, 32 pixels at a time
+stbi__forceinline static STBI__TARGET_AVX512 void stbi__YCbCr_to_RGBA_32(stbi_uc *out, __m256i y_bytes, __m256i cb_bytes, __m256i cr_bytes)
+{
+   __m256i signflip  = _mm256_set1_epi8(-0x80);
+   __m512i cr_const0 = _mm512_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m512i cr_const1 = _mm512_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m512i cb_const0 = _mm512_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m512i cb_const1 = _mm512_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m512i y_bias = _mm512_set1_epi16(128);
+   __m512i xw = _mm512_set1_epi16(255); // alpha channel
+   // 64-bit chunks of the two interleaved halves, in pixel order
+   __m512i lo_idx = _mm512_setr_epi64(0,1,8,9,2,3,10,11);
+   __m512i hi_idx = _mm512_setr_epi64(4,5,12,13,6,7,14,15);
+
+   // widen, see the AVX2 version
+   __m512i y_w  = _mm512_cvtepu8_epi16(y_bytes);
+   __m512i cr_w = _mm512_cvtepu8_epi16(_mm256_xor_si256(cr_bytes, signflip));
+   __m512i cb_w = _mm512_cvtepu8_epi16(_mm256_xor_si256(cb_bytes, signflip));
+   __m512i yw  = _mm512_or_si512(_mm512_slli_epi16(y_w, 8), y_bias);
+   __m512i crw = _mm512_slli_epi16(cr_w, 8);
+   __m512i cbw = _mm512_slli_epi16(cb_w, 8);
+
+   // color transform
+   __m512i yws = _mm512_srli_epi16(yw, 4);
+   __m512i cr0 = _mm512_mulhi_epi16(cr_const0, crw);
+   __m512i cb0 = _mm512_mulhi_epi16(cb_const0, cbw);
+   __m512i cb1 = _mm512_mulhi_epi16(cbw, cb_const1);
+   __m512i cr1 = _mm512_mulhi_epi16(crw, cr_const1);
+   __m512i rws = _mm512_add_epi16(cr0, yws);
+   __m512i gwt = _mm512_add_epi16(cb0, yws);
+   __m512i bws = _mm512_add_epi16(yws, cb1);
+   __m512i gws = _mm512_add_epi16(gwt, cr1);
+
+   // descale
+   __m512i rw = _mm512_srai_epi16(rws, 4);
+   __m512i bw = _mm512_srai_epi16(bws, 4);
+   __m512i gw = _mm512_srai_epi16(gws, 4);
+
+   // back to byte, set up for transpose
+   __m512i brb = _mm512_packus_epi16(rw, bw);
+   __m512i gxb = _mm512_packus_epi16(gw, xw);
+
+   // transpose to interleave channels
+   __m512i t0 = _mm512_unpacklo_epi8(brb, gxb);
+   __m512i t1 = _mm512_unpackhi_epi8(brb, gxb);
+   __m512i o0 = _mm512_unpacklo_epi16(t0, t1);
+   __m512i o1 = _mm512_unpackhi_epi16(t0, t1);
+
+   // store
+   _mm512_storeu_si512((void *) (out + 0), _mm512_permutex2var_epi64(o0, lo_idx, o1));
+   _mm512_storeu_si512((void *) (out + 64), _mm512_permutex2var_epi64(o0, hi_idx, o1));
+}
+
+static STBI__TARGET_AVX512 void stbi__YCbCr_to_RGB_avx512(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
    if (step == 4) {
-      // this is a fairly straightforward implementation and not super-optimized.
-      uint8x8_t signflip = vdup_n_u8(0x80);
-      int16x8_t cr_const0 = vdupq_n_s16(   (short) ( 1.40200f*4096.0f+0.5f));
-      int16x8_t cr_const1 = vdupq_n_s16( - (short) ( 0.71414f*4096.0f+0.5f));
-      int16x8_t cb_const0 = vdupq_n_s16( - (short) ( 0.34414f*4096.0f+0.5f));
-      int16x8_t cb_const1 = vdupq_n_s16(   (short) ( 1.77200f*4096.0f+0.5f));
+      for (; i+31 < count; i += 32) {
+         stbi__YCbCr_to_RGBA_32(out, _mm256_loadu_si256((__m256i *) (y+i)), _mm256_loadu_si256((__m256i *) (pcb+i)), _mm256_loadu_si256((__m256i *) (pcr+i)));
+         out += 128;
+      }
+   }
 
-      for (; i+7 < count; i += 8) {
-         // load
-         uint8x8_t y_bytes  = vld1_u8(y + i);
-         uint8x8_t cr_bytes = vld1_u8(pcr + i);
-         uint8x8_t cb_bytes = vld1_u8(pcb + i);
-         int8x8_t cr_biased = vreinterpret_s8_u8(vsub_u8(cr_bytes, signflip));
-         int8x8_t cb_biased = vreinterpret_s8_u8(vsub_u8(cb_bytes, signflip));
+   stbi__YCbCr_to_RGB_avx2(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
 
-         // expand to s16
-         int16x8_t yws = vreinterpretq_s16_u16(vshll_n_u8(y_bytes, 4));
-         int16x8_t crw = vshll_n_s8(cr_biased, 7);
-         int16x8_t cbw = vshll_n_s8(cb_biased, 7);
+#ifdef STBI__AVX2
+// 4:2:0 and 4:2:2 straight to RGBA: the chroma of each row is upsampled
+// while it is converted, instead of into line buffers first. chroma rows
+// are upsampled 2x horizontally, and filtered between cb_near and cb_far
+// like stbi__resample_row_hv_2 does. for 4:2:2, cb_far and cr_far are NULL,
+// and they come out like stbi__resample_row_h_2 makes them. the results are
+// exactly those of upsampling and then converting. this only pays off with
+// the wide registers; with SSE2 the two passes measured faster, so there
+// (and in C) the kernel table has no fused version
+
+// the upsampled chroma for output pixel x, out of w input pixels
+stbi_inline static int stbi__resample_h_2_at(stbi_uc const *in_near, stbi_uc const *in_far, int w, int x)
+{
+   int i = x >> 1, t;
+   if (in_far == NULL) {
+      // stbi__resample_row_h_2 is the same as hv_2 with the same row twice,
+      // except that it weights the next to last output pixel the other way
+      if (x == 2*w-2 && w > 1) return stbi__div4(3*in_near[w-2] + in_near[w-1] + 2);
+      in_far = in_near;
+   }
+   t = 3*in_near[i] + in_far[i];
+   if (x & 1) {
+      if (i+1 >= w) return stbi__div4(t+2);
+      return stbi__div16(3*t + 3*in_near[i+1] + in_far[i+1] + 8);
+   } else {
+      if (i == 0) return stbi__div4(t+2);
+      return stbi__div16(3*t + 3*in_near[i-1] + in_far[i-1] + 8);
+   }
+}
 
-         // color transform
-         int16x8_t cr0 = vqdmulhq_s16(crw, cr_const0);
-         int16x8_t cb0 = vqdmulhq_s16(cbw, cb_const0);
-         int16x8_t cr1 = vqdmulhq_s16(crw, cr_const1);
-         int16x8_t cb1 = vqdmulhq_s16(cbw, cb_const1);
-         int16x8_t rws = vaddq_s16(yws, cr0);
-         int16x8_t gws = vaddq_s16(vaddq_s16(yws, cb0), cr1);
-         int16x8_t bws = vaddq_s16(yws, cb1);
+// the tail of the SIMD versions, from output pixel x on
+static void stbi__YCbCr_h2_to_RGB_from(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step, int x)
+{
+   int w = (count+1) >> 1;
+   for (; x < count; ++x)
+      stbi__YCbCr_to_RGB_pixel(out + x*step, y[x], stbi__resample_h_2_at(cb_near, cb_far, w, x), stbi__resample_h_2_at(cr_near, cr_far, w, x));
+}
 
-         // undo scaling, round, convert to byte
-         uint8x8x4_t o;
-         o.val[0] = vqrshrun_n_s16(rws, 4);
-         o.val[1] = vqrshrun_n_s16(gws, 4);
-         o.val[2] = vqrshrun_n_s16(bws, 4);
-         o.val[3] = vdup_n_u8(255);
+// 16 output pixels at a time, starting at input chroma pixel i
+static void stbi__YCbCr_h2_to_RGB_simd_from(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step, int i)
+{
+   int w = (count+1) >> 1;
+   if (step == 4) {
+      stbi_uc const *cbf = cb_far ? cb_far : cb_near;
+      stbi_uc const *crf = cr_far ? cr_far : cr_near;
+      int j = i ? i-1 : 0;
+      int cb1 = 3*cb_near[j] + cbf[j];
+      int cr1 = 3*cr_near[j] + crf[j];
+      // like stbi__resample_row_hv_2_from, this can't do the last chroma pixel
+      for (; i < ((w-1) & ~7); i += 8) {
+         __m128i cb = stbi__resample_hv_2_8(cb_near, cbf, i, cb1);
+         __m128i cr = stbi__resample_hv_2_8(cr_near, crf, i, cr1);
+         stbi__YCbCr_to_RGBA_8(out + i*8,      _mm_loadl_epi64((__m128i *) (y + i*2)), cb, cr);
+         stbi__YCbCr_to_RGBA_8(out + i*8 + 32, _mm_loadl_epi64((__m128i *) (y + i*2 + 8)), _mm_srli_si128(cb, 8), _mm_srli_si128(cr, 8));
+         cb1 = 3*cb_near[i+7] + cbf[i+7];
+         cr1 = 3*cr_near[i+7] + crf[i+7];
+      }
+   }
+   stbi__YCbCr_h2_to_RGB_from(out, y, cb_near, cb_far, cr_near, cr_far, count, step, i*2);
+}
 
-         // store, interleaving r/g/b/a
-         vst4_u8(out, o);
-         out += 8*4;
+// 32 output pixels at a time
+static STBI__TARGET_AVX2 void stbi__YCbCr_h2_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step)
+{
+   int i = 0, w = (count+1) >> 1;
+   if (step == 4) {
+      stbi_uc const *cbf = cb_far ? cb_far : cb_near;
+      stbi_uc const *crf = cr_far ? cr_far : cr_near;
+      int cb1 = 3*cb_near[0] + cbf[0];
+      int cr1 = 3*cr_near[0] + crf[0];
+      for (; i < ((w-1) & ~15); i += 16) {
+         __m256i cb = stbi__resample_hv_2_16(cb_near, cbf, i, cb1);
+         __m256i cr = stbi__resample_hv_2_16(cr_near, crf, i, cr1);
+         stbi__YCbCr_to_RGBA_16(out + i*8,      _mm_loadu_si128((__m128i *) (y + i*2)),      _mm256_castsi256_si128(cb),      _mm256_castsi256_si128(cr));
+         stbi__YCbCr_to_RGBA_16(out + i*8 + 64, _mm_loadu_si128((__m128i *) (y + i*2 + 16)), _mm256_extracti128_si256(cb, 1), _mm256_extracti128_si256(cr, 1));
+         cb1 = 3*cb_near[i+15] + cbf[i+15];
+         cr1 = 3*cr_near[i+15] + crf[i+15];
       }
    }
-#endif
+   stbi__YCbCr_h2_to_RGB_simd_from(out, y, cb_near, cb_far, cr_near, cr_far, count, step, i);
+}
 
-   for (; i < count; ++i) {
-      int y_fixed = (y[i] << 20) + (1<<19); // rounding
-      int r,g,b;
-      int cr = pcr[i] - 128;
-      int cb = pcb[i] - 128;
-      r = y_fixed + cr* stbi__float2fixed(1.40200f);
-      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
-      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
-      r >>= 20;
-      g >>= 20;
-      b >>= 20;
-      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
-      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
-      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
-      out[0] = (stbi_uc)r;
-      out[1] = (stbi_uc)g;
-      out[2] = (stbi_uc)b;
-      out[3] = 255;
-      out += step;
+#ifdef STBI__AVX512
+// 64 output pixels at a time
+static STBI__TARGET_AVX512 void stbi__YCbCr_h2_to_RGB_avx512(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count, int step)
+{
+   int i = 0, w = (count+1) >> 1;
+   if (step == 4) {
+      stbi_uc const *cbf = cb_far ? cb_far : cb_near;
+      stbi_uc const *crf = cr_far ? cr_far : cr_near;
+      int cb1 = 3*cb_near[0] + cbf[0];
+      int cr1 = 3*cr_near[0] + crf[0];
+      for (; i < ((w-1) & ~31); i += 32) {
+         __m512i cb = stbi__resample_hv_2_32(cb_near, cbf, i, cb1);
+         __m512i cr = stbi__resample_hv_2_32(cr_near, crf, i, cr1);
+         // (the maskz forms, since some GCCs warn about the plain ones)
+         stbi__YCbCr_to_RGBA_32(out + i*8,       _mm256_loadu_si256((__m256i *) (y + i*2)),      _mm512_maskz_extracti64x4_epi64(0xff, cb, 0), _mm512_maskz_extracti64x4_epi64(0xff, cr, 0));
+         stbi__YCbCr_to_RGBA_32(out + i*8 + 128, _mm256_loadu_si256((__m256i *) (y + i*2 + 32)), _mm512_maskz_extracti64x4_epi64(0xff, cb, 1), _mm512_maskz_extracti64x4_epi64(0xff, cr, 1));
+         cb1 = 3*cb_near[i+31] + cbf[i+31];
+         cr1 = 3*cr_near[i+31] + crf[i+31];
+      }
    }
+   stbi__YCbCr_h2_to_RGB_simd_from(out, y, cb_near, cb_far, cr_near, cr_far, count, step, i);
 }
 #endif
+#endif // STBI__AVX2
 
-// set up the kernels
-static void stbi__setup_jpeg(stbi__jpeg *j)
+// the kernels the JPEG decoder can swap out for faster versions
+typedef struct
 {
-   j->idct_block_kernel = stbi__idct_block;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+   void (*idct_block)(stbi_uc *out, int out_stride, short data[64]);
+   void (*YCbCr_to_RGB)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   resample_row_func resample_row_hv_2;
+   YCbCr_h2_to_RGB_func YCbCr_h2_to_RGB;
+} stbi__jpeg_kernel_table;
 
+static const stbi__jpeg_kernel_table stbi__jpeg_kernels_c =
+   { stbi__idct_block, stbi__YCbCr_to_RGB_row, stbi__resample_row_hv_2, NULL };
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+static const stbi__jpeg_kernel_table stbi__jpeg_kernels_simd =
+   { stbi__idct_simd, stbi__YCbCr_to_RGB_simd, stbi__resample_row_hv_2_simd, NULL };
+#endif
+#ifdef STBI__AVX2
+static const stbi__jpeg_kernel_table stbi__jpeg_kernels_avx2 =
+   { stbi__idct_avx2, stbi__YCbCr_to_RGB_avx2, stbi__resample_row_hv_2_avx2, stbi__YCbCr_h2_to_RGB_avx2 };
+#endif
+#ifdef STBI__AVX512
+static const stbi__jpeg_kernel_table stbi__jpeg_kernels_avx512 =
+   { stbi__idct_avx2, stbi__YCbCr_to_RGB_avx512, stbi__resample_row_hv_2_avx512, stbi__YCbCr_h2_to_RGB_avx512 };
+#endif
+
+// picked for every JPEG; it's only a cpuid or two, and unlike a cached
+// pointer, nothing that loads on several threads at once has to race on it
+static const stbi__jpeg_kernel_table *stbi__jpeg_pick_kernels(void)
+{
+   const stbi__jpeg_kernel_table *k = &stbi__jpeg_kernels_c;
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
-      j->idct_block_kernel = stbi__idct_simd;
-      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+      k = &stbi__jpeg_kernels_simd;
+   #ifdef STBI__AVX2
+      switch (stbi__avx_level()) {
+      #ifdef STBI__AVX512
+         case 2: k = &stbi__jpeg_kernels_avx512; break;
+      #endif
+         case 1: k = &stbi__jpeg_kernels_avx2; break;
+      }
+   #endif
    }
 #endif
-
 #ifdef STBI_NEON
-   j->idct_block_kernel = stbi__idct_simd;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   k = &stbi__jpeg_kernels_simd;
 #endif
+   return k;
+}
+
+// log2 of the factor set with stbi_set_jpeg_downscale
+static int stbi__jpeg_scale(void)
+{
+   int factor = stbi__jpeg_downscale;
+   return factor >= 8 ? 3 : factor >= 4 ? 2 : factor >= 2 ? 1 : 0;
+}
+
+// set up the kernels
+static void stbi__setup_jpeg(stbi__jpeg *j)
+{
+   const stbi__jpeg_kernel_table *k = stbi__jpeg_pick_kernels();
+   j->idct_block_kernel = k->idct_block;
+   j->YCbCr_to_RGB_kernel = k->YCbCr_to_RGB;
+   j->resample_row_hv_2_kernel = k->resample_row_hv_2;
+   j->YCbCr_h2_to_RGB_kernel = k->YCbCr_h2_to_RGB;
+   j->scale = stbi__jpeg_scale();
+   j->coeff_end = 64;
+   switch (j->scale) {
+      case 1: j->idct_block_kernel = stbi__idct_block_4x4; j->coeff_end = 25; break;
+      case 2: j->idct_block_kernel = stbi__idct_block_2x2; j->coeff_end =  5; break;
+      case 3: j->idct_block_kernel = stbi__idct_block_1x1; j->coeff_end =  1; break;
+   }
+}
+
+// clip x pixels, scaled down, to the part in MCUs [m0,m1) that are f pixels wide
+static int stbi__jpeg_window(int x, int scale, int m0, int m1, int f)
+{
+   x = (x + (1 << scale) - 1) >> scale;
+   if (x > m1 * f) x = m1 * f;
+   return x - m0 * f;
+}
+
+// once the blocks are decoded, make the image and component sizes match the
+// planes: smaller when scaling down, and just the decoded MCUs for a region.
+// the rest of the decoder then just sees a smaller image
+static void stbi__jpeg_scale_sizes(stbi__jpeg *z)
+{
+   int i, bs = 8 >> z->scale;
+   z->s->img_x = stbi__jpeg_window(z->s->img_x, z->scale, z->mcu_x0, z->mcu_x1, z->img_h_max * bs);
+   z->s->img_y = stbi__jpeg_window(z->s->img_y, z->scale, z->mcu_y0, z->mcu_y1, z->img_v_max * bs);
+   for (i=0; i < z->s->img_n; ++i) {
+      z->img_comp[i].x = stbi__jpeg_window(z->img_comp[i].x, z->scale, z->mcu_x0, z->mcu_x1, z->img_comp[i].h * bs);
+      z->img_comp[i].y = stbi__jpeg_window(z->img_comp[i].y, z->scale, z->mcu_y0, z->mcu_y1, z->img_comp[i].v * bs);
+   }
 }
 
 // clean up the temporary component buffers
@@ -3853,6 +6366,17 @@ typedef struct
    int ypos;    // which pre-expansion row we're on
 } stbi__resample;
 
+// put r in the state the row loop below would be in after j output rows
+static void stbi__resample_seek(stbi__resample *r, stbi_uc *data, int w2, int comp_y, int j)
+{
+   int t = j + (r->vs >> 1);
+   int q = t / r->vs;
+   r->ystep = t % r->vs;
+   r->ypos  = q;
+   r->line1 = data + w2 * (q < comp_y ? q : comp_y-1);
+   r->line0 = q == 0 ? data : data + w2 * (q-1 < comp_y ? q-1 : comp_y-1);
+}
+
 // fast 0..255 * 0..255 => 0..255 rounded multiplication
 static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
 {
@@ -3860,6 +6384,156 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4];
+   stbi_uc *output;   // row 0; may be the last row in memory if the image is flipped
+   stbi_uc *linebuf;  // decode_n line buffers and one output row per band
+   int stride;        // bytes from one output row to the next
+   int no_slack;      // nothing may be written past the end of the last row
+   int x0, y0, w, h;  // the part of the decoded image that is output
+   int n, decode_n, is_rgb;
+   int h2;            // YCbCr_h2_to_RGB_kernel upsamples the chroma
+   int band_rows, band_size;
+} stbi__jpeg_convert_jobs;
+
+// resample and color-convert one band of output rows
+static void stbi__jpeg_convert_job(void *user, int band)
+{
+   stbi__jpeg_convert_jobs *c = (stbi__jpeg_convert_jobs *) user;
+   stbi__jpeg *z = c->z;
+   int k, n = c->n, decode_n = c->decode_n, is_rgb = c->is_rgb;
+   unsigned int i,j,j1;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *cfar[4];
+   stbi_uc *linebuf[4], *lastrow;
+   stbi__resample res_comp[4];
+
+   j  = band * c->band_rows;
+   j1 = j + c->band_rows;
+   if (j1 > (unsigned int) c->h) j1 = c->h;
+   for (k=0; k < decode_n; ++k) {
+      res_comp[k] = c->res_comp[k];
+      stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y, c->y0 + j);
+      linebuf[k] = c->linebuf + band * c->band_size + k * (z->s->img_x + 3);
+   }
+   lastrow = c->linebuf + band * c->band_size + decode_n * (z->s->img_x + 3);
+
+   for (; j < j1; ++j) {
+      stbi_uc *dest = c->output + (ptrdiff_t) c->stride * (ptrdiff_t) j;
+      stbi_uc *row = dest, *out;
+      // 1- and 3-channel rows can be written with one byte past the last
+      // pixel. unless that is the start of the next row of this band, build
+      // the row on the side. so are rows that get cropped
+      if (c->w != (int) z->s->img_x)
+         row = lastrow;
+      else if ((n == 1 || n == 3) && (c->stride != n * c->w || (j+1 == j1 && (j1 < (unsigned int) c->h || c->no_slack))))
+         row = lastrow;
+      out = row;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         if (k && c->h2) {
+            // just the rows to upsample from
+            coutput[k] = y_bot ? r->line1 : r->line0;
+            cfar[k] = r->vs == 1 ? NULL : y_bot ? r->line0 : r->line1;
+         } else
+            coutput[k] = r->resample(linebuf[k],
+                                     y_bot ? r->line1 : r->line0,
+                                     y_bot ? r->line0 : r->line1,
+                                     r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (c->h2) {
+               z->YCbCr_h2_to_RGB_kernel(out, y, coutput[1], cfar[1], coutput[2], cfar[2], z->s->img_x, n);
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (row != dest)
+         memcpy(dest, row + n * c->x0, n * c->w);
+   }
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3870,6 +6544,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   stbi__jpeg_scale_sizes(z);
 
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
@@ -3887,27 +6562,33 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // resample and color-convert
    {
-      int k;
-      unsigned int i,j;
+      int k, bands;
+      stbi__jpeg_convert_jobs c;
+      stbi__into *into = z->s->into;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
-      stbi__resample res_comp[4];
+      if (into && ((int) z->s->img_x > into->w || (int) z->s->img_y > into->h)) {
+         stbi__cleanup_jpeg(z);
+         return stbi__errpuc("too large", "Image bigger than the destination");
+      }
+      if (z->s->region) {
+         // just the region, out of the MCUs around it
+         stbi__region *r = z->s->region;
+         c.x0 = r->x - z->mcu_x0 * (z->img_mcu_w >> z->scale);
+         c.y0 = r->y - z->mcu_y0 * (z->img_mcu_h >> z->scale);
+         c.w = r->w;
+         c.h = r->h;
+      } else {
+         c.x0 = c.y0 = 0;
+         c.w = z->s->img_x;
+         c.h = z->s->img_y;
+      }
 
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
+         stbi__resample *r = &c.res_comp[k];
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
          r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
 
          if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
          else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
@@ -3916,108 +6597,52 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          else                               r->resample = stbi__resample_row_generic;
       }
 
+      // the usual 4:2:0 and 4:2:2 YCbCr to RGBA skip the chroma line buffers, when
+      // the kernel table has a fused kernel for it
+      c.h2 = z->YCbCr_h2_to_RGB_kernel && n == 4 && z->s->img_n == 3 && !is_rgb && c.res_comp[0].hs == 1 && c.res_comp[0].vs == 1;
+      for (k=1; k < decode_n; ++k)
+         if (c.res_comp[k].hs != 2 || c.res_comp[k].vs > 2)
+            c.h2 = 0;
+
+      // rows are converted in bands, each with its own line buffers big
+      // enough for upsampling off the edges with upsample factor of 4
+      bands = stbi__parallel_jobs(c.h, 16);
+      c.band_rows = (c.h + bands-1) / bands;
+      bands = (c.h + c.band_rows-1) / c.band_rows;
+      c.band_size = decode_n * (z->s->img_x + 3) + 4 * z->s->img_x;
+      c.linebuf = (stbi_uc *) stbi__malloc_mad2(bands, c.band_size, 0);
+      if (!c.linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      if (into) {
+         // the caller's memory gets the final image
+         output = c.output = into->out;
+         c.stride = into->stride;
+         c.no_slack = 1;
+      } else {
+         output = (stbi_uc *) stbi__malloc_mad3(n, c.w, c.h, 1);
+         if (!output) { stbi__free(c.linebuf); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         c.output = output;
+         c.stride = n * c.w;
+         c.no_slack = 0;
+      }
+      if (stbi__vertically_flip_on_load) {
+         // write the rows bottom up
+         c.output += (ptrdiff_t) c.stride * (ptrdiff_t) (c.h-1);
+         c.stride = -c.stride;
+      }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
+      c.z = z;
+      c.n = n;
+      c.decode_n = decode_n;
+      c.is_rgb = is_rgb;
+      stbi__parallel_for(stbi__jpeg_convert_job, &c, bands);
+
+      stbi__free(c.linebuf);
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = c.w;
+      *out_y = c.h;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
       return output;
    }
@@ -4029,11 +6654,12 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   ri->flipped = 1; // load_jpeg_image writes the rows flipped if need be
+   ri->cropped = 1; // and only the region, if there is one
+   stbi__free(j);
    return result;
 }
 
@@ -4047,18 +6673,20 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
 static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
 {
+   int scale = stbi__jpeg_scale();
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_header)) {
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   // the size stbi_load will return
+   if (x) *x = (j->s->img_x + (1 << scale)-1) >> scale;
+   if (y) *y = (j->s->img_y + (1 << scale)-1) >> scale;
    if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
    return 1;
 }
@@ -4071,9 +6699,217 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    memset(j, 0, sizeof(stbi__jpeg));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
+   return result;
+}
+
+// decode up to the planes (or the coefficients, with keep_coeff) of a
+// YCbCr or greyscale JPEG. returns the decoder, which has to be cleaned up
+// and freed even if this fails, or NULL if it couldn't be allocated
+static stbi__jpeg *stbi__jpeg_decode_ycbcr(stbi__context *s, int keep_coeff, int *ok)
+{
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   *ok = 0;
+   if (!z) {
+      stbi__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   memset(z, 0, sizeof(stbi__jpeg));
+   z->s = s;
+   stbi__setup_jpeg(z);
+   if (keep_coeff) {
+      z->keep_coeff = 1;
+      z->scale = 0;
+      z->coeff_end = 64;
+   }
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (!stbi__decode_jpeg_image(z)) return z;
+   stbi__jpeg_scale_sizes(z);
+   if (s->img_n != 1 && (s->img_n != 3 || z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif))) {
+      stbi__err("not YCbCr", "Only YCbCr and greyscale JPEGs have planes");
+      return z;
+   }
+   *ok = 1;
+   return z;
+}
+
+// copy the decoded planes out, cropped to their size and flipped if need be
+static stbi_uc *stbi__jpeg_planes_main(stbi__context *s, int *x, int *y, int *planes, stbi_jpeg_plane plane[3])
+{
+   stbi__jpeg *z;
+   stbi_uc *result = NULL;
+   int k, j, n, ok, total = 0;
+
+   memset(plane, 0, 3 * sizeof(plane[0]));
+   z = stbi__jpeg_decode_ycbcr(s, 0, &ok);
+   if (!z) return NULL;
+   if (!ok) goto done;
+
+   n = s->img_n;
+   for (k=0; k < n; ++k) {
+      // each fit in the component buffer already, but not necessarily all
+      if (!stbi__addsizes_valid(total, z->img_comp[k].x * z->img_comp[k].y)) {
+         stbi__err("too large", "Image too large to decode");
+         goto done;
+      }
+      total += z->img_comp[k].x * z->img_comp[k].y;
+   }
+   result = (stbi_uc *) stbi__malloc(total);
+   if (!result) {
+      stbi__err("outofmem", "Out of memory");
+      goto done;
+   }
+
+   total = 0;
+   for (k=0; k < n; ++k) {
+      stbi_uc *p = result + total;
+      int w = z->img_comp[k].x, h = z->img_comp[k].y;
+      for (j=0; j < h; ++j)
+         memcpy(p + (size_t) w * (stbi__vertically_flip_on_load ? h-1-j : j), z->img_comp[k].data + (size_t) z->img_comp[k].w2 * j, w);
+      plane[k].data = p;
+      plane[k].w = w;
+      plane[k].h = h;
+      plane[k].sx = z->img_h_max / z->img_comp[k].h;
+      plane[k].sy = z->img_v_max / z->img_comp[k].v;
+      total += w * h;
+   }
+   *x = s->img_x;
+   *y = s->img_y;
+   if (planes) *planes = n;
+
+done:
+   stbi__cleanup_jpeg(z);
+   stbi__free(z);
+   return result;
+}
+
+// hand out the coefficients, which were decoded into one block, in natural order
+static short *stbi__jpeg_coefficients_main(stbi__context *s, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3])
+{
+   stbi__jpeg *z;
+   short *result = NULL;
+   int b, i, k, n, ok;
+
+   memset(comp, 0, 3 * sizeof(comp[0]));
+   z = stbi__jpeg_decode_ycbcr(s, 1, &ok);
+   if (!z) return NULL;
+   if (!ok) goto done;
+
+   n = s->img_n;
+   result = z->img_comp[0].coeff;
+   for (k=0; k < n; ++k) {
+      // as allocated in stbi__process_frame_header
+      int count = z->img_comp[k].coeff_w * z->img_comp[k].coeff_h;
+      short *c = z->img_comp[k].coeff;
+      if (z->progressive) {
+         // the progressive scans keep them in zigzag order
+         for (b=0; b < count; ++b, c += 64) {
+            short t[64];
+            memcpy(t, c, sizeof(t));
+            for (i=0; i < 64; ++i)
+               c[stbi__jpeg_dezigzag[i]] = t[i];
+         }
+      }
+      comp[k].coeff = z->img_comp[k].coeff;
+      z->img_comp[k].coeff = NULL;
+      for (i=0; i < 64; ++i)
+         comp[k].quant[i] = z->dequant[z->img_comp[k].tq][i];
+      comp[k].blocks_w = z->img_comp[k].coeff_w;
+      comp[k].blocks_h = z->img_comp[k].coeff_h;
+      comp[k].w = z->img_comp[k].x;
+      comp[k].h = z->img_comp[k].y;
+      comp[k].sx = z->img_h_max / z->img_comp[k].h;
+      comp[k].sy = z->img_v_max / z->img_comp[k].v;
+   }
+   *x = s->img_x;
+   *y = s->img_y;
+   if (planes) *planes = n;
+
+done:
+   stbi__cleanup_jpeg(z);
+   stbi__free(z);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_jpeg_planes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *planes, stbi_jpeg_plane plane[3])
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_planes_main(&s,x,y,planes,plane);
+}
+
+STBIDEF stbi_uc *stbi_jpeg_planes_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *planes, stbi_jpeg_plane plane[3])
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__jpeg_planes_main(&s,x,y,planes,plane);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_jpeg_planes_from_file(FILE *f, int *x, int *y, int *planes, stbi_jpeg_plane plane[3])
+{
+   stbi__context s;
+   stbi_uc *result;
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_planes_main(&s,x,y,planes,plane);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_jpeg_planes(char const *filename, int *x, int *y, int *planes, stbi_jpeg_plane plane[3])
+{
+   stbi__context s;
+   stbi__file file;
+   stbi_uc *result;
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__jpeg_planes_main(&s,x,y,planes,plane);
+   stbi__close_file(&file);
+   return result;
+}
+#endif
+
+STBIDEF short *stbi_jpeg_coefficients_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3])
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_coefficients_main(&s,x,y,planes,comp);
+}
+
+STBIDEF short *stbi_jpeg_coefficients_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3])
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__jpeg_coefficients_main(&s,x,y,planes,comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF short *stbi_jpeg_coefficients_from_file(FILE *f, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3])
+{
+   stbi__context s;
+   short *result;
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_coefficients_main(&s,x,y,planes,comp);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
    return result;
 }
+
+STBIDEF short *stbi_jpeg_coefficients(char const *filename, int *x, int *y, int *planes, stbi_jpeg_coeffs comp[3])
+{
+   stbi__context s;
+   stbi__file file;
+   short *result;
+   if (!stbi__open_file(&s, &file, filename)) return (short *) stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__jpeg_coefficients_main(&s,x,y,planes,comp);
+   stbi__close_file(&file);
+   return result;
+}
+#endif
 #endif
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
@@ -4086,20 +6922,33 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  10 // accelerate all cases in default tables, and pairs of short literals
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// Decoded symbols are stored as 32-bit entries so the inner loop gets everything
+// from one lookup:  bits 0-3 code length, 4-7 kind, 8-15 literal or extra bits,
+// 16-31 second literal or base length/distance. An entry of 0 means "not in fast table".
+#define STBI__ZK_LIT   1 // one literal (or code length symbol)
+#define STBI__ZK_LIT2  2 // two literals; code length is the sum of both
+#define STBI__ZK_COPY  3 // length or distance: base + extra bits
+#define STBI__ZK_EOB   4 // end of block
+#define STBI__ZK_BAD   5 // symbol that must not appear in compressed data
+
+#define STBI__ZT_CODELEN 0 // kinds of huffman tables
+#define STBI__ZT_LITLEN  1
+#define STBI__ZT_DIST    2
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+   stbi__uint32 fast[1 << STBI__ZFAST_BITS];
    stbi__uint16 firstcode[16];
    int maxcode[17];
    stbi__uint16 firstsymbol[16];
    stbi_uc  size[STBI__ZNSYMS];
-   stbi__uint16 value[STBI__ZNSYMS];
+   stbi__uint32 value[STBI__ZNSYMS];
 } stbi__zhuffman;
 
 stbi_inline static int stbi__bitreverse16(int n)
@@ -4119,7 +6968,37 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static stbi__uint32 stbi__zsym_entry(int type, int sym, int s)
+{
+   if (type == STBI__ZT_LITLEN) {
+      if (sym < 256)  return (sym << 8) | (STBI__ZK_LIT << 4) | s;
+      if (sym == 256) return (STBI__ZK_EOB << 4) | s;
+      if (sym >= 286) return (STBI__ZK_BAD << 4) | s; // per DEFLATE, length codes 286 and 287 must not appear in compressed data
+      sym -= 257;
+      return (stbi__zlength_base[sym] << 16) | (stbi__zlength_extra[sym] << 8) | (STBI__ZK_COPY << 4) | s;
+   }
+   if (type == STBI__ZT_DIST) {
+      if (sym >= 30) return (STBI__ZK_BAD << 4) | s; // per DEFLATE, distance codes 30 and 31 must not appear in compressed data
+      return (stbi__zdist_base[sym] << 16) | (stbi__zdist_extra[sym] << 8) | (STBI__ZK_COPY << 4) | s;
+   }
+   return (sym << 8) | (STBI__ZK_LIT << 4) | s;
+}
+
+static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num, int type)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
@@ -4150,9 +7029,9 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       int s = sizelist[i];
       if (s) {
          int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
+         stbi__uint32 fastv = stbi__zsym_entry(type, i, s);
          z->size [c] = (stbi_uc     ) s;
-         z->value[c] = (stbi__uint16) i;
+         z->value[c] = fastv;
          if (s <= STBI__ZFAST_BITS) {
             int j = stbi__bit_reverse(next_code[s],s);
             while (j < (1 << STBI__ZFAST_BITS)) {
@@ -4163,32 +7042,69 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
          ++next_code[s];
       }
    }
+   if (type == STBI__ZT_LITLEN) {
+      // where a literal leaves room in the index for a second complete literal code,
+      // decode both with one lookup. going downwards, fast[j >> s] is still unpaired.
+      for (i=(1 << STBI__ZFAST_BITS)-1; i >= 0; --i) {
+         stbi__uint32 e = z->fast[i];
+         if (((e >> 4) & 15) == STBI__ZK_LIT) {
+            int s = e & 15;
+            stbi__uint32 e2 = z->fast[i >> s];
+            if (((e2 >> 4) & 15) == STBI__ZK_LIT && s + (int) (e2 & 15) <= STBI__ZFAST_BITS)
+               z->fast[i] = ((e2 & 0xff00) << 8) | (e & 0xff00) | (STBI__ZK_LIT2 << 4) | (s + (e2 & 15));
+         }
+      }
+   }
    return 1;
 }
 
 // zlib-from-memory implementation for PNG reading
-//    because PNG allows splitting the zlib stream arbitrarily,
-//    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    because PNG allows splitting the zlib stream arbitrarily, the input
+//    can come in pieces: when one runs out, znext is asked for the next,
+//    so PNG hands over its IDAT chunks where they are without combining them
 
 typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
+   // if set, points zbuffer and zbuffer_end at the next (non-empty) piece of
+   // input and returns 1, or returns 0 at the end of the input
+   int (*znext)(void *user, stbi_uc **start, stbi_uc **end);
+   void *znext_user;
    int num_bits;
-   stbi__uint32 code_buffer;
+   int num_pad;   // zero bits appended past the end of input; reading them is an error
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_suspend;     // return STBI__ZFULL when the output is full instead of failing
+
+   int   z_state;       // where stbi__zinflate picks up, STBI__ZS_*
+   int   z_final;       // the current block is the last one
+   int   z_stored_left; // bytes left to copy in a stored block
 
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
+#define STBI__ZFULL  2  // stopped with the output buffer (nearly) full; make room and call again
+
+enum
+{
+   STBI__ZS_header,   // next is a block header
+   STBI__ZS_stored,   // copying a stored block
+   STBI__ZS_huffman,  // decoding a compressed block
+   STBI__ZS_done
+};
+
+static int stbi__znext(stbi__zbuf *z)
+{
+   return z->znext && z->znext(z->znext_user, &z->zbuffer, &z->zbuffer_end);
+}
+
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   return z->zbuffer >= z->zbuffer_end && !stbi__znext(z);
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4196,64 +7112,79 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return stbi__zeof(z) ? 0 : *z->zbuffer++;
 }
 
+stbi_inline static stbi__uint64 stbi__zget64le(const stbi_uc *p)
+{
+#if defined(STBI__X64_TARGET) || defined(STBI__X86_TARGET)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) (p[0] | (p[1] << 8) | (p[2] << 16) | ((stbi__uint32) p[3] << 24))
+        | ((stbi__uint64) (p[4] | (p[5] << 8) | (p[6] << 16) | ((stbi__uint32) p[7] << 24)) << 32);
+#endif
+}
+
+// Refill to at least 56 bits. Bits above num_bits may already hold the start
+// of the next input byte; OR-ing that byte in again later is harmless.
 static void stbi__fill_bits(stbi__zbuf *z)
 {
-   do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
-        z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
-        return;
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      z->code_buffer |= stbi__zget64le(z->zbuffer) << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+   } else {
+      while (z->num_bits < 56) {
+         if (z->zbuffer < z->zbuffer_end || stbi__znext(z))
+            z->code_buffer |= (stbi__uint64) *z->zbuffer++ << z->num_bits;
+         else
+            z->num_pad += 8;
+         z->num_bits += 8;
       }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   }
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+stbi_inline static int stbi__zoverread(stbi__zbuf *z)
+{
+   return z->num_bits < z->num_pad;
+}
+
+// returns the table entry for the code at the bottom of code_buffer, or 0 if invalid
+static stbi__uint32 stbi__zhuffman_decode_slowpath(stbi__zhuffman *z, stbi__uint64 code_buffer)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
-   if (s >= 16) return -1; // invalid code!
+   if (s >= 16) return 0; // invalid code!
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
-   if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
-   if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
-   a->code_buffer >>= s;
-   a->num_bits -= s;
+   if (b >= STBI__ZNSYMS) return 0; // some data was corrupt somewhere!
+   if (z->size[b] != s) return 0;  // was originally an assert, but report failure instead.
    return z->value[b];
 }
 
-stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
+stbi_inline static stbi__uint32 stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
-   int b,s;
-   if (a->num_bits < 16) {
-      if (stbi__zeof(a)) {
-         return -1;   /* report error for unexpected end of data. */
-      }
-      stbi__fill_bits(a);
-   }
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
-   if (b) {
-      s = b >> 9;
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return b & 511;
-   }
-   return stbi__zhuffman_decode_slowpath(a, z);
+   stbi__uint32 e;
+   if (a->num_bits < 16) stbi__fill_bits(a);
+   e = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   if (!e) e = stbi__zhuffman_decode_slowpath(z, a->code_buffer);
+   a->code_buffer >>= e & 15;
+   a->num_bits -= e & 15;
+   return e;
 }
 
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
@@ -4269,7 +7200,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4278,60 +7209,130 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+// the fast loop copies matches 8 bytes at a time, so it may write up to 7 bytes
+// past the longest match; it only runs while that much output space is left
+#define STBI__ZFAST_OUT_SLACK  (258 + 8)
 
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (zout >= a->zout_end) {
-            if (!stbi__zexpand(a, zout, 1)) return 0;
-            zout = a->zout;
-         }
-         *zout++ = (char) z;
-      } else {
-         stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
+      stbi__uint32 e;
+      stbi_uc *p;
+      int len,dist;
+
+      // Fast loop: while at least 8 input bytes remain and any match fits in the
+      // output, refill 64 bits per symbol without bounds checks. One refill covers
+      // a full length/distance pair (at most 15+5+15+13 bits). Anything unusual
+      // (end of block, corrupt data) drops to the careful path below, which
+      // decodes the same symbol again and reports errors.
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= STBI__ZFAST_OUT_SLACK) {
+         stbi__uint64 cb = a->code_buffer;
+         int nb = a->num_bits;
+         stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end - 8;
+         char *out_end = a->zout_end - STBI__ZFAST_OUT_SLACK;
+         const stbi__uint32 *lfast = a->z_length.fast, *dfast = a->z_distance.fast;
+         do {
+            stbi__uint32 d;
+            int s,k;
+            cb |= stbi__zget64le(in) << nb;
+            in += (63 - nb) >> 3;
+            nb |= 56;
+            e = lfast[cb & STBI__ZFAST_MASK];
+            k = (e >> 4) & 15;
+            if ((unsigned) (k - 1) < 2) {
+               // one or two literals per entry (k is the count), and up to three
+               // entries per refill since each code fits in STBI__ZFAST_BITS
+               int n = 3;
+               do {
+                  zout[0] = (char) (e >> 8);
+                  zout[1] = (char) (e >> 16);
+                  zout += k;
+                  cb >>= e & 15;
+                  nb -= e & 15;
+                  e = lfast[cb & STBI__ZFAST_MASK];
+                  k = (e >> 4) & 15;
+               } while (--n && (unsigned) (k - 1) < 2);
+               continue;
+            }
+            if (!e) e = stbi__zhuffman_decode_slowpath(&a->z_length, cb);
+            if (((e >> 4) & 15) != STBI__ZK_COPY) goto careful;
+            s = (e & 15) + ((e >> 8) & 15);
+            len = (int) (e >> 16) + (int) ((cb >> (e & 15)) & ((1 << ((e >> 8) & 15)) - 1));
+            d = dfast[(cb >> s) & STBI__ZFAST_MASK];
+            if (!d) d = stbi__zhuffman_decode_slowpath(&a->z_distance, cb >> s);
+            if (((d >> 4) & 15) != STBI__ZK_COPY) goto careful;
+            dist = (int) (d >> 16) + (int) ((cb >> (s + (d & 15))) & ((1 << ((d >> 8) & 15)) - 1));
+            if (zout - a->zout_start < dist) goto careful;
+            s += (d & 15) + ((d >> 8) & 15);
+            p = (stbi_uc *) (zout - dist);
+            if (dist >= 8) {
+               char *end = zout + len;
+               do {
+                  memcpy(zout, p, 8);
+                  zout += 8;
+                  p += 8;
+               } while (zout < end);
+               zout = end;
+            } else if (dist == 1) { // run of one byte; common in images.
+               memset(zout, *p, len);
+               zout += len;
+            } else {
+               do *zout++ = *p++; while (--len);
+            }
+            cb >>= s;
+            nb -= s;
+         } while (in <= in_end && zout <= out_end);
+      careful:
+         a->code_buffer = cb;
+         a->num_bits = nb;
+         a->zbuffer = in;
+      }
+
+      // a suspendable decode stops between symbols while any match still fits
+      if (a->z_suspend && a->zout_end - zout < 258) {
+         a->zout = zout;
+         return STBI__ZFULL;
+      }
+
+      e = stbi__zhuffman_decode(a, &a->z_length);
+      switch ((e >> 4) & 15) {
+         case STBI__ZK_LIT:
+         case STBI__ZK_LIT2:
+            if (a->zout_end - zout < (int) ((e >> 4) & 15)) {
+               if (!stbi__zexpand(a, zout, (e >> 4) & 15)) return 0;
+               zout = a->zout;
+            }
+            *zout++ = (char) (e >> 8);
+            if (((e >> 4) & 15) == STBI__ZK_LIT2)
+               *zout++ = (char) (e >> 16);
+            break;
+         case STBI__ZK_COPY:
+            len = (int) (e >> 16) + (int) stbi__zreceive(a, (e >> 8) & 15);
+            e = stbi__zhuffman_decode(a, &a->z_distance);
+            if (((e >> 4) & 15) != STBI__ZK_COPY) return stbi__err("bad huffman code","Corrupt PNG");
+            dist = (int) (e >> 16) + (int) stbi__zreceive(a, (e >> 8) & 15);
+            if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+            if (a->zout_end - zout < len) {
+               if (!stbi__zexpand(a, zout, len)) return 0;
+               zout = a->zout;
+            }
+            p = (stbi_uc *) (zout - dist);
+            if (dist == 1) { // run of one byte; common in images.
+               stbi_uc v = *p;
+               if (len) { do *zout++ = v; while (--len); }
+            } else {
+               if (len) { do *zout++ = *p++; while (--len); }
+            }
+            break;
+         case STBI__ZK_EOB:
             a->zout = zout;
+            if (stbi__zoverread(a)) return stbi__err("unexpected end","Corrupt PNG");
             return 1;
-         }
-         if (z >= 286) return stbi__err("bad huffman code","Corrupt PNG"); // per DEFLATE, length codes 286 and 287 must not appear in compressed data
-         z -= 257;
-         len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG"); // per DEFLATE, distance codes 30 and 31 must not appear in compressed data
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-         if (zout + len > a->zout_end) {
-            if (!stbi__zexpand(a, zout, len)) return 0;
-            zout = a->zout;
-         }
-         p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
-         } else {
-            if (len) { do *zout++ = *p++; while (--len); }
-         }
+         default:
+            return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
       }
+      if (stbi__zoverread(a)) return stbi__err("unexpected end","Corrupt PNG");
    }
 }
 
@@ -4353,12 +7354,13 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       int s = stbi__zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (stbi_uc) s;
    }
-   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19, STBI__ZT_CODELEN)) return 0;
 
    n = 0;
    while (n < ntot) {
-      int c = stbi__zhuffman_decode(a, &z_codelength);
-      if (c < 0 || c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
+      stbi__uint32 e = stbi__zhuffman_decode(a, &z_codelength);
+      int c = (int) (e >> 8) & 255;
+      if (!e || c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (stbi_uc) c;
       else {
@@ -4380,8 +7382,9 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (stbi__zoverread(a)) return stbi__err("unexpected end","Corrupt PNG");
+   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit, STBI__ZT_LITLEN)) return 0;
+   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, STBI__ZT_DIST)) return 0;
    return 1;
 }
 
@@ -4391,29 +7394,48 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
-   // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   for (k=0; k < 4; ++k)
+      header[k] = (stbi_uc) stbi__zreceive(a, 8);
+   if (stbi__zoverread(a)) return stbi__err("unexpected end","Corrupt PNG");
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   a->z_stored_left = len;
    return 1;
 }
 
+static int stbi__copy_uncompressed_block(stbi__zbuf *a)
+{
+   int len = a->z_stored_left;
+   if (a->zout + len > a->zout_end) {
+      if (a->z_suspend)
+         len = (int) (a->zout_end - a->zout);
+      else if (!stbi__zexpand(a, a->zout, len))
+         return 0;
+   }
+   a->z_stored_left -= len;
+   // the bit buffer holds whole bytes here, which come first
+   for (; len && a->num_bits >= 8; --len)
+      *a->zout++ = (char) stbi__zreceive(a, 8);
+   if (stbi__zoverread(a)) return stbi__err("read past buffer","Corrupt PNG");
+   if (len) {
+      // the bit buffer is empty, except for bits of the next input byte that
+      // a refill put above num_bits; the bytes are taken directly instead
+      a->code_buffer = 0;
+      do {
+         int n;
+         if (a->zbuffer >= a->zbuffer_end && !stbi__znext(a)) return stbi__err("read past buffer","Corrupt PNG");
+         n = (int) (a->zbuffer_end - a->zbuffer);
+         if (n > len) n = len;
+         memcpy(a->zout, a->zbuffer, n);
+         a->zbuffer += n;
+         a->zout += n;
+         len -= n;
+      } while (len);
+   }
+   return a->z_stored_left ? STBI__ZFULL : 1;
+}
+
 static int stbi__parse_zlib_header(stbi__zbuf *a)
 {
    int cmf   = stbi__zget8(a);
@@ -4457,40 +7479,68 @@ Init algorithm:
 }
 */
 
-static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+// decode blocks until the end of the stream (returns 1), an error (0), or,
+// if z_suspend is set, the output buffer filling up (STBI__ZFULL)
+static int stbi__zinflate(stbi__zbuf *a)
+{
+   int r, type;
+   for (;;) {
+      switch (a->z_state) {
+         case STBI__ZS_header:
+            a->z_final = stbi__zreceive(a,1);
+            type = stbi__zreceive(a,2);
+            if (type == 0) {
+               if (!stbi__parse_uncompressed_block(a)) return 0;
+               a->z_state = STBI__ZS_stored;
+            } else if (type == 3) {
+               return 0;
+            } else {
+               if (type == 1) {
+                  // use fixed code lengths
+                  if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS, STBI__ZT_LITLEN)) return 0;
+                  if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32, STBI__ZT_DIST)) return 0;
+               } else {
+                  if (!stbi__compute_huffman_codes(a)) return 0;
+               }
+               a->z_state = STBI__ZS_huffman;
+            }
+            break;
+         case STBI__ZS_stored:
+         case STBI__ZS_huffman:
+            r = a->z_state == STBI__ZS_stored ? stbi__copy_uncompressed_block(a) : stbi__parse_huffman_block(a);
+            if (r != 1) return r;
+            a->z_state = a->z_final ? STBI__ZS_done : STBI__ZS_header;
+            break;
+         default:
+            return 1;
+      }
+   }
+}
+
+static int stbi__zstart(stbi__zbuf *a, int parse_header)
 {
-   int final, type;
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->num_pad = 0;
    a->code_buffer = 0;
-   do {
-      final = stbi__zreceive(a,1);
-      type = stbi__zreceive(a,2);
-      if (type == 0) {
-         if (!stbi__parse_uncompressed_block(a)) return 0;
-      } else if (type == 3) {
-         return 0;
-      } else {
-         if (type == 1) {
-            // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
-         } else {
-            if (!stbi__compute_huffman_codes(a)) return 0;
-         }
-         if (!stbi__parse_huffman_block(a)) return 0;
-      }
-   } while (!final);
+   a->z_state = STBI__ZS_header;
    return 1;
 }
 
+static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+{
+   if (!stbi__zstart(a, parse_header)) return 0;
+   return stbi__zinflate(a);
+}
+
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
 {
    a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_suspend  = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4502,11 +7552,12 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
+   a.znext = NULL;
    if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4523,11 +7574,12 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
+   a.znext = NULL;
    if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4537,6 +7589,7 @@ STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.znext = NULL;
    if (stbi__do_zlib(&a, obuffer, olen, 0, 1))
       return (int) (a.zout - a.zout_start);
    else
@@ -4550,11 +7603,12 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer+len;
+   a.znext = NULL;
    if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4564,6 +7618,7 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.znext = NULL;
    if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
       return (int) (a.zout - a.zout_start);
    else
@@ -4596,6 +7651,94 @@ static stbi__pngchunk stbi__get_chunk_header(stbi__context *s)
    return c;
 }
 
+#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+
+// the zlib stream of a PNG: the data of the IDAT chunks in a row, handed to
+// the inflater as they come (stbi__zbuf's znext), so they're never put
+// together first. from memory they're read where they are; from callbacks,
+// through a buffer of STBI_FILE_BUFFER_SIZE bytes
+typedef struct
+{
+   stbi__context *s;
+   stbi__uint32 left;      // bytes of the current IDAT not handed out yet
+   stbi_uc *buf;           // callbacks only
+   stbi__pngchunk next;    // the chunk after the IDATs, once ended
+   int ended, truncated;
+} stbi__png_idat;
+
+// start on the IDAT chunk whose header was just read
+static int stbi__png_idat_start(stbi__png_idat *d, stbi__context *s, stbi__uint32 length)
+{
+   d->s = s;
+   d->left = length;
+   d->buf = NULL;
+   d->ended = d->truncated = 0;
+   if (s->io.read) {
+      d->buf = (stbi_uc *) stbi__malloc(STBI_FILE_BUFFER_SIZE);
+      if (!d->buf) return stbi__err("outofmem", "Out of memory");
+   }
+   return 1;
+}
+
+// once the current IDAT is used up, go on to the next one, if that's next
+static void stbi__png_idat_advance(stbi__png_idat *d)
+{
+   while (d->left == 0 && !d->ended) {
+      stbi__get32be(d->s); // CRC
+      d->next = stbi__get_chunk_header(d->s);
+      if (d->next.type == STBI__PNG_TYPE('I','D','A','T'))
+         d->left = d->next.length;
+      else
+         d->ended = 1;
+   }
+}
+
+static int stbi__png_idat_next(void *user, stbi_uc **start, stbi_uc **end)
+{
+   stbi__png_idat *d = (stbi__png_idat *) user;
+   stbi__context *s = d->s;
+   stbi__uint32 n;
+   stbi__png_idat_advance(d);
+   if (d->ended) return 0;
+   if (s->io.read) {
+      n = d->left < STBI_FILE_BUFFER_SIZE ? d->left : STBI_FILE_BUFFER_SIZE;
+      if (!stbi__getn(s, d->buf, (int) n)) n = 0;
+      *start = d->buf;
+   } else {
+      n = (stbi__uint32) (s->img_buffer_end - s->img_buffer);
+      if (n > d->left) n = d->left;
+      *start = s->img_buffer;
+      s->img_buffer += n;
+   }
+   if (n == 0) {
+      d->ended = d->truncated = 1;
+      return 0;
+   }
+   d->left -= n;
+   *end = *start + n;
+   return 1;
+}
+
+static void stbi__png_idat_input(stbi__zbuf *a, stbi__png_idat *d)
+{
+   a->zbuffer = a->zbuffer_end = NULL;
+   a->znext = stbi__png_idat_next;
+   a->znext_user = d;
+}
+
+// pass over what the inflater didn't read, up to the chunk after the IDATs,
+// to find out if they were cut short
+static int stbi__png_idat_end(stbi__png_idat *d)
+{
+   stbi_uc *start, *end;
+   while (stbi__png_idat_next(d, &start, &end))
+      ;
+   stbi__free(d->buf);
+   d->buf = NULL;
+   if (d->truncated) return stbi__err("outofdata","Corrupt PNG");
+   return 1;
+}
+
 static int stbi__check_png_header(stbi__context *s)
 {
    static const stbi_uc png_sig[8] = { 137,80,78,71,13,10,26,10 };
@@ -4605,11 +7748,34 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+// where finished scanlines go: to func for stbi_png_rows, or else into
+// memory in their final place and format. that's the caller's memory for
+// stbi_load_into, or for stbi_load 'image', allocated once the size is known.
+// for stbi_load_region, 'image' is just the region
+typedef struct
+{
+   stbi_png_row_func *func;
+   void *user;
+   stbi__into *into;
+   stbi__into image;
+   stbi__region *region;
+   int *x, *y, *comp;
+   int req_comp;
+   int keep16;    // 16-bit images stay 16-bit, for stbi_load_16
+   // what stbi__parse_png_file found out, for the pixel fixups
+   stbi_uc *palette, *tc;
+   stbi__uint16 *tc16;
+   int pal_img_n, pal_avx2, has_trans, de_iphone;
+   // the calling thread's settings; rows can be emitted on other threads
+   int flip, unpremultiply;
+} stbi__png_stream;
+
 typedef struct
 {
    stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
+   stbi_uc *expanded, *out;
    int depth;
+   stbi__png_stream *stream;  // only for STBI__SCAN_rows
 } stbi__png;
 
 
@@ -4618,297 +7784,751 @@ enum {
    STBI__F_sub=1,
    STBI__F_up=2,
    STBI__F_avg=3,
-   STBI__F_paeth=4,
-   // synthetic filters used for first scanline to avoid needing a dummy row of 0s
-   STBI__F_avg_first,
-   STBI__F_paeth_first
+   STBI__F_paeth=4
 };
 
-static stbi_uc first_row_filter[5] =
+static int stbi__paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+#ifdef STBI_SSE2
+// load/store one pixel of 'bpp' bytes without touching the bytes after it
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int bpp)
+{
+   stbi__uint32 lo;
+   stbi__uint16 hi;
+   switch (bpp) {
+      case 8: return _mm_loadl_epi64((const __m128i *) p);
+      case 6: memcpy(&lo, p, 4); memcpy(&hi, p+4, 2); return _mm_insert_epi16(_mm_cvtsi32_si128((int) lo), hi, 2);
+      case 4: memcpy(&lo, p, 4); return _mm_cvtsi32_si128((int) lo);
+      default: memcpy(&hi, p, 2); return _mm_cvtsi32_si128((int) (hi | (p[2] << 16)));
+   }
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int bpp)
+{
+   stbi__uint32 lo = (stbi__uint32) _mm_cvtsi128_si32(v);
+   stbi__uint16 hi;
+   switch (bpp) {
+      case 8: _mm_storel_epi64((__m128i *) p, v); break;
+      case 6: hi = (stbi__uint16) _mm_extract_epi16(v, 2); memcpy(p, &lo, 4); memcpy(p+4, &hi, 2); break;
+      case 4: memcpy(p, &lo, 4); break;
+      default: hi = (stbi__uint16) lo; memcpy(p, &hi, 2); p[2] = (stbi_uc) (lo >> 16); break;
+   }
+}
+
+// one pixel of Sub or Avg, which depend on the pixel to the left, a; they
+// return the unfiltered pixel, which is the next one's a
+stbi_inline static __m128i stbi__png_sub_px(stbi_uc *cur, const stbi_uc *raw, __m128i a, int bpp)
+{
+   a = _mm_add_epi8(stbi__png_load_px(raw, bpp), a);
+   stbi__png_store_px(cur, a, bpp);
+   return a;
+}
+
+stbi_inline static __m128i stbi__png_avg_px(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, __m128i a, int bpp)
+{
+   __m128i b = stbi__png_load_px(prior, bpp);
+   // pavgb rounds up, (a+b)>>1 doesn't
+   __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+   a = _mm_add_epi8(stbi__png_load_px(raw, bpp), avg);
+   stbi__png_store_px(cur, a, bpp);
+   return a;
+}
+
+// SSE2 unfiltering of 3, 4, 6 and 8 byte pixels (8- and 16-bit RGB and RGBA).
+// Avg and Paeth go a pixel at a time with all of its bytes in one register,
+// with a loop per pixel size so the loads and stores are fixed-size. Sub is a
+// prefix sum, done 16 bytes at a time for 4 and 8 byte pixels; Up has no
+// dependencies at all.
+static int stbi__unfilter_row_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter, int bpp)
+{
+   __m128i a = _mm_setzero_si128(); // pixel to the left, zero for the first
+   __m128i c = a;                   // same for the row above
+   int k = 0;
+
+   if (filter == STBI__F_none || (bpp != 3 && bpp != 4 && bpp != 6 && bpp != 8) || !stbi__sse2_available())
+      return 0;
+
+   switch (filter) {
+      case STBI__F_sub:
+         for (; bpp == 4 && k+16 <= nk; k += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            a = _mm_shuffle_epi32(x, 0xff);
+            _mm_storeu_si128((__m128i *) (cur+k), x);
+         }
+         for (; bpp == 8 && k+16 <= nk; k += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            a = _mm_unpackhi_epi64(x, x);
+            _mm_storeu_si128((__m128i *) (cur+k), x);
+         }
+         switch (bpp) {
+            case 3: for (; k < nk; k += 3) a = stbi__png_sub_px(cur+k, raw+k, a, 3); break;
+            case 4: for (; k < nk; k += 4) a = stbi__png_sub_px(cur+k, raw+k, a, 4); break;
+            case 6: for (; k < nk; k += 6) a = stbi__png_sub_px(cur+k, raw+k, a, 6); break;
+            case 8: for (; k < nk; k += 8) a = stbi__png_sub_px(cur+k, raw+k, a, 8); break;
+         }
+         break;
+
+      case STBI__F_up:
+         for (; k+16 <= nk; k += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+            __m128i b = _mm_loadu_si128((const __m128i *) (prior+k));
+            _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(x, b));
+         }
+         for (; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         break;
+
+      case STBI__F_avg:
+         switch (bpp) {
+            case 3: for (; k < nk; k += 3) a = stbi__png_avg_px(cur+k, raw+k, prior+k, a, 3); break;
+            case 4: for (; k < nk; k += 4) a = stbi__png_avg_px(cur+k, raw+k, prior+k, a, 4); break;
+            case 6: for (; k < nk; k += 6) a = stbi__png_avg_px(cur+k, raw+k, prior+k, a, 6); break;
+            case 8: for (; k < nk; k += 8) a = stbi__png_avg_px(cur+k, raw+k, prior+k, a, 8); break;
+         }
+         break;
+
+      case STBI__F_paeth: {
+         // this works in 16 bits; with b = up, c = up-left and p = a+b-c,
+         // the distances are |p-a| = |b-c|, |p-b| = |a-c| and
+         // |p-c| = |(b-c) + (a-c)|. ties go to a, then b, as in stbi__paeth
+         __m128i zero = _mm_setzero_si128();
+         __m128i lo8  = _mm_set1_epi16(0xff);
+         #define STBI__PAETH_LOOP(n) \
+            for (; k < nk; k += n) { \
+               __m128i b  = _mm_unpacklo_epi8(stbi__png_load_px(prior+k, n), zero); \
+               __m128i x  = _mm_unpacklo_epi8(stbi__png_load_px(raw+k, n), zero); \
+               __m128i pa = _mm_sub_epi16(b, c); \
+               __m128i pb = _mm_sub_epi16(a, c); \
+               __m128i pc = _mm_add_epi16(pa, pb); \
+               __m128i smallest, use_a, use_b, nearest; \
+               pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa)); \
+               pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb)); \
+               pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc)); \
+               smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+               use_a = _mm_cmpeq_epi16(smallest, pa); \
+               use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb)); \
+               nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)), \
+                                      _mm_andnot_si128(_mm_or_si128(use_a, use_b), c)); \
+               a = _mm_and_si128(_mm_add_epi16(x, nearest), lo8); \
+               c = b; \
+               stbi__png_store_px(cur+k, _mm_packus_epi16(a, a), n); \
+            }
+         switch (bpp) {
+            case 3: STBI__PAETH_LOOP(3) break;
+            case 4: STBI__PAETH_LOOP(4) break;
+            case 6: STBI__PAETH_LOOP(6) break;
+            case 8: STBI__PAETH_LOOP(8) break;
+         }
+         #undef STBI__PAETH_LOOP
+         break;
+      }
+   }
+   return 1;
+}
+
+// SSE2 unpacking of 1, 2 and 4-bit samples to bytes, 16 packed bytes at a
+// time; returns how many samples it did, always a whole number of bytes'
+// worth. scale is the stbi__depth_scale_table entry for gray, else 1; a
+// sample times the scale still fits in its byte, so a 16-bit multiply does
+// two at once
+static stbi__uint32 stbi__png_unpack_sse2(stbi_uc *out, const stbi_uc *in, stbi__uint32 n, int depth, int scale)
+{
+   __m128i mul = _mm_set1_epi16((short) scale);
+   stbi__uint32 k = 0;
+   int i;
+
+   if (!stbi__sse2_available())
+      return 0;
+
+   if (depth == 4) {
+      __m128i lo4 = _mm_set1_epi8(0x0f);
+      for (; k+32 <= n; k += 32, in += 16) {
+         __m128i v  = _mm_loadu_si128((const __m128i *) in);
+         __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), lo4);
+         __m128i lo = _mm_and_si128(v, lo4);
+         __m128i a  = _mm_unpacklo_epi8(hi, lo);
+         __m128i b  = _mm_unpackhi_epi8(hi, lo);
+         _mm_storeu_si128((__m128i *) (out+k   ), _mm_mullo_epi16(a, mul));
+         _mm_storeu_si128((__m128i *) (out+k+16), _mm_mullo_epi16(b, mul));
+      }
+   } else if (depth == 2) {
+      __m128i lo2 = _mm_set1_epi8(0x03);
+      for (; k+64 <= n; k += 64, in += 16) {
+         __m128i v  = _mm_loadu_si128((const __m128i *) in);
+         __m128i f3 = _mm_and_si128(_mm_srli_epi16(v, 6), lo2);
+         __m128i f2 = _mm_and_si128(_mm_srli_epi16(v, 4), lo2);
+         __m128i f1 = _mm_and_si128(_mm_srli_epi16(v, 2), lo2);
+         __m128i f0 = _mm_and_si128(v, lo2);
+         __m128i a  = _mm_unpacklo_epi8(f3, f2), b = _mm_unpacklo_epi8(f1, f0);
+         __m128i c  = _mm_unpackhi_epi8(f3, f2), d = _mm_unpackhi_epi8(f1, f0);
+         __m128i o[4];
+         o[0] = _mm_unpacklo_epi16(a, b);
+         o[1] = _mm_unpackhi_epi16(a, b);
+         o[2] = _mm_unpacklo_epi16(c, d);
+         o[3] = _mm_unpackhi_epi16(c, d);
+         for (i=0; i < 4; ++i)
+            _mm_storeu_si128((__m128i *) (out+k+16*i), _mm_mullo_epi16(o[i], mul));
+      }
+   } else {
+      // spread each byte over 8, then test a different bit in each copy;
+      // that gives 0 or 0xff, and the scale is 0xff or 1
+      __m128i bit = _mm_setr_epi8(-128,64,32,16,8,4,2,1, -128,64,32,16,8,4,2,1);
+      __m128i one = _mm_set1_epi8((char) scale);
+      for (; k+128 <= n; k += 128, in += 16) {
+         __m128i v = _mm_loadu_si128((const __m128i *) in);
+         __m128i w[2], d[4], o[8];
+         w[0] = _mm_unpacklo_epi8(v, v);
+         w[1] = _mm_unpackhi_epi8(v, v);
+         for (i=0; i < 2; ++i) {
+            d[2*i  ] = _mm_unpacklo_epi16(w[i], w[i]);
+            d[2*i+1] = _mm_unpackhi_epi16(w[i], w[i]);
+         }
+         for (i=0; i < 4; ++i) {
+            o[2*i  ] = _mm_unpacklo_epi32(d[i], d[i]);
+            o[2*i+1] = _mm_unpackhi_epi32(d[i], d[i]);
+         }
+         for (i=0; i < 8; ++i) {
+            __m128i t = _mm_cmpeq_epi8(_mm_and_si128(o[i], bit), bit);
+            _mm_storeu_si128((__m128i *) (out+k+16*i), _mm_and_si128(t, one));
+         }
+      }
+   }
+   return k;
+}
+#endif
+
+// undo the filter on one scanline of nk bytes with bpp bytes per pixel (1 for
+// depths below 8); prior is the previous unfiltered scanline, all zeros for
+// the first one
+static void stbi__unfilter_row(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int nk, int filter, int bpp)
+{
+   int k;
+
+#ifdef STBI_SSE2
+   if (stbi__unfilter_row_sse2(cur, raw, prior, nk, filter, bpp))
+      return;
+#endif
+
+   switch (filter) {
+      case STBI__F_none:
+         memcpy(cur, raw, nk);
+         break;
+      case STBI__F_sub:
+         memcpy(cur, raw, bpp);
+         for (k=bpp; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+         break;
+      case STBI__F_up:
+         for (k=0; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         break;
+      case STBI__F_avg:
+         for (k=0; k < bpp; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+         for (k=bpp; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-bpp])>>1));
+         break;
+      case STBI__F_paeth:
+         for (k=0; k < bpp; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // stbi__paeth(0,prior[k],0)
+         for (k=bpp; k < nk; ++k)
+            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+         break;
+   }
+}
+
+// add an alpha channel of 255 to x pixels of 8-bit img_n channel data; dest
+// may be the same as src
+static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__uint32 x, int img_n)
+{
+   int i;
+   // work backwards, in case dest == src
+   if (img_n == 1) {
+      for (i=x-1; i >= 0; --i) {
+         dest[i*2+1] = 255;
+         dest[i*2+0] = src[i];
+      }
+   } else {
+      STBI_ASSERT(img_n == 3);
+      for (i=x-1; i >= 0; --i) {
+         dest[i*4+3] = 255;
+         dest[i*4+2] = src[i*3+2];
+         dest[i*4+1] = src[i*3+1];
+         dest[i*4+0] = src[i*3+0];
+      }
+   }
+}
+
+static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+
+// state for unfiltering a (sub)image a scanline at a time
+typedef struct
+{
+   stbi_uc *filter_buf;  // two unfiltered rows, alternating; the first "prior" row is zeros
+   stbi__uint32 x, stride, img_width_bytes, img_len;
+   int img_n, out_n, depth, color, filter_bytes;
+} stbi__png_rows;
+
+static int stbi__png_rows_init(stbi__png_rows *r, int img_n, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16? 2 : 1);
+
+   STBI_ASSERT(out_n == img_n || out_n == img_n+1);
+   r->filter_buf = NULL;
+   r->x = x;
+   r->stride = x*out_n*bytes;
+   r->img_n = img_n;
+   r->out_n = out_n;
+   r->depth = depth;
+   r->color = color;
+   // low bit depths are filtered byte by byte
+   r->filter_bytes = depth < 8 ? 1 : img_n*bytes;
+
+   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   r->img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   if (!stbi__mad2sizes_valid(r->img_width_bytes, y, r->img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
+   r->img_len = (r->img_width_bytes + 1) * y;
+   return 1;
+}
+
+static int stbi__png_rows_alloc(stbi__png_rows *r)
+{
+   r->filter_buf = (stbi_uc *) stbi__malloc_mad2(r->img_width_bytes, 2, 0);
+   if (!r->filter_buf) return stbi__err("outofmem", "Out of memory");
+   memset(r->filter_buf + r->img_width_bytes, 0, r->img_width_bytes);
+   return 1;
+}
+
+// unfilter scanline j (which must follow scanline j-1) from raw, which starts
+// with the filter type byte, and expand it into dest, adding alpha if asked
+static int stbi__png_unfilter_row(stbi__png_rows *r, stbi__uint32 j, const stbi_uc *raw, stbi_uc *dest)
 {
-   STBI__F_none,
-   STBI__F_sub,
-   STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
-};
+   stbi__uint32 i, x = r->x;
+   stbi__uint32 img_width_bytes = r->img_width_bytes;
+   stbi_uc *cur   = r->filter_buf + ( j & 1)*img_width_bytes;
+   stbi_uc *prior = r->filter_buf + (~j & 1)*img_width_bytes;
+   int img_n = r->img_n, out_n = r->out_n, depth = r->depth;
+   int filter = *raw++;
+   int k;
 
-static int stbi__paeth(int a, int b, int c)
-{
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
-}
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
 
-static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+   stbi__unfilter_row(cur, raw, prior, img_width_bytes, filter, r->filter_bytes);
+
+   if (depth < 8) {
+      stbi_uc *in  = cur;
+      stbi_uc *out = dest;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 the trailing bits of the last byte are skipped
+      stbi_uc scale = (r->color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+      stbi__uint32 n = x*img_n, done = 0;
+
+#ifdef STBI_SSE2
+      done = stbi__png_unpack_sse2(out, in, n, depth, scale);
+      in  += done * depth / 8;
+      out += done;
+#endif
+      if (depth == 4) {
+         for (k=n-done; k >= 2; k-=2, ++in) {
+            *out++ = scale * ((*in >> 4)       );
+            *out++ = scale * ((*in     ) & 0x0f);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=n-done; k >= 4; k-=4, ++in) {
+            *out++ = scale * ((*in >> 6)       );
+            *out++ = scale * ((*in >> 4) & 0x03);
+            *out++ = scale * ((*in >> 2) & 0x03);
+            *out++ = scale * ((*in     ) & 0x03);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 6)       );
+         if (k > 1) *out++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *out++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=n-done; k >= 8; k-=8, ++in) {
+            *out++ = scale * ((*in >> 7)       );
+            *out++ = scale * ((*in >> 6) & 0x01);
+            *out++ = scale * ((*in >> 5) & 0x01);
+            *out++ = scale * ((*in >> 4) & 0x01);
+            *out++ = scale * ((*in >> 3) & 0x01);
+            *out++ = scale * ((*in >> 2) & 0x01);
+            *out++ = scale * ((*in >> 1) & 0x01);
+            *out++ = scale * ((*in     ) & 0x01);
+         }
+         if (k > 0) *out++ = scale * ((*in >> 7)       );
+         if (k > 1) *out++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *out++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *out++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *out++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *out++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *out++ = scale * ((*in >> 1) & 0x01);
+      }
+      if (img_n != out_n)
+         stbi__create_png_alpha_expand8(dest, dest, x, img_n);
+   } else if (depth == 8) {
+      if (img_n == out_n)
+         memcpy(dest, cur, x*img_n);
+      else
+         stbi__create_png_alpha_expand8(dest, cur, x, img_n);
+   } else {
+      // 16-bit: convert from big-endian to platform-native
+      stbi__uint16 *dest16 = (stbi__uint16 *) dest;
+      if (img_n == out_n) {
+         for (i=0; i < x*img_n; ++i, ++dest16, cur += 2)
+            *dest16 = (cur[0] << 8) | cur[1];
+      } else {
+         STBI_ASSERT(img_n+1 == out_n);
+         for (i=0; i < x; ++i) {
+            for (k=0; k < img_n; ++k, ++dest16, cur += 2)
+               *dest16 = (cur[0] << 8) | cur[1];
+            *dest16++ = 0xffff;
+         }
+      }
+   }
+   return 1;
+}
 
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
    int bytes = (depth == 16? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
+   stbi__png_rows r;
+   stbi__uint32 j;
 
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
-
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, out_n*bytes, 0);
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
+   if (!stbi__png_rows_init(&r, a->s->img_n, out_n, x, y, depth, color)) return 0;
 
    // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
    // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
    // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   if (raw_len < r.img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   if (!stbi__png_rows_alloc(&r)) return 0;
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
-      int filter = *raw++;
-
-      if (filter > 4)
-         return stbi__err("invalid filter","Corrupt PNG");
-
-      if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
-      }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
+      if (!stbi__png_unfilter_row(&r, j, raw, a->out + r.stride*j)) {
+         stbi__free(r.filter_buf);
+         return 0;
       }
+      raw += r.img_width_bytes + 1;
+   }
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
-         }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
+   stbi__free(r.filter_buf);
+   return 1;
+}
+
+// inflates a non-interlaced IDAT stream a few scanlines at a time, through a
+// window that holds 32K of history for matches, a partial row and 'chunk'
+// bytes of new output
+typedef struct
+{
+   stbi__zbuf z;
+   stbi__uint32 row_bytes;      // a scanline with its filter byte
+   stbi__uint32 rows_left;      // scanlines not yet returned
+   stbi__uint32 pos, used;      // window offset of the next scanline, bytes in the window
+   int status;                  // last stbi__zinflate result
+} stbi__png_zrows;
+
+static int stbi__png_zrows_start(stbi__png_zrows *zr, stbi__png_idat *idat, stbi__uint32 row_bytes, stbi__uint32 rows, stbi__uint32 chunk, int parse_header)
+{
+   stbi__zbuf *a = &zr->z;
+   stbi_uc *window = (stbi_uc *) stbi__malloc_mad2(1, row_bytes, 32768 + chunk);
+   if (!window) return stbi__err("outofmem", "Out of memory");
+   stbi__png_idat_input(a, idat);
+   a->zout_start = a->zout = (char *) window;
+   a->zout_end = (char *) window + 32768 + chunk + row_bytes;
+   a->z_expandable = 0;
+   a->z_suspend = 1;
+   zr->row_bytes = row_bytes;
+   zr->rows_left = rows;
+   zr->pos = zr->used = 0;
+   zr->status = STBI__ZFULL;
+   if (!stbi__zstart(a, parse_header)) {
+      stbi__free(window);
+      return 0;
+   }
+   return 1;
+}
+
+// returns how many scanlines can be taken with stbi__png_zrows_next before
+// calling this again, which may move them; 0 once the stream is done. the
+// stream is inflated to its end, so if status isn't 1 or rows_left isn't 0
+// by then, it was corrupt
+static stbi__uint32 stbi__png_zrows_fill(stbi__png_zrows *zr)
+{
+   stbi__zbuf *a = &zr->z;
+   for (;;) {
+      stbi__uint32 keep, n = (zr->used - zr->pos) / zr->row_bytes;
+      if (n > zr->rows_left) n = zr->rows_left;
+      if (n || zr->status != STBI__ZFULL) return n;
+      // slide the window down, keeping 32K of history for matches and the
+      // start of the next row. data after the last row is just skipped
+      if (zr->rows_left == 0) zr->pos = zr->used;
+      keep = zr->used < 32768 ? zr->used : 32768;
+      if (keep < zr->used - zr->pos) keep = zr->used - zr->pos;
+      memmove(a->zout_start, a->zout_start + zr->used - keep, keep);
+      a->zout = a->zout_start + keep;
+      zr->pos -= zr->used - keep;
+      zr->status = stbi__zinflate(a);
+      zr->used = (stbi__uint32) (a->zout - a->zout_start);
+   }
+}
+
+static stbi_uc *stbi__png_zrows_next(stbi__png_zrows *zr)
+{
+   stbi_uc *row = (stbi_uc *) zr->z.zout_start + zr->pos;
+   zr->pos += zr->row_bytes;
+   --zr->rows_left;
+   return row;
+}
+
+static int stbi__png_zrows_ok(stbi__png_zrows *zr)
+{
+   if (zr->status != 1) return 0; // zlib should set error
+   if (zr->rows_left) return stbi__err("not enough pixels","Corrupt PNG");
+   return 1;
+}
+
+static int stbi__png_zrows_done(stbi__png_zrows *zr)
+{
+   stbi__free(zr->z.zout_start);
+   return stbi__png_zrows_ok(zr);
+}
+
+// Adam7 de-interlacing. The seven passes are unfiltered independently, as
+// jobs, once the whole image has been inflated. The last pass is every odd
+// row in full, so it goes straight into the image; the others go into one
+// scratch buffer, and the even rows are then put together from them in row
+// bands. Each even row is a chain of merges of two rows whose pixels
+// alternate (pass 1 with 2, then with 4, then with 6), which SSE2 does as
+// byte/word/dword/qword unpacks.
+
+typedef struct
+{
+   stbi__png_rows rows[7];
+   stbi_uc *raw[7];              // each pass's filtered scanlines
+   stbi_uc *out[7];              // and where its unfiltered rows go
+   stbi__uint32 out_stride[7];
+   stbi__uint32 ny[7];           // rows in each pass, 0 if it's empty
+   int npass;                    // passes that have all of their data
+   int jobs;                     // 1, or one job per pass
+   int failed[7];
+   const char *failure[7];       // stbi_failure_reason, from the failing thread
+   stbi_uc *final, *tmp;
+   stbi__uint32 w, h, out_bytes, stride, band, tmp_bytes;
+} stbi__png_adam7;
+
+static void stbi__png_adam7_pass_job(void *user, int index)
+{
+   stbi__png_adam7 *d = (stbi__png_adam7 *) user;
+   int p;
+   // biggest pass first
+   for (p = 6 - index; p >= 0; p -= d->jobs) {
+      stbi__png_rows *r = &d->rows[p];
+      stbi_uc *raw = d->raw[p];
+      stbi__uint32 j;
+      if (p >= d->npass) continue;
+      for (j=0; j < d->ny[p]; ++j, raw += r->img_width_bytes + 1) {
+         if (!stbi__png_unfilter_row(r, j, raw, d->out[p] + (size_t) d->out_stride[p] * j)) {
+            d->failed[p] = 1;
+            d->failure[p] = stbi__g_failure_reason;
+            break;
          }
       }
    }
+}
 
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
+// dest gets the na pixels of a and nb of b alternately, a first; na is nb
+// or nb+1
+static void stbi__png_adam7_merge(stbi_uc *dest, const stbi_uc *a, stbi__uint32 na, const stbi_uc *b, stbi__uint32 nb, int bytes)
+{
+   stbi__uint32 i = 0;
+#ifdef STBI_SSE2
+   if ((bytes & (bytes-1)) == 0 && stbi__sse2_available()) {
+      stbi__uint32 step = 16 / bytes;
+      for (; i+step <= nb; i += step) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (a + i*bytes));
+         __m128i y = _mm_loadu_si128((const __m128i *) (b + i*bytes));
+         __m128i lo, hi;
+         switch (bytes) {
+            case 1:  lo = _mm_unpacklo_epi8 (x, y); hi = _mm_unpackhi_epi8 (x, y); break;
+            case 2:  lo = _mm_unpacklo_epi16(x, y); hi = _mm_unpackhi_epi16(x, y); break;
+            case 4:  lo = _mm_unpacklo_epi32(x, y); hi = _mm_unpackhi_epi32(x, y); break;
+            default: lo = _mm_unpacklo_epi64(x, y); hi = _mm_unpackhi_epi64(x, y); break;
          }
+         _mm_storeu_si128((__m128i *) (dest + 2*i*bytes   ), lo);
+         _mm_storeu_si128((__m128i *) (dest + 2*i*bytes+16), hi);
       }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
-
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
+   }
+#endif
+   // fixed-size copies for the rest, and for 3 and 6 byte pixels
+   #define STBI__ADAM7_MERGE(n) \
+      for (; i < nb; ++i) { \
+         memcpy(dest + (2*i  )*n, a + i*n, n); \
+         memcpy(dest + (2*i+1)*n, b + i*n, n); \
+      } \
+      break;
+   switch (bytes) {
+      case 1: STBI__ADAM7_MERGE(1)
+      case 2: STBI__ADAM7_MERGE(2)
+      case 3: STBI__ADAM7_MERGE(3)
+      case 4: STBI__ADAM7_MERGE(4)
+      case 6: STBI__ADAM7_MERGE(6)
+      default: STBI__ADAM7_MERGE(8)
+   }
+   #undef STBI__ADAM7_MERGE
+   if (na > nb)
+      memcpy(dest + 2*i*bytes, a + i*bytes, bytes);
+}
+
+// row j of pass p
+static stbi_uc *stbi__png_adam7_row(stbi__png_adam7 *d, int p, stbi__uint32 j)
+{
+   return d->out[p] + (size_t) d->out_stride[p] * j;
+}
+
+static void stbi__png_adam7_rows_job(void *user, int index)
+{
+   stbi__png_adam7 *d = (stbi__png_adam7 *) user;
+   stbi__uint32 w = d->w, n = d->out_bytes;
+   stbi__uint32 y = 2 * index * d->band, end = y + 2 * d->band;
+   stbi__uint32 n4 = (w+3) >> 2, n2 = (w+1) >> 1;
+   stbi_uc *t4 = d->tmp + (size_t) d->tmp_bytes * index; // columns x % 4 == 0
+   stbi_uc *t2 = t4 + n4 * n;                            // columns x % 2 == 0
+   if (end > d->h) end = d->h;
+   for (; y < end; y += 2) {
+      stbi_uc *even = t2, *quad = t4;
+      if ((y & 3) == 2) {
+         even = stbi__png_adam7_row(d, 4, y >> 2);
+      } else {
+         if ((y & 7) == 4)
+            quad = stbi__png_adam7_row(d, 2, y >> 3);
+         else
+            stbi__png_adam7_merge(t4, stbi__png_adam7_row(d, 0, y >> 3), (w+7) >> 3, stbi__png_adam7_row(d, 1, y >> 3), (w+3) >> 3, n);
+         stbi__png_adam7_merge(t2, quad, n4, stbi__png_adam7_row(d, 3, y >> 2), (w+1) >> 2, n);
       }
+      stbi__png_adam7_merge(d->final + (size_t) d->stride * y, even, n2, stbi__png_adam7_row(d, 5, y >> 1), w >> 1, n);
    }
-
-   return 1;
 }
 
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
    int bytes = (depth == 16 ? 2 : 1);
-   int out_bytes = out_n * bytes;
-   stbi_uc *final;
-   int p;
+   stbi__png_adam7 d;
+   stbi_uc *scratch, *q;
+   size_t size = 0;
+   stbi__uint32 total = 0, erows;
+   int p, bands;
    if (!interlaced)
       return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
 
-   // de-interlacing
-   final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
-   if (!final) return stbi__err("outofmem", "Out of memory");
+   d.w = a->s->img_x;
+   d.h = a->s->img_y;
+   d.out_bytes = out_n * bytes;
+   d.stride = d.w * d.out_bytes;
+   d.final = (stbi_uc *) stbi__malloc_mad3(d.w, d.h, d.out_bytes, 0);
+   if (!d.final) return stbi__err("outofmem", "Out of memory");
+
+   // find where each pass's data is, and how much scratch memory they need.
+   // passes that would run out of data aren't decoded
+   d.npass = 7;
    for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
       // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
-      if (x && y) {
-         stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j) {
-            for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                      a->out + (j*x+i)*out_bytes, out_bytes);
-            }
-         }
-         STBI_FREE(a->out);
-         image_data += img_len;
-         image_data_len -= img_len;
+      stbi__uint32 x = (d.w - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (d.h - yorig[p] + yspc[p]-1) / yspc[p];
+      stbi__png_rows *r = &d.rows[p];
+      d.failed[p] = 0;
+      d.failure[p] = NULL;
+      d.ny[p] = x ? y : 0;
+      if (!d.ny[p]) continue;
+      if (!stbi__png_rows_init(r, a->s->img_n, out_n, x, y, depth, color)) {
+         stbi__free(d.final);
+         return 0;
+      }
+      if (image_data_len < r->img_len) {
+         d.npass = p;
+         break;
+      }
+      d.raw[p] = image_data;
+      image_data += r->img_len;
+      image_data_len -= r->img_len;
+      total += r->img_len;
+      size += (size_t) r->img_width_bytes * 2;
+      if (p < 6) size += (size_t) x * y * d.out_bytes;
+   }
+   erows = (d.h + 1) >> 1;
+   bands = stbi__parallel_jobs(erows, 1 + (1 << 16) / d.stride);
+   d.band = (erows + bands-1) / bands;
+   bands = (erows + d.band-1) / d.band;
+   d.tmp_bytes = (((d.w+3) >> 2) + ((d.w+1) >> 1)) * d.out_bytes;
+   size += (size_t) d.tmp_bytes * bands;
+
+   scratch = (stbi_uc *) stbi__malloc(size);
+   if (!scratch) {
+      stbi__free(d.final);
+      return stbi__err("outofmem", "Out of memory");
+   }
+   for (q = scratch, p=0; p < d.npass; ++p) {
+      stbi__png_rows *r = &d.rows[p];
+      d.out[p] = q;
+      d.out_stride[p] = 0;
+      if (!d.ny[p]) continue;
+      r->filter_buf = q;
+      memset(q + r->img_width_bytes, 0, r->img_width_bytes);
+      q += (size_t) r->img_width_bytes * 2;
+      if (p < 6) {
+         d.out[p] = q;
+         d.out_stride[p] = r->x * d.out_bytes;
+         q += (size_t) d.out_stride[p] * d.ny[p];
+      } else {
+         d.out[p] = d.final + d.stride;
+         d.out_stride[p] = d.stride * 2;
       }
    }
-   a->out = final;
+   d.tmp = q;
 
+   d.jobs = stbi__parallel_jobs(total, 1 << 16) > 1 ? 7 : 1;
+   stbi__parallel_for(stbi__png_adam7_pass_job, &d, d.jobs);
+   for (p=0; p < d.npass; ++p) {
+      if (d.failed[p]) {
+         stbi__g_failure_reason = d.failure[p];
+         break;
+      }
+   }
+   if (p == 7)
+      stbi__parallel_for(stbi__png_adam7_rows_job, &d, bands);
+   stbi__free(scratch);
+   if (p < 7) {
+      stbi__free(d.final);
+      return p < d.npass ? 0 : stbi__err("not enough pixels","Corrupt PNG");
+   }
+   a->out = d.final;
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4929,11 +8549,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4954,19 +8572,59 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
-{
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+#ifdef STBI__AVX2
+// AVX2 palette lookup, 8 pixels at a time with a gather; palette entries are
+// 4 bytes, so each is one 32-bit element. for 3 channels the alpha bytes are
+// squeezed out of each half, and the two 12-byte halves stored with 16-byte
+// stores, which write 4 bytes past the 24 of these pixels; the loop stops
+// short enough that those are still the next pixels'. returns how many
+// pixels it did
+static STBI__TARGET_AVX2 stbi__uint32 stbi__expand_palette_avx2(stbi_uc *p, const stbi_uc *orig, stbi__uint32 pixel_count, const stbi_uc *palette, int pal_img_n)
+{
+   stbi__uint32 i = 0;
+   if (pal_img_n == 4) {
+      for (; i+8 <= pixel_count; i += 8) {
+         __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (orig+i)));
+         __m256i px  = _mm256_i32gather_epi32((const int *) palette, idx, 4);
+         _mm256_storeu_si256((__m256i *) (p + 4*i), px);
+      }
+   } else {
+      __m256i rgb = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                     0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      for (; i+10 <= pixel_count; i += 8) {
+         __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (orig+i)));
+         __m256i px  = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *) palette, idx, 4), rgb);
+         _mm_storeu_si128((__m128i *) (p + 3*i     ), _mm256_castsi256_si128(px));
+         _mm_storeu_si128((__m128i *) (p + 3*i + 12), _mm256_extracti128_si256(px, 1));
+      }
+   }
+   return i;
+}
+#endif
 
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+// whether palette expansion can use AVX2. asked once per image, not per row
+static int stbi__png_pal_avx2(void)
+{
+#ifdef STBI__AVX2
+   return stbi__avx_level() > 0;
+#else
+   return 0;
+#endif
+}
 
+// expand palette indices to pal_img_n channels; avx2 is from stbi__png_pal_avx2
+static void stbi__expand_palette_pixels(stbi_uc *p, const stbi_uc *orig, stbi__uint32 pixel_count, const stbi_uc *palette, int pal_img_n, int avx2)
+{
+   stbi__uint32 i = 0;
+#ifdef STBI__AVX2
+   if (avx2)
+      i = stbi__expand_palette_avx2(p, orig, pixel_count, palette, pal_img_n);
+#else
+   STBI_NOTUSED(avx2);
+#endif
+   p += i*pal_img_n;
    if (pal_img_n == 3) {
-      for (i=0; i < pixel_count; ++i) {
+      for (; i < pixel_count; ++i) {
          int n = orig[i]*4;
          p[0] = palette[n  ];
          p[1] = palette[n+1];
@@ -4974,7 +8632,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 3;
       }
    } else {
-      for (i=0; i < pixel_count; ++i) {
+      for (; i < pixel_count; ++i) {
          int n = orig[i]*4;
          p[0] = palette[n  ];
          p[1] = palette[n+1];
@@ -4983,8 +8641,19 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
-   a->out = temp_out;
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *p;
+
+   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__expand_palette_pixels(p, a->out, pixel_count, palette, pal_img_n, stbi__png_pal_avx2());
+   stbi__free(a->out);
+   a->out = p;
 
    STBI_NOTUSED(len);
 
@@ -5031,13 +8700,11 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
                                 : stbi__de_iphone_flag_global)
 #endif // STBI_THREAD_LOCAL
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n, int unpremultiply)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -5045,8 +8712,8 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      STBI_ASSERT(out_n == 4);
+      if (unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -5074,19 +8741,341 @@ static void stbi__de_iphone(stbi__png *z)
    }
 }
 
-#define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
+// stbi_png_rows decodes non-interlaced images a scanline at a time: each row
+// is inflated into a small window, unfiltered, fixed up and converted, and
+// handed to the caller. the IDAT data is read as it's inflated, so this
+// needs memory for a 96K window and a few rows. interlaced images have to
+// be decoded as a whole first, since every pass contributes to every row
+
+#define STBI__PNG_ROWS_CHUNK   (1 << 16)  // inflate this much between window slides
+
+static int stbi__png_stream_begin(stbi__png *z)
+{
+   stbi__png_stream *st = z->stream;
+   int w = z->s->img_x, h = z->s->img_y;
+   if (st->region) {
+      if (!stbi__clip_region(st->region, w, h)) return 0;
+      w = st->region->w;
+      h = st->region->h;
+   }
+   if (!st->func && !st->into) {
+      int out_n = st->req_comp ? st->req_comp : z->s->img_out_n;
+      int bytes = (z->depth == 16 && st->keep16) ? 2 : 1;
+      st->image.out = (stbi_uc *) stbi__malloc_mad3(w, h, out_n*bytes, 0);
+      if (!st->image.out) return stbi__err("outofmem", "Out of memory");
+      st->image.w = w;
+      st->image.h = h;
+      st->image.stride = w * out_n*bytes;
+      st->into = &st->image;
+   }
+   if (st->into && (w > st->into->w || h > st->into->h))
+      return stbi__err("too large", "Image bigger than the destination");
+   *st->x = w;
+   *st->y = h;
+   if (st->comp) *st->comp = z->s->img_n;
+   return 1;
+}
+
+// hand finished scanline j, which has s->img_out_n channels of z->depth
+// bits, on as req_comp channels of 8 bits (or 16 with keep16). pix and
+// spare both have room for a row of 4 16-bit channels. with a region, pix
+// is just the part of the row in it, and j counts from its top
+static int stbi__png_stream_emit(stbi__png *z, stbi__uint32 j, stbi_uc *pix, stbi_uc *spare)
+{
+   stbi__context *s = z->s;
+   stbi__png_stream *st = z->stream;
+   stbi__uint32 i, x = st->region ? (stbi__uint32) st->region->w : s->img_x;
+   stbi__uint32 y = st->region ? (stbi__uint32) st->region->h : s->img_y;
+   int n = s->img_out_n, out_n = st->req_comp ? st->req_comp : n;
+   size_t row_bytes = (size_t) x*out_n;
+
+   if (z->depth == 16) {
+      // convert at 16 bits and then narrow, like stbi_load does
+      stbi__uint16 *p16 = (stbi__uint16 *) pix;
+      if (out_n != n) {
+         if (!stbi__convert_row16((stbi__uint16 *) spare, p16, n, out_n, x)) return stbi__err("unsupported", "Unsupported format conversion");
+         p16 = (stbi__uint16 *) spare;
+      }
+      if (st->keep16) {
+         pix = (stbi_uc *) p16;
+         row_bytes *= 2;
+      } else {
+         for (i=0; i < x*out_n; ++i)
+            pix[i] = (stbi_uc) (p16[i] >> 8);
+      }
+   } else if (out_n != n) {
+      if (!stbi__convert_row(spare, pix, n, out_n, x)) return stbi__err("unsupported", "Unsupported format conversion");
+      pix = spare;
+   }
+   if (st->flip)
+      j = y-1-j;
+   if (st->into)
+      memcpy(st->into->out + (size_t) st->into->stride * j, pix, row_bytes);
+   else if (!st->func(st->user, j, pix))
+      return stbi__err("stopped", "Row callback stopped decoding");
+   return 1;
+}
+
+// fix up unfiltered scanline j, which has r->out_n channels, and emit it.
+// row and spare both have room for a row of 4 16-bit channels
+static int stbi__png_stream_row(stbi__png *z, stbi__png_rows *r, stbi__uint32 j, stbi_uc *row, stbi_uc *spare)
+{
+   stbi__png_stream *st = z->stream;
+   stbi__uint32 x = r->x;
+   if (st->region) {
+      // only the part in the region needs fixing up
+      if (j < (stbi__uint32) st->region->y) return 1;
+      j -= st->region->y;
+      x = st->region->w;
+      row += st->region->x * r->out_n * (z->depth == 16 ? 2 : 1);
+   }
+   if (st->has_trans) {
+      if (z->depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) row, x, st->tc16, r->out_n);
+      else
+         stbi__compute_transparency(row, x, st->tc, r->out_n);
+   }
+   if (st->de_iphone)
+      stbi__de_iphone(row, x, r->out_n, st->unpremultiply);
+   if (st->pal_img_n) {
+      stbi__expand_palette_pixels(spare, row, x, st->palette, z->s->img_out_n, st->pal_avx2);
+      return stbi__png_stream_emit(z, j, spare, row);
+   }
+   return stbi__png_stream_emit(z, j, row, spare);
+}
+
+static int stbi__png_stream_rows(stbi__png *z, stbi__png_rows *r, stbi__png_idat *idat, int parse_header)
+{
+   stbi__png_zrows zr;
+   stbi__uint32 j = 0, n, end = z->s->img_y;
+   stbi_uc *row;
+   int ok = 1;
+
+   // rows below the region don't need to be inflated at all
+   if (z->stream->region)
+      end = z->stream->region->y + z->stream->region->h;
+
+   row = (stbi_uc *) stbi__malloc_mad2(r->x, 16, 0);
+   if (!row) return stbi__err("outofmem", "Out of memory");
+   if (!stbi__png_rows_alloc(r)) {
+      stbi__free(row);
+      return 0;
+   }
+   if (!stbi__png_zrows_start(&zr, idat, r->img_width_bytes+1, z->s->img_y, STBI__PNG_ROWS_CHUNK, parse_header)) {
+      stbi__free(r->filter_buf);
+      stbi__free(row);
+      return 0;
+   }
+
+   while (ok && j < end && (n = stbi__png_zrows_fill(&zr)) != 0) {
+      for (; ok && n && j < end; --n, ++j) {
+         ok = stbi__png_unfilter_row(r, j, stbi__png_zrows_next(&zr), row);
+         if (ok)
+            ok = stbi__png_stream_row(z, r, j, row, row + r->x*8);
+      }
+   }
+
+   if (ok && j < z->s->img_y && j == end)
+      stbi__free(zr.z.zout_start);
+   else if (ok)
+      ok = stbi__png_zrows_done(&zr);
+   else
+      stbi__free(zr.z.zout_start);
+   stbi__free(r->filter_buf);
+   stbi__free(row);
+   return ok;
+}
+
+// hand out the rows of an image that was decoded as a whole
+static int stbi__png_stream_image(stbi__png *z)
+{
+   stbi__context *s = z->s;
+   stbi__uint32 j, stride = s->img_x * s->img_out_n * (z->depth == 16 ? 2 : 1);
+   stbi_uc *row = (stbi_uc *) stbi__malloc_mad2(s->img_x, 16, 0);
+   int ok = 1;
+
+   if (!row) return stbi__err("outofmem", "Out of memory");
+   ok = stbi__png_stream_begin(z);
+   for (j=0; ok && j < s->img_y; ++j) {
+      memcpy(row, z->out + stride*j, stride);
+      ok = stbi__png_stream_emit(z, j, row, row + s->img_x*8);
+   }
+   stbi__free(row);
+   return ok;
+}
+
+#ifndef STBI_NO_THREADS
+// Big non-interlaced images are inflated and unfiltered at the same time. One
+// job inflates the IDAT stream through a sliding window and hands complete
+// scanlines to the other through a small ring, so the inflated image is never
+// held in memory as a whole. Rows are unfiltered and emitted by whichever job
+// gets to them: the inflating job does it itself when the ring is full and nobody
+// else is, so neither job waits on one that hasn't started. The IDATs are read
+// as they're inflated, so there's no going back: if anything goes wrong, the
+// reason is taken on the thread it went wrong on and handed to the caller.
+
+#define STBI__PNG_PIPE_MIN     (1 << 20)  // smallest inflated size worth two threads
+#define STBI__PNG_PIPE_CHUNK   (1 << 17)  // inflate this much between window slides
+#define STBI__PNG_PIPE_RING    (1 << 18)  // bytes of scanlines in the ring, at least 8 rows
+
+typedef struct
+{
+   stbi__png *z;
+   stbi__png_rows *rows;
+   stbi__png_zrows zr;
+   stbi_uc *ring;              // nslots raw scanlines, filter byte first
+   stbi_uc *row;               // the row being unfiltered, then scratch for emitting it
+   stbi__uint32 y, row_bytes, nslots;
+   // protected by the pool lock
+   stbi__uint32 produced;      // rows put in the ring
+   stbi__uint32 consumed;      // rows unfiltered
+   int unfiltering;            // a job is unfiltering rows right now
+   int inflated;               // the inflate job is done
+   int failed;
+   const char *failure;        // stbi_failure_reason, from the failing thread
+} stbi__png_pipe;
+
+// the caller holds the pool lock
+static void stbi__png_pipe_fail(stbi__png_pipe *p)
+{
+   if (!p->failed) {
+      p->failed = 1;
+      p->failure = stbi__g_failure_reason;
+   }
+}
+
+// unfilter and emit all rows in the ring; the caller holds the pool lock,
+// which is released meanwhile
+static void stbi__png_pipe_drain(stbi__png_pipe *p)
+{
+   stbi__uint32 j = p->consumed, end = p->produced;
+   int ok = 1;
+   p->unfiltering = 1;
+   stbi__pool_unlock();
+   for (; ok && j < end; ++j) {
+      ok = stbi__png_unfilter_row(p->rows, j, p->ring + (j % p->nslots) * p->row_bytes, p->row);
+      if (ok)
+         ok = stbi__png_stream_row(p->z, p->rows, j, p->row, p->row + p->rows->x*8);
+   }
+   stbi__pool_lock();
+   p->unfiltering = 0;
+   p->consumed = end;
+   if (!ok) stbi__png_pipe_fail(p);
+   stbi__pool_wake(stbi__pool_event);
+}
+
+static void stbi__png_pipe_inflate(stbi__png_pipe *p)
+{
+   stbi__uint32 n, rows = 0; // rows handed over
+   int failed = 0;
+
+   while ((n = stbi__png_zrows_fill(&p->zr)) != 0) {
+      stbi__uint32 room;
+      stbi__pool_lock();
+      while (!p->failed && p->produced - p->consumed == p->nslots) {
+         if (p->unfiltering)
+            stbi__pool_wait(stbi__pool_event);
+         else
+            stbi__png_pipe_drain(p);
+      }
+      room = p->nslots - (p->produced - p->consumed);
+      failed = p->failed;
+      stbi__pool_unlock();
+      if (failed) break;
+      if (n > room) n = room;
+      for (; n; --n, ++rows)
+         memcpy(p->ring + (rows % p->nslots) * p->row_bytes, stbi__png_zrows_next(&p->zr), p->row_bytes);
+      stbi__pool_lock();
+      p->produced = rows;
+      stbi__pool_wake(stbi__pool_event);
+      stbi__pool_unlock();
+   }
+
+   if (!failed && !stbi__png_zrows_ok(&p->zr)) failed = 1;
+   stbi__pool_lock();
+   if (failed) stbi__png_pipe_fail(p);
+   p->inflated = 1;
+   stbi__pool_wake(stbi__pool_event);
+   stbi__pool_unlock();
+}
+
+static void stbi__png_pipe_unfilter(stbi__png_pipe *p)
+{
+   stbi__pool_lock();
+   while (!p->failed && p->consumed < p->y) {
+      if (p->produced > p->consumed && !p->unfiltering)
+         stbi__png_pipe_drain(p);
+      else if (p->inflated && !p->unfiltering)
+         break;
+      else
+         stbi__pool_wait(stbi__pool_event);
+   }
+   stbi__pool_unlock();
+}
+
+static void stbi__png_pipe_job(void *user, int index)
+{
+   if (index == 0)
+      stbi__png_pipe_inflate((stbi__png_pipe *) user);
+   else
+      stbi__png_pipe_unfilter((stbi__png_pipe *) user);
+}
+
+// rows are emitted from another thread, so only for memory destinations.
+// returns -1 without reading anything if the image is decoded serially
+static int stbi__png_stream_pipelined(stbi__png *z, stbi__png_rows *r, stbi__png_idat *idat, int parse_header)
+{
+   stbi__png_pipe p;
+
+   if (stbi__thread_count() < 2) return -1;
+   if (r->img_len < STBI__PNG_PIPE_MIN) return -1;
+
+   p.z = z;
+   p.rows = r;
+   p.y = z->s->img_y;
+   p.row_bytes = r->img_width_bytes + 1;
+   p.nslots = STBI__PNG_PIPE_RING / p.row_bytes;
+   if (p.nslots < 8) p.nslots = 8;
+   if (p.nslots > p.y) p.nslots = p.y;
+   p.produced = p.consumed = 0;
+   p.unfiltering = p.inflated = p.failed = 0;
+   p.failure = NULL;
+
+   p.ring = (stbi_uc *) stbi__malloc_mad2(p.nslots, p.row_bytes, 0);
+   p.row = (stbi_uc *) stbi__malloc_mad2(r->x, 16, 0);
+   if (!p.ring || !p.row || !stbi__png_rows_alloc(r)) {
+      stbi__free(p.row);
+      stbi__free(p.ring);
+      return -1;
+   }
+
+   if (stbi__png_zrows_start(&p.zr, idat, p.row_bytes, p.y, STBI__PNG_PIPE_CHUNK, parse_header)) {
+      stbi__parallel_for(stbi__png_pipe_job, &p, 2);
+      stbi__free(p.zr.z.zout_start);
+      if (p.failed) stbi__g_failure_reason = p.failure;
+   } else {
+      p.failed = 1;
+   }
+
+   stbi__free(r->filter_buf);
+   stbi__free(p.ring);
+   stbi__free(p.row);
+   return !p.failed;
+}
+#endif
+
 
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 i, pal_len=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, idat=0, have_next=0;
+   stbi__pngchunk c, next;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
-   z->idata = NULL;
    z->out = NULL;
 
    if (!stbi__check_png_header(s)) return 0;
@@ -5094,7 +9083,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    if (scan == STBI__SCAN_type) return 1;
 
    for (;;) {
-      stbi__pngchunk c = stbi__get_chunk_header(s);
+      c = have_next ? next : stbi__get_chunk_header(s);
+      have_next = 0;
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -5146,7 +9136,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (idat) return stbi__err("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
@@ -5170,6 +9160,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          }
 
          case STBI__PNG_TYPE('I','D','A','T'): {
+            stbi__png_idat d;
+            stbi__uint32 raw_len, bpl;
+            int ok;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
             if (scan == STBI__SCAN_header) {
@@ -5178,60 +9171,93 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                   s->img_n = pal_img_n;
                return 1;
             }
-            if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
-            if ((int)(ioff + c.length) < (int)ioff) return 0;
-            if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
-               stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
-               while (ioff + c.length > idata_limit)
-                  idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
-               z->idata = p;
+            if (idat) {
+               // IDATs after other chunks; the zlib stream has ended already
+               stbi__skip(s, c.length);
+               break;
             }
-            if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
-            ioff += c.length;
-            break;
-         }
-
-         case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
-            if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (scan != STBI__SCAN_load) return 1;
-            if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            idat = 1;
+            // everything needed comes before the IDATs, so decode them now,
+            // as they're read
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
-               if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
-               } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+            if (scan == STBI__SCAN_rows && !interlace) {
+               stbi__png_stream *st = z->stream;
+               stbi__png_rows r;
+               st->palette = palette;
+               st->pal_img_n = pal_img_n;
+               st->pal_avx2 = pal_img_n && stbi__png_pal_avx2();
+               st->has_trans = has_trans;
+               st->tc = tc;
+               st->tc16 = tc16;
+               st->de_iphone = is_iphone && stbi__de_iphone_flag && s->img_out_n > 2;
+               st->flip = stbi__vertically_flip_on_load;
+               st->unpremultiply = stbi__unpremultiply_on_load;
+               if (!stbi__png_rows_init(&r, s->img_n, s->img_out_n, s->img_x, s->img_y, z->depth, color)) return 0;
+               if (pal_img_n) {
+                  s->img_n = pal_img_n; // record the actual colors we had
+                  s->img_out_n = req_comp >= 3 ? req_comp : pal_img_n;
+               } else if (has_trans) {
+                  ++s->img_n;
                }
+               if (!stbi__png_stream_begin(z)) return 0;
+               if (!stbi__png_idat_start(&d, s, c.length)) return 0;
+               ok = -1;
+               #ifndef STBI_NO_THREADS
+               if (!st->func && !st->region)
+                  ok = stbi__png_stream_pipelined(z, &r, &d, !is_iphone);
+               #endif
+               if (ok < 0)
+                  ok = stbi__png_stream_rows(z, &r, &d, !is_iphone);
+               if (!stbi__png_idat_end(&d) || !ok) return 0;
+            } else {
+               stbi__zbuf a;
+               // initial guess for decoded data size to avoid unnecessary reallocs
+               bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+               raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+               z->expanded = (stbi_uc *) stbi__malloc(raw_len);
+               if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+               if (!stbi__png_idat_start(&d, s, c.length)) return 0;
+               stbi__png_idat_input(&a, &d);
+               ok = stbi__do_zlib(&a, (char *) z->expanded, raw_len, 1, !is_iphone);
+               z->expanded = (stbi_uc *) a.zout_start;
+               raw_len = (stbi__uint32) (a.zout - a.zout_start);
+               if (!stbi__png_idat_end(&d) || !ok) return 0; // zlib should set error
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+               if (has_trans) {
+                  if (z->depth == 16) {
+                     if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, tc16, s->img_out_n)) return 0;
+                  } else {
+                     if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
+                  }
+               }
+               if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+                  stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n, stbi__unpremultiply_on_load);
+               if (pal_img_n) {
+                  // pal_img_n == 3 or 4
+                  s->img_n = pal_img_n; // record the actual colors we had
+                  s->img_out_n = pal_img_n;
+                  if (req_comp >= 3) s->img_out_n = req_comp;
+                  if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+                     return 0;
+               } else if (has_trans) {
+                  // non-paletted image with tRNS -> source image has (constant) alpha
+                  ++s->img_n;
+               }
+               stbi__free(z->expanded); z->expanded = NULL;
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
-            if (pal_img_n) {
-               // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
-               if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
-                  return 0;
-            } else if (has_trans) {
-               // non-paletted image with tRNS -> source image has (constant) alpha
-               ++s->img_n;
-            }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            // the CRCs have been read, up to the header of the chunk after
+            next = d.next;
+            have_next = 1;
+            continue;
+         }
+
+         case STBI__PNG_TYPE('I','E','N','D'): {
+            if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+            if (scan != STBI__SCAN_load && scan != STBI__SCAN_rows) return 1;
+            if (!idat) return stbi__err("no IDAT","Corrupt PNG");
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5259,43 +9285,131 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    }
 }
 
-static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
+static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri, int bpc)
+{
+   void *result=NULL;
+   stbi__png_stream st;
+   int sx, sy;
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   // non-interlaced images go through the row stream, which puts every row
+   // straight into its final place and format. x, y and n are only set on
+   // success, like the other loaders
+   memset(&st, 0, sizeof(st));
+   st.x = &sx;
+   st.y = &sy;
+   st.req_comp = req_comp;
+   st.keep16 = (bpc == 16);
+   st.region = p->s->region;
+   p->stream = &st;
+   if (stbi__parse_png_file(p, STBI__SCAN_rows, req_comp)) {
+      if (p->depth <= 8)
+         ri->bits_per_channel = 8;
+      else if (p->depth == 16)
+         ri->bits_per_channel = st.into && !st.keep16 ? 8 : 16;
+      else
+         return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
+      if (st.into) {
+         // already converted, and flipped and cropped if need be
+         ri->flipped = 1;
+         ri->cropped = 1;
+         result = st.image.out;
+         st.image.out = NULL;
+         p->s->img_x = sx;
+         p->s->img_y = sy;
+      } else {
+         result = p->out;
+         p->out = NULL;
+         if (req_comp && req_comp != p->s->img_out_n) {
+            if (ri->bits_per_channel == 8)
+               result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            else
+               result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+            p->s->img_out_n = req_comp;
+            if (result == NULL) return result;
+         }
+      }
+      *x = p->s->img_x;
+      *y = p->s->img_y;
+      if (n) *n = p->s->img_n;
+   }
+   stbi__free(st.image.out);
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+
+   return result;
+}
+
+static int stbi__png_rows_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_png_row_func *func, void *user)
+{
+   stbi__png p;
+   stbi__png_stream st;
+   int ok;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   memset(&st, 0, sizeof(st));
+   st.func = func;
+   st.user = user;
+   st.into = s->into;
+   st.x = x;
+   st.y = y;
+   st.comp = comp;
+   st.req_comp = req_comp;
+   p.s = s;
+   p.stream = &st;
+   ok = stbi__parse_png_file(&p, STBI__SCAN_rows, req_comp);
+   if (ok && p.out)
+      ok = stbi__png_stream_image(&p); // interlaced
+   stbi__free(p.out);
+   stbi__free(p.expanded);
+   return ok;
+}
+
+STBIDEF int stbi_png_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_png_row_func *func, void *func_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__png_rows_main(&s,x,y,comp,req_comp,func,func_user);
+}
+
+STBIDEF int stbi_png_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_png_row_func *func, void *func_user)
 {
-   void *result=NULL;
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
-      if (p->depth <= 8)
-         ri->bits_per_channel = 8;
-      else if (p->depth == 16)
-         ri->bits_per_channel = 16;
-      else
-         return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
-      result = p->out;
-      p->out = NULL;
-      if (req_comp && req_comp != p->s->img_out_n) {
-         if (ri->bits_per_channel == 8)
-            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-         else
-            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-         p->s->img_out_n = req_comp;
-         if (result == NULL) return result;
-      }
-      *x = p->s->img_x;
-      *y = p->s->img_y;
-      if (n) *n = p->s->img_n;
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__png_rows_main(&s,x,y,comp,req_comp,func,func_user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_png_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_png_row_func *func, void *func_user)
+{
+   stbi__context s;
+   int result;
+   stbi__start_file(&s,f);
+   result = stbi__png_rows_main(&s,x,y,comp,req_comp,func,func_user);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   return result;
+}
 
+STBIDEF int stbi_png_rows(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_png_row_func *func, void *func_user)
+{
+   stbi__context s;
+   stbi__file file;
+   int result;
+   if (!stbi__open_file(&s, &file, filename)) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi__png_rows_main(&s,x,y,comp,req_comp,func,func_user);
+   stbi__close_file(&file);
    return result;
 }
+#endif
 
-static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    stbi__png p;
+   if (s->into) // stream the rows into place
+      return stbi__png_rows_main(s, x,y,comp,req_comp, NULL, NULL) ? s->into->out : NULL;
    p.s = s;
-   return stbi__do_png(&p, x,y,comp,req_comp, ri);
+   return stbi__do_png(&p, x,y,comp,req_comp, ri, bpc);
 }
 
 static int stbi__png_test(stbi__context *s)
@@ -5527,15 +9641,21 @@ static void *stbi__bmp_parse_header(stbi__context *s, stbi__bmp_data *info)
 }
 
 
+// where row j of a BMP goes in the output
+static stbi_uc *stbi__bmp_row(stbi__context *s, stbi_uc *out, int out_n, int flip_vertically, int j)
+{
+   if (flip_vertically) j = s->img_y-1-j;
+   return out + (size_t) j * s->img_x * out_n;
+}
+
 static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
-   stbi_uc *out;
+   stbi_uc *out, *o, *tmp = NULL;
    unsigned int mr=0,mg=0,mb=0,ma=0, all_a;
    stbi_uc pal[256][4];
    int psize=0,i,j,width;
-   int flip_vertically, pad, target;
+   int flip_vertically, pad, target, out_n;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
@@ -5589,15 +9709,25 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
 
+   out_n = req_comp ? req_comp : target;
+
    // sanity-check size
-   if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
+   if (!stbi__mad3sizes_valid(out_n, s->img_x, s->img_y, 0))
       return stbi__errpuc("too large", "Corrupt BMP");
 
-   out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
+   // rows are decoded as target channels, converted to out_n on the side if
+   // those differ, and go straight to where they end up, flipped or not
+   out = (stbi_uc *) stbi__malloc_mad3(out_n, s->img_x, s->img_y, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
+   if (out_n != target) {
+      tmp = (stbi_uc *) stbi__malloc_mad2(target, s->img_x, 0);
+      if (!tmp) { stbi__free(out); return stbi__errpuc("outofmem", "Out of memory"); }
+   }
+   if (stbi__vertically_flip_on_load)
+      flip_vertically = !flip_vertically;
+   ri->flipped = 1;
    if (info.bpp < 16) {
-      int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); stbi__free(tmp); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5609,50 +9739,54 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); stbi__free(tmp); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
-            int bit_offset = 7, v = stbi__get8(s);
+            int z = 0, bit_offset = 7, v = stbi__get8(s);
+            o = tmp ? tmp : stbi__bmp_row(s, out, out_n, flip_vertically, j);
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
-               out[z++] = pal[color][0];
-               out[z++] = pal[color][1];
-               out[z++] = pal[color][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[color][0];
+               o[z++] = pal[color][1];
+               o[z++] = pal[color][2];
+               if (target == 4) o[z++] = 255;
                if (i+1 == (int) s->img_x) break;
                if((--bit_offset) < 0) {
                   bit_offset = 7;
                   v = stbi__get8(s);
                }
             }
+            if (tmp) stbi__convert_row(stbi__bmp_row(s, out, out_n, flip_vertically, j), tmp, target, out_n, s->img_x);
             stbi__skip(s, pad);
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            int z = 0;
+            o = tmp ? tmp : stbi__bmp_row(s, out, out_n, flip_vertically, j);
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
                   v2 = v & 15;
                   v >>= 4;
                }
-               out[z++] = pal[v][0];
-               out[z++] = pal[v][1];
-               out[z++] = pal[v][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[v][0];
+               o[z++] = pal[v][1];
+               o[z++] = pal[v][2];
+               if (target == 4) o[z++] = 255;
                if (i+1 == (int) s->img_x) break;
                v = (info.bpp == 8) ? stbi__get8(s) : v2;
-               out[z++] = pal[v][0];
-               out[z++] = pal[v][1];
-               out[z++] = pal[v][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[v][0];
+               o[z++] = pal[v][1];
+               o[z++] = pal[v][2];
+               if (target == 4) o[z++] = 255;
             }
+            if (tmp) stbi__convert_row(stbi__bmp_row(s, out, out_n, flip_vertically, j), tmp, target, out_n, s->img_x);
             stbi__skip(s, pad);
          }
       }
    } else {
       int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
-      int z = 0;
       int easy=0;
       stbi__skip(s, info.offset - info.extra_read - info.hsz);
       if (info.bpp == 24) width = 3 * s->img_x;
@@ -5666,64 +9800,52 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); stbi__free(tmp); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(out); stbi__free(tmp); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         int z = 0;
+         o = tmp ? tmp : stbi__bmp_row(s, out, out_n, flip_vertically, j);
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                unsigned char a;
-               out[z+2] = stbi__get8(s);
-               out[z+1] = stbi__get8(s);
-               out[z+0] = stbi__get8(s);
+               o[z+2] = stbi__get8(s);
+               o[z+1] = stbi__get8(s);
+               o[z+0] = stbi__get8(s);
                z += 3;
                a = (easy == 2 ? stbi__get8(s) : 255);
                all_a |= a;
-               if (target == 4) out[z++] = a;
+               if (target == 4) o[z++] = a;
             }
          } else {
             int bpp = info.bpp;
             for (i=0; i < (int) s->img_x; ++i) {
                stbi__uint32 v = (bpp == 16 ? (stbi__uint32) stbi__get16le(s) : stbi__get32le(s));
                unsigned int a;
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
                a = (ma ? stbi__shiftsigned(v & ma, ashift, acount) : 255);
                all_a |= a;
-               if (target == 4) out[z++] = STBI__BYTECAST(a);
+               if (target == 4) o[z++] = STBI__BYTECAST(a);
             }
          }
+         if (tmp) stbi__convert_row(stbi__bmp_row(s, out, out_n, flip_vertically, j), tmp, target, out_n, s->img_x);
          stbi__skip(s, pad);
       }
    }
+   stbi__free(tmp);
 
    // if alpha channel is all 0s, replace with all 255s
-   if (target == 4 && all_a == 0)
-      for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
+   if (target == 4 && all_a == 0 && (out_n == 2 || out_n == 4))
+      for (i=out_n*s->img_x*s->img_y-1; i >= 0; i -= out_n)
          out[i] = 255;
 
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i]; p1[i] = p2[i]; p2[i] = t;
-         }
-      }
-   }
-
-   if (req_comp && req_comp != target) {
-      out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
-      if (out == NULL) return out; // stbi__convert_format frees input on failure
-   }
-
    *x = s->img_x;
    *y = s->img_y;
    if (comp) *comp = s->img_n;
@@ -5886,14 +10008,13 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    int tga_inverted = stbi__get8(s);
    // int tga_alpha_bits = tga_inverted & 15; // the 4 lowest bits - unused (useless?)
    //   image data
-   unsigned char *tga_data;
+   unsigned char *tga_data, *tga_row, *tga_tmp = NULL;
    unsigned char *tga_palette = NULL;
-   int i, j;
+   int i, j, k, out_n;
    unsigned char raw_data[4] = {0};
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5920,148 +10041,151 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    *y = tga_height;
    if (comp) *comp = tga_comp;
 
-   if (!stbi__mad3sizes_valid(tga_width, tga_height, tga_comp, 0))
+   out_n = req_comp ? req_comp : tga_comp;
+   if (!stbi__mad3sizes_valid(tga_width, tga_height, out_n, 0))
       return stbi__errpuc("too large", "Corrupt TGA");
 
-   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
+   // each row is decoded as tga_comp channels, converted on the side if
+   // req_comp differs, and goes straight to where it ends up, flipped or not
+   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, out_n, 0);
    if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
+   if (out_n != tga_comp) {
+      tga_tmp = (unsigned char*)stbi__malloc_mad2(tga_width, tga_comp, 0);
+      if (!tga_tmp) {
+         stbi__free(tga_data);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+   }
+   if (stbi__vertically_flip_on_load)
+      tga_inverted = !tga_inverted;
+   ri->flipped = 1;
 
    // skip to the data's starting position (offset usually = 0)
    stbi__skip(s, tga_offset );
 
-   if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
-      for (i=0; i < tga_height; ++i) {
-         int row = tga_inverted ? tga_height -i - 1 : i;
-         stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
-         stbi__getn(s, tga_row, tga_width * tga_comp);
+   //   do I need to load a palette?
+   if ( tga_indexed )
+   {
+      if (tga_palette_len == 0) {  /* you have to have at least one entry! */
+         stbi__free(tga_data);
+         stbi__free(tga_tmp);
+         return stbi__errpuc("bad palette", "Corrupt TGA");
       }
-   } else  {
-      //   do I need to load a palette?
-      if ( tga_indexed)
-      {
-         if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
-            return stbi__errpuc("bad palette", "Corrupt TGA");
-         }
 
-         //   any data to skip? (offset usually = 0)
-         stbi__skip(s, tga_palette_start );
-         //   load the palette
-         tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
-         if (!tga_palette) {
-            STBI_FREE(tga_data);
-            return stbi__errpuc("outofmem", "Out of memory");
-         }
-         if (tga_rgb16) {
-            stbi_uc *pal_entry = tga_palette;
-            STBI_ASSERT(tga_comp == STBI_rgb);
-            for (i=0; i < tga_palette_len; ++i) {
-               stbi__tga_read_rgb16(s, pal_entry);
-               pal_entry += tga_comp;
-            }
-         } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
-               return stbi__errpuc("bad palette", "Corrupt TGA");
+      //   any data to skip? (offset usually = 0)
+      stbi__skip(s, tga_palette_start );
+      //   load the palette
+      tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
+      if (!tga_palette) {
+         stbi__free(tga_data);
+         stbi__free(tga_tmp);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+      if (tga_rgb16) {
+         stbi_uc *pal_entry = tga_palette;
+         STBI_ASSERT(tga_comp == STBI_rgb);
+         for (i=0; i < tga_palette_len; ++i) {
+            stbi__tga_read_rgb16(s, pal_entry);
+            pal_entry += tga_comp;
          }
+      } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
+            stbi__free(tga_data);
+            stbi__free(tga_tmp);
+            stbi__free(tga_palette);
+            return stbi__errpuc("bad palette", "Corrupt TGA");
       }
-      //   load the data
-      for (i=0; i < tga_width * tga_height; ++i)
-      {
-         //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
-         if ( tga_is_RLE )
+   }
+
+   for (i=0; i < tga_height; ++i) {
+      int row = tga_inverted ? tga_height -i - 1 : i;
+      stbi_uc *dest = tga_data + row*tga_width*out_n;
+      tga_row = tga_tmp ? tga_tmp : dest;
+      if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
+         stbi__getn(s, tga_row, tga_width * tga_comp);
+      } else {
+         //   load the data; RLE packets may run on into the next row
+         for (k=0; k < tga_width; ++k)
          {
-            if ( RLE_count == 0 )
+            //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
+            if ( tga_is_RLE )
             {
-               //   yep, get the next byte as a RLE command
-               int RLE_cmd = stbi__get8(s);
-               RLE_count = 1 + (RLE_cmd & 127);
-               RLE_repeating = RLE_cmd >> 7;
-               read_next_pixel = 1;
-            } else if ( !RLE_repeating )
+               if ( RLE_count == 0 )
+               {
+                  //   yep, get the next byte as a RLE command
+                  int RLE_cmd = stbi__get8(s);
+                  RLE_count = 1 + (RLE_cmd & 127);
+                  RLE_repeating = RLE_cmd >> 7;
+                  read_next_pixel = 1;
+               } else if ( !RLE_repeating )
+               {
+                  read_next_pixel = 1;
+               }
+            } else
             {
                read_next_pixel = 1;
             }
-         } else
-         {
-            read_next_pixel = 1;
-         }
-         //   OK, if I need to read a pixel, do it now
-         if ( read_next_pixel )
-         {
-            //   load however much data we did have
-            if ( tga_indexed )
+            //   OK, if I need to read a pixel, do it now
+            if ( read_next_pixel )
             {
-               // read in index, then perform the lookup
-               int pal_idx = (tga_bits_per_pixel == 8) ? stbi__get8(s) : stbi__get16le(s);
-               if ( pal_idx >= tga_palette_len ) {
-                  // invalid index
-                  pal_idx = 0;
-               }
-               pal_idx *= tga_comp;
-               for (j = 0; j < tga_comp; ++j) {
-                  raw_data[j] = tga_palette[pal_idx+j];
-               }
-            } else if(tga_rgb16) {
-               STBI_ASSERT(tga_comp == STBI_rgb);
-               stbi__tga_read_rgb16(s, raw_data);
-            } else {
-               //   read in the data raw
-               for (j = 0; j < tga_comp; ++j) {
-                  raw_data[j] = stbi__get8(s);
+               //   load however much data we did have
+               if ( tga_indexed )
+               {
+                  // read in index, then perform the lookup
+                  int pal_idx = (tga_bits_per_pixel == 8) ? stbi__get8(s) : stbi__get16le(s);
+                  if ( pal_idx >= tga_palette_len ) {
+                     // invalid index
+                     pal_idx = 0;
+                  }
+                  pal_idx *= tga_comp;
+                  for (j = 0; j < tga_comp; ++j) {
+                     raw_data[j] = tga_palette[pal_idx+j];
+                  }
+               } else if(tga_rgb16) {
+                  STBI_ASSERT(tga_comp == STBI_rgb);
+                  stbi__tga_read_rgb16(s, raw_data);
+               } else {
+                  //   read in the data raw
+                  for (j = 0; j < tga_comp; ++j) {
+                     raw_data[j] = stbi__get8(s);
+                  }
                }
-            }
-            //   clear the reading flag for the next pixel
-            read_next_pixel = 0;
-         } // end of reading a pixel
+               //   clear the reading flag for the next pixel
+               read_next_pixel = 0;
+            } // end of reading a pixel
 
-         // copy data
-         for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+            // copy data
+            for (j = 0; j < tga_comp; ++j)
+              tga_row[k*tga_comp+j] = raw_data[j];
 
-         //   in case we're in RLE mode, keep counting down
-         --RLE_count;
+            //   in case we're in RLE mode, keep counting down
+            --RLE_count;
+         }
       }
-      //   do I need to invert the image?
-      if ( tga_inverted )
+
+      // swap RGB - if the source data was RGB16, it already is in the right order
+      if (tga_comp >= 3 && !tga_rgb16)
       {
-         for (j = 0; j*2 < tga_height; ++j)
+         unsigned char* tga_pixel = tga_row;
+         for (k=0; k < tga_width; ++k)
          {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
-            }
+            unsigned char temp = tga_pixel[0];
+            tga_pixel[0] = tga_pixel[2];
+            tga_pixel[2] = temp;
+            tga_pixel += tga_comp;
          }
       }
-      //   clear my palette, if I had one
-      if ( tga_palette != NULL )
-      {
-         STBI_FREE( tga_palette );
-      }
+
+      // convert to target component count
+      if (tga_tmp)
+         stbi__convert_row(dest, tga_tmp, tga_comp, out_n, tga_width);
    }
 
-   // swap RGB - if the source data was RGB16, it already is in the right order
-   if (tga_comp >= 3 && !tga_rgb16)
+   //   clear my palette, if I had one
+   if ( tga_palette != NULL )
    {
-      unsigned char* tga_pixel = tga_data;
-      for (i=0; i < tga_width * tga_height; ++i)
-      {
-         unsigned char temp = tga_pixel[0];
-         tga_pixel[0] = tga_pixel[2];
-         tga_pixel[2] = temp;
-         tga_pixel += tga_comp;
-      }
+      stbi__free( tga_palette );
    }
-
-   // convert to target component count
-   if (req_comp && req_comp != tga_comp)
-      tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+   stbi__free(tga_tmp);
 
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -6234,7 +10358,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6526,7 +10650,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6549,24 +10673,33 @@ static int stbi__pic_test(stbi__context *s)
 // GIF loader -- public domain by Jean-Marc Lienher -- simplified/shrunk by stb
 
 #ifndef STBI_NO_GIF
+// the string a code stands for, as where it first went in stbi__gif.indices
 typedef struct
 {
-   stbi__int16 prefix;
-   stbi_uc first;
-   stbi_uc suffix;
+   stbi__uint32 pos;
+   stbi__uint32 len;
 } stbi__gif_lzw;
 
+// stbi__gif.indices has the one-pixel strings for the codes below the clear
+// code first, then the indices decoded for the frame; strings are copied 16
+// bytes at a time, so there's that much to spare after both
+#define STBI__GIF_ROOTS   (4096 + 16)
+#define STBI__GIF_SPARE   16
+
 typedef struct
 {
    int w,h;
    stbi_uc *out;                 // output buffer (always 4 components)
    stbi_uc *background;          // The current "background" as far as a gif is concerned
    stbi_uc *history;
+   stbi_uc *indices;             // the frame's palette indices, see STBI__GIF_ROOTS
    int flags, bgindex, ratio, transparent, eflags;
    stbi_uc  pal[256][4];
    stbi_uc lpal[256][4];
    stbi__gif_lzw codes[8192];
    stbi_uc *color_table;
+   stbi__uint32 color[256];      // color_table as output pixels, 0 for transparent entries,
+   stbi__uint32 keep[256];       // and ~0 for those (they leave the pixel as it was)
    int parse, step;
    int lflags;
    int start_x, start_y;
@@ -6574,6 +10707,7 @@ typedef struct
    int cur_x, cur_y;
    int line_size;
    int delay;
+   stbi_uc *two_back;            // only for stbi_gif_stream: the frame from two back, kept in place
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6640,60 +10774,83 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!g) return stbi__err("outofmem", "Out of memory");
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+// don't render transparent pixels, without a branch
+static void stbi__gif_put(stbi_uc *p, stbi__uint32 color, stbi__uint32 keep)
 {
-   stbi_uc *p, *c;
-   int idx;
-
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
+   stbi__uint32 v;
+   memcpy(&v, p, 4);
+   v = (v & keep) | color;
+   memcpy(p, &v, 4);
+}
 
-   if (g->cur_y >= g->max_y) return;
+// draw the first n decoded pixels of the frame, a row at a time (interlaced
+// rows go to the rows of the pass they're in)
+static void stbi__gif_draw(stbi__gif *g, stbi_uc *src, stbi__uint32 n)
+{
+   while (n > 0 && g->cur_y < g->max_y) {
+      int idx = g->cur_x + g->cur_y, i;
+      int w = (g->max_x - g->cur_x) >> 2;
+      stbi_uc *p = &g->out[idx];
+      if ((stbi__uint32) w > n) w = (int) n;
+      memset(&g->history[idx / 4], 1, w);
+      for (i = 0; i < w; ++i)
+         stbi__gif_put(p + 4 * i, g->color[src[i]], g->keep[src[i]]);
+      src += w;
+      n -= w;
+      g->cur_x += 4 * w;
 
-   idx = g->cur_x + g->cur_y;
-   p = &g->out[idx];
-   g->history[idx / 4] = 1;
+      if (g->cur_x >= g->max_x) {
+         g->cur_x = g->start_x;
+         g->cur_y += g->step;
 
-   c = &g->color_table[g->codes[code].suffix * 4];
-   if (c[3] > 128) { // don't render transparent pixels;
-      p[0] = c[2];
-      p[1] = c[1];
-      p[2] = c[0];
-      p[3] = c[3];
+         while (g->cur_y >= g->max_y && g->parse > 0) {
+            g->step = (1 << g->parse) * g->line_size;
+            g->cur_y = g->start_y + (g->step >> 1);
+            --g->parse;
+         }
+      }
    }
-   g->cur_x += 4;
-
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
+}
 
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
-      }
+// read one data sub-block; past the end of the data, reads zeroes like stbi__get8
+static void stbi__gif_block(stbi__context *s, stbi_uc *block, int len)
+{
+   if (s->img_buffer_end - s->img_buffer >= len) {
+      memcpy(block, s->img_buffer, len);
+      s->img_buffer += len;
+   } else {
+      int i;
+      for (i = 0; i < len; ++i)
+         block[i] = stbi__get8(s);
    }
 }
 
+// decodes the frame's palette indices first, then draws them in one go.
+// each code's string is copied from where it first went: a new code is
+// the previous code's string plus the first pixel of the one after it,
+// which is right behind it, so it's at the same place but one longer
 static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 {
    stbi_uc lzw_cs;
    stbi__int32 len, init_code;
    stbi__uint32 first;
-   stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
+   stbi__int32 codesize, codemask, avail, oldcode, valid_bits, clear;
+   stbi__uint32 bits;
    stbi__gif_lzw *p;
+   stbi_uc block[255], *next = block;
+   stbi_uc *idx = g->indices;
+   stbi__uint32 pos, oldpos = 0, end;
+   int ended = 0;
 
    lzw_cs = stbi__get8(s);
    if (lzw_cs > 12) return NULL;
@@ -6704,10 +10861,26 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    bits = 0;
    valid_bits = 0;
    for (init_code = 0; init_code < clear; init_code++) {
-      g->codes[init_code].prefix = -1;
-      g->codes[init_code].first = (stbi_uc) init_code;
-      g->codes[init_code].suffix = (stbi_uc) init_code;
+      idx[init_code] = (stbi_uc) init_code;
+      g->codes[init_code].pos = init_code;
+      g->codes[init_code].len = 1;
+   }
+   for (init_code = 0; init_code < 256; init_code++) {
+      stbi_uc *c = &g->color_table[init_code * 4], rgba[4];
+      rgba[0] = c[2];
+      rgba[1] = c[1];
+      rgba[2] = c[0];
+      rgba[3] = c[3];
+      memcpy(&g->color[init_code], rgba, 4);
+      g->keep[init_code] = 0;
+      if (c[3] <= 128) { // don't render transparent pixels;
+         g->color[init_code] = 0;
+         g->keep[init_code] = ~0u;
+      }
    }
+   pos = end = STBI__GIF_ROOTS;
+   if (g->cur_y < g->max_y)
+      end += (stbi__uint32) ((g->max_x - g->start_x) >> 2) * (stbi__uint32) ((g->max_y - g->start_y) / g->line_size);
 
    // support no starting clear code
    avail = clear+2;
@@ -6716,19 +10889,27 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    len = 0;
    for(;;) {
       if (valid_bits < codesize) {
-         if (len == 0) {
-            len = stbi__get8(s); // start new block
-            if (len == 0)
-               return g->out;
-         }
-         --len;
-         bits |= (stbi__int32) stbi__get8(s) << valid_bits;
-         valid_bits += 8;
+         if (ended)
+            break;
+         // take as many bytes as fit, so this happens every few codes
+         do {
+            if (len == 0) {
+               len = stbi__get8(s); // start new block
+               if (len == 0) {
+                  ended = 1;
+                  break;
+               }
+               stbi__gif_block(s, block, len);
+               next = block;
+            }
+            --len;
+            bits |= (stbi__uint32) *next++ << valid_bits;
+            valid_bits += 8;
+         } while (valid_bits <= 24);
       } else {
-         stbi__int32 code = bits & codemask;
+         stbi__int32 code = (stbi__int32) (bits & codemask);
          bits >>= codesize;
          valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
          if (code == clear) {  // clear code
             codesize = lzw_cs + 1;
             codemask = (1 << codesize) - 1;
@@ -6736,11 +10917,13 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
             oldcode = -1;
             first = 0;
          } else if (code == clear + 1) { // end of stream code
-            stbi__skip(s, len);
-            while ((len = stbi__get8(s)) > 0)
-               stbi__skip(s,len);
-            return g->out;
+            // the rest of this block has been read already
+            if (!ended)
+               while ((len = stbi__get8(s)) > 0)
+                  stbi__skip(s,len);
+            break;
          } else if (code <= avail) {
+            stbi__uint32 n, from;
             if (first) {
                return stbi__errpuc("no clear code", "Corrupt GIF");
             }
@@ -6751,13 +10934,37 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
                   return stbi__errpuc("too many codes", "Corrupt GIF");
                }
 
-               p->prefix = (stbi__int16) oldcode;
-               p->first = g->codes[oldcode].first;
-               p->suffix = (code == avail) ? p->first : g->codes[code].first;
+               p->pos = oldpos;
+               p->len = g->codes[oldcode].len + 1;
             } else if (code == avail)
                return stbi__errpuc("illegal code in raster", "Corrupt GIF");
 
-            stbi__out_gif_code(g, (stbi__uint16) code);
+            n = g->codes[code].len;
+            from = g->codes[code].pos;
+            if (pos + n <= end) {
+               stbi_uc *o = idx + pos, *i = idx + from;
+               if (pos - from >= 16) {
+                  stbi_uc *e = o + n;
+                  do {
+                     memcpy(o, i, 16);
+                     o += 16;
+                     i += 16;
+                  } while (o < e);
+               } else {
+                  // the string runs into itself (a new code used right away)
+                  stbi__uint32 k;
+                  for (k = 0; k < n; ++k)
+                     o[k] = i[k];
+               }
+            } else {
+               // pixels past the end of the frame are dropped
+               stbi__uint32 k;
+               for (k = 0; pos + k < end; ++k)
+                  idx[pos + k] = idx[from + k];
+               n = end - pos;
+            }
+            oldpos = pos;
+            pos += n;
 
             if ((avail & codemask) == 0 && avail <= 0x0FFF) {
                codesize++;
@@ -6770,6 +10977,9 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
          }
       }
    }
+
+   stbi__gif_draw(g, idx + STBI__GIF_ROOTS, pos - STBI__GIF_ROOTS);
+   return g->out;
 }
 
 // this function is designed to support animated gifs, although stb_image doesn't support it
@@ -6778,7 +10988,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 {
    int dispose;
    int first_frame;
-   int pi;
+   int pi, row;
    int pcount;
    STBI_NOTUSED(req_comp);
 
@@ -6792,7 +11002,8 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
       g->out = (stbi_uc *) stbi__malloc(4 * pcount);
       g->background = (stbi_uc *) stbi__malloc(4 * pcount);
       g->history = (stbi_uc *) stbi__malloc(pcount);
-      if (!g->out || !g->background || !g->history)
+      g->indices = (stbi_uc *) stbi__malloc(STBI__GIF_ROOTS + pcount + STBI__GIF_SPARE);
+      if (!g->out || !g->background || !g->history || !g->indices)
          return stbi__errpuc("outofmem", "Out of memory");
 
       // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
@@ -6811,33 +11022,43 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
          dispose = 2; // if I don't have an image to revert back to, default to the old background
       }
 
-      if (dispose == 3) { // use previous graphic
-         for (pi = 0; pi < pcount; ++pi) {
-            if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &two_back[pi * 4], 4 );
-            }
-         }
-      } else if (dispose == 2) {
-         // restore what was changed last frame to background before that frame;
+      if (g->two_back && dispose == 3) {
+         // streaming keeps a single older frame: the previous frame is moved
+         // into it as it's disposed of, ready to be "two back" for the next one
          for (pi = 0; pi < pcount; ++pi) {
-            if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &g->background[pi * 4], 4 );
-            }
+            stbi_uc *o = &g->out[pi * 4], *b = &g->two_back[pi * 4], t[4];
+            memcpy( t, o, 4 );
+            if (g->history[pi])
+               memcpy( o, b, 4 );
+            memcpy( b, t, 4 );
          }
       } else {
-         // This is a non-disposal case eithe way, so just
-         // leave the pixels as is, and they will become the new background
-         // 1: do not dispose
-         // 0:  not specified.
+         // 3: use previous graphic
+         // 2: restore what was changed last frame to background before that frame
+         // 1: do not dispose, 0: not specified; the pixels are left as they are
+         // and will become the new background
+         stbi_uc *from = dispose == 3 ? two_back : g->background;
+         if (g->two_back)
+            memcpy( g->two_back, g->out, 4 * pcount );
+         if (dispose == 2 || dispose == 3) {
+            // only the last frame's rectangle has pixels in history
+            for (row = g->start_y; row < g->max_y; row += g->line_size)
+               for (pi = row + g->start_x; pi < row + g->max_x; pi += 4)
+                  if (g->history[pi / 4])
+                     memcpy( &g->out[pi], &from[pi], 4 );
+         }
       }
 
-      // background is what out is after the undoing of the previou frame;
-      memcpy( g->background, g->out, 4 * g->w * g->h );
+      // background is what out is after the undoing of the previous frame, which
+      // only differs from the last background in the last frame's rectangle
+      // (all of the image after the first frame, see below); that's also where
+      // history needs clearing
+      for (row = g->start_y; row < g->max_y; row += g->line_size) {
+         memcpy( &g->background[row + g->start_x], &g->out[row + g->start_x], g->max_x - g->start_x );
+         memset( &g->history[(row + g->start_x) / 4], 0x00, (g->max_x - g->start_x) / 4 );
+      }
    }
 
-   // clear my history;
-   memset( g->history, 0x00, g->w * g->h );        // pixels that were affected previous frame
-
    for (;;) {
       int tag = stbi__get8(s);
       switch (tag) {
@@ -6900,6 +11121,12 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
                   }
                }
             }
+            if (first_frame) {
+               // the next frame saves the background from all of out
+               g->start_x = g->start_y = 0;
+               g->max_x = g->line_size;
+               g->max_y = g->h * g->line_size;
+            }
 
             return o;
          }
@@ -6950,12 +11177,13 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
 static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__free(g->out);
+   stbi__free(g->history);
+   stbi__free(g->indices);
+   stbi__free(g->background);
 
-   if (out) STBI_FREE(out);
-   if (delays && *delays) STBI_FREE(*delays);
+   if (out) stbi__free(out);
+   if (delays && *delays) stbi__free(*delays);
    return stbi__errpuc("outofmem", "Out of memory");
 }
 
@@ -6990,7 +11218,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized( out, out_size, layers * stride );
                if (!tmp)
                   return stbi__load_gif_main_outofmem(&g, out, delays);
                else {
@@ -6999,7 +11227,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc_sized( *delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
                      return stbi__load_gif_main_outofmem(&g, out, delays);
                   *delays = new_delays;
@@ -7019,7 +11247,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
@@ -7029,12 +11257,13 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.indices);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
-      if (req_comp && req_comp != 4)
+      if (out && req_comp && req_comp != 4)
          out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
 
       *z = layers;
@@ -7063,12 +11292,13 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.indices);
+   stbi__free(g.background);
 
    return u;
 }
@@ -7077,6 +11307,158 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+struct stbi_gif_stream
+{
+   stbi__context s;
+   stbi__gif g;
+   stbi_uc *result;   // frames converted to req_comp and/or flipped; else frames are g.out
+   int req_comp, flip;
+   int frames;        // decoded so far
+   int pending;       // the first frame is decoded when the stream starts
+   int done;
+#ifndef STBI_NO_STDIO
+   stbi__file file;   // from stbi_gif_stream_open
+   FILE *f;           // from stbi_gif_stream_from_file, to unget what was buffered
+#endif
+};
+
+STBIDEF void stbi_gif_stream_close(stbi_gif_stream *st)
+{
+   if (!st) return;
+   stbi__free(st->g.out);
+   stbi__free(st->g.background);
+   stbi__free(st->g.history);
+   stbi__free(st->g.indices);
+   stbi__free(st->g.two_back);
+   stbi__free(st->result);
+#ifndef STBI_NO_STDIO
+   if (st->f) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(st->f, - (int) (st->s.img_buffer_end - st->s.img_buffer), SEEK_CUR);
+   }
+   stbi__close_file(&st->file);
+#endif
+   stbi__free(st);
+}
+
+// st->s has been started; decode the first frame so the size is known
+static stbi_gif_stream *stbi__gif_stream_start(stbi_gif_stream *st, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *u;
+   int w, h;
+
+   if (req_comp < 0 || req_comp > 4) {
+      stbi_gif_stream_close(st);
+      return (stbi_gif_stream *) stbi__errpuc("bad req_comp", "Internal error");
+   }
+   if (!stbi__gif_test(&st->s)) {
+      stbi_gif_stream_close(st);
+      return (stbi_gif_stream *) stbi__errpuc("not GIF", "Image was not as a gif type.");
+   }
+   u = stbi__gif_load_next(&st->s, &st->g, comp, req_comp, 0);
+   if (u == (stbi_uc *) &st->s) u = stbi__errpuc("no frames", "Corrupt GIF");
+   if (!u) {
+      stbi_gif_stream_close(st);
+      return NULL;
+   }
+
+   w = st->g.w;
+   h = st->g.h;
+   st->req_comp = req_comp ? req_comp : 4;
+   st->flip = stbi__vertically_flip_on_load;
+   st->g.two_back = (stbi_uc *) stbi__malloc(4 * w * h);
+   if (st->req_comp != 4 || st->flip)
+      st->result = (stbi_uc *) stbi__malloc_mad3(st->req_comp, w, h, 0);
+   if (!st->g.two_back || (!st->result && (st->req_comp != 4 || st->flip))) {
+      stbi_gif_stream_close(st);
+      return (stbi_gif_stream *) stbi__errpuc("outofmem", "Out of memory");
+   }
+   st->frames = 1;
+   st->pending = 1;
+   *x = w;
+   *y = h;
+   return st;
+}
+
+static stbi_gif_stream *stbi__gif_stream_alloc(void)
+{
+   stbi_gif_stream *st = (stbi_gif_stream *) stbi__malloc(sizeof(stbi_gif_stream));
+   if (!st) return (stbi_gif_stream *) stbi__errpuc("outofmem", "Out of memory");
+   memset(st, 0, sizeof(*st));
+   return st;
+}
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *st = stbi__gif_stream_alloc();
+   if (!st) return NULL;
+   stbi__start_mem(&st->s,buffer,len);
+   return stbi__gif_stream_start(st,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *st = stbi__gif_stream_alloc();
+   if (!st) return NULL;
+   stbi__start_callbacks(&st->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_stream_start(st,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_stream *stbi_gif_stream_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *st = stbi__gif_stream_alloc();
+   if (!st) return NULL;
+   stbi__start_file(&st->s,f);
+   st->f = f;
+   return stbi__gif_stream_start(st,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_gif_stream *stbi_gif_stream_open(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_gif_stream *st = stbi__gif_stream_alloc();
+   if (!st) return NULL;
+   if (!stbi__open_file(&st->s, &st->file, filename)) {
+      stbi__free(st);
+      return (stbi_gif_stream *) stbi__errpuc("can't fopen", "Unable to open file");
+   }
+   return stbi__gif_stream_start(st,x,y,comp,req_comp);
+}
+#endif
+
+STBIDEF stbi_uc const *stbi_gif_stream_next(stbi_gif_stream *st, int *delay)
+{
+   stbi__gif *g = &st->g;
+   stbi_uc *u;
+   int j;
+
+   if (st->pending) {
+      st->pending = 0;
+      u = g->out;
+   } else {
+      if (st->done) return NULL;
+      // the frame two back is only there from the third frame on
+      u = stbi__gif_load_next(&st->s, g, NULL, 4, st->frames >= 2 ? g->two_back : 0);
+      if (u == (stbi_uc *) &st->s) u = 0;  // end of animated gif marker
+      if (!u) {
+         st->done = 1;
+         return NULL;
+      }
+      ++st->frames;
+   }
+
+   if (delay) *delay = g->delay;
+   if (!st->result) return u;
+   for (j=0; j < g->h; ++j) {
+      stbi_uc *dest = st->result + (size_t) (st->flip ? g->h-1-j : j) * g->w * st->req_comp;
+      if (st->req_comp == 4)
+         memcpy(dest, u + (size_t) j * g->w * 4, (size_t) g->w * 4);
+      else
+         stbi__convert_row(dest, u + (size_t) j * g->w * 4, 4, st->req_comp, g->w);
+   }
+   return st->result;
+}
 #endif
 
 // *************************************************************************************************
@@ -7131,8 +11513,10 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
    if ( input[3] != 0 ) {
       float f1;
-      // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+      // Exponent: 2^(e-136) is 2^(e-127) * 2^-9, exactly, without ldexp()
+      stbi__uint32 bits = (stbi__uint32) input[3] << 23;
+      memcpy(&f1, &bits, 4);
+      f1 *= 1.0f / 512;
       if (req_comp <= 2)
          output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
       else {
@@ -7154,19 +11538,69 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
-static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+// a scanline of RGBE pixels to floats, as stbi__hdr_convert does
+static void stbi__hdr_convert_row(float *output, stbi_uc *input, int width, int req_comp)
+{
+   int i = 0;
+#ifdef STBI_SSE2
+   if ((req_comp == 3 || req_comp == 4) && stbi__sse2_available()) {
+      // 4 pixels at a time: each pixel's R,G,B,E as 32-bit ints, scaled by
+      // its 2^(E-136) (0 for E=0). with 3 channels the stores overlap, and
+      // the last pixel is left for stbi__hdr_convert so they stay in the row
+      __m128 scale = _mm_set1_ps(1.0f / 512), one = _mm_set_ps(1.0f, 0, 0, 0);
+      __m128 rgb = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+      __m128i zero = _mm_setzero_si128();
+      for (; i+5 <= width; i += 4) {
+         __m128i px = _mm_loadu_si128((__m128i *) (input + i*4));
+         __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+         __m128i p[4];
+         int k;
+         p[0] = _mm_unpacklo_epi16(lo, zero);
+         p[1] = _mm_unpackhi_epi16(lo, zero);
+         p[2] = _mm_unpacklo_epi16(hi, zero);
+         p[3] = _mm_unpackhi_epi16(hi, zero);
+         for (k=0; k < 4; ++k) {
+            __m128i e = _mm_shuffle_epi32(p[k], _MM_SHUFFLE(3,3,3,3));
+            __m128 f1 = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(e, 23)), scale);
+            __m128 v = _mm_or_ps(_mm_and_ps(_mm_mul_ps(_mm_cvtepi32_ps(p[k]), f1), rgb), one);
+            _mm_storeu_ps(output + (i+k)*req_comp, v);
+         }
+      }
+   }
+#endif
+   for (; i < width; ++i)
+      stbi__hdr_convert(output + i*req_comp, input + i*4, req_comp);
+}
+
+// put n converted floats in the output at element 'at', as they are, or as
+// half floats if half is 1 (or 2, to use F16C)
+static void stbi__hdr_put(void *out, size_t at, float const *f, int n, int half)
+{
+#ifndef STBI_NO_LINEAR
+   if (half) {
+      stbi__float_to_half_row((stbi__uint16 *) out + at, f, n, half == 2);
+      return;
+   }
+#else
+   STBI_NOTUSED(half);
+#endif
+   memcpy((float *) out + at, f, n * sizeof(float));
+}
+
+// returns floats, or half floats for stbi_loadh (see stbi__hdr_put)
+static void *stbi__hdr_load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, int half)
 {
    char buffer[STBI__HDR_BUFLEN];
    char *token;
    int valid = 0;
    int width, height;
    stbi_uc *scanline;
-   float *hdr_data;
+   void *hdr_data;
+   float px[4], *row;
    int len;
    unsigned char count, value;
    int i, j, k, c1,c2, z;
    const char *headerToken;
-   STBI_NOTUSED(ri);
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
@@ -7206,7 +11640,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
       return stbi__errpf("too large", "HDR image is too large");
 
    // Read data
-   hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+   hdr_data = stbi__malloc_mad4(width, height, req_comp, half ? 2 : sizeof(float), 0);
    if (!hdr_data)
       return stbi__errpf("outofmem", "Out of memory");
 
@@ -7219,7 +11653,8 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi_uc rgbe[4];
            main_decode_loop:
             stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+            stbi__hdr_convert(px, rgbe, req_comp);
+            stbi__hdr_put(hdr_data, ((size_t) j * width + i) * req_comp, px, req_comp, half);
          }
       }
    } else {
@@ -7238,19 +11673,21 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             rgbe[1] = (stbi_uc) c2;
             rgbe[2] = (stbi_uc) len;
             rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
+            stbi__hdr_convert(px, rgbe, req_comp);
+            stbi__hdr_put(hdr_data, 0, px, req_comp, half);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
-            scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
+            // with half floats, the row is converted to floats first, after the RGBE
+            scanline = (stbi_uc *) stbi__malloc_mad2(width, half ? 4 + req_comp * sizeof(float) : 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
@@ -7264,27 +11701,38 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = value;
                } else {
                   // Dump
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = stbi__get8(s);
                }
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         if (half) {
+            row = (float *) (scanline + width*4);
+            stbi__hdr_convert_row(row, scanline, width, req_comp);
+            stbi__hdr_put(hdr_data, (size_t) j*width*req_comp, row, width*req_comp, half);
+         } else {
+            stbi__hdr_convert_row((float *) hdr_data + (size_t) j*width*req_comp, scanline, width, req_comp);
+         }
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
 }
 
+static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   STBI_NOTUSED(ri);
+   return (float *) stbi__hdr_load_main(s, x, y, comp, req_comp, 0);
+}
+
 static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -7524,7 +11972,7 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
    out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (!stbi__getn(s, out, s->img_n * s->img_x * s->img_y * (ri->bits_per_channel / 8))) {
-      STBI_FREE(out);
+      stbi__free(out);
       return stbi__errpuc("bad PNM", "PNM file truncated");
    }
 
@@ -7758,6 +12206,153 @@ STBIDEF int stbi_is_16_bit_from_callbacks(stbi_io_callbacks const *c, void *user
    return stbi__is_16_main(&s);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+//  batch loading
+//
+//    - one pool job per image; the pool work of each decode is a nested
+//      group as usual, which idle threads pick up once the images are
+//      all handed out
+//    - a job takes on the calling thread's per-thread settings for the
+//      length of its load, and puts back those of the thread it runs on
+//    - failures are read from stbi__g_failure_reason on the thread that
+//      loaded the image, so without thread-locals everything stays on the
+//      calling thread
+
+#ifdef STBI_THREAD_LOCAL
+// the per-thread settings as set, not as in effect
+typedef struct
+{
+   stbi_allocator const *allocator;
+   int flip, flip_set;
+   int downscale, downscale_set;
+#ifndef STBI_NO_PNG
+   int unpremultiply, unpremultiply_set;
+   int de_iphone, de_iphone_set;
+#endif
+} stbi__thread_settings;
+
+static void stbi__get_thread_settings(stbi__thread_settings *t)
+{
+   t->allocator = stbi__g_allocator;
+   t->flip = stbi__vertically_flip_on_load_local;
+   t->flip_set = stbi__vertically_flip_on_load_set;
+   t->downscale = stbi__jpeg_downscale_local;
+   t->downscale_set = stbi__jpeg_downscale_set;
+#ifndef STBI_NO_PNG
+   t->unpremultiply = stbi__unpremultiply_on_load_local;
+   t->unpremultiply_set = stbi__unpremultiply_on_load_set;
+   t->de_iphone = stbi__de_iphone_flag_local;
+   t->de_iphone_set = stbi__de_iphone_flag_set;
+#endif
+}
+
+static void stbi__set_thread_settings(stbi__thread_settings const *t)
+{
+   stbi__g_allocator = t->allocator;
+   stbi__vertically_flip_on_load_local = t->flip;
+   stbi__vertically_flip_on_load_set = t->flip_set;
+   stbi__jpeg_downscale_local = t->downscale;
+   stbi__jpeg_downscale_set = t->downscale_set;
+#ifndef STBI_NO_PNG
+   stbi__unpremultiply_on_load_local = t->unpremultiply;
+   stbi__unpremultiply_on_load_set = t->unpremultiply_set;
+   stbi__de_iphone_flag_local = t->de_iphone;
+   stbi__de_iphone_flag_set = t->de_iphone_set;
+#endif
+}
+#endif // STBI_THREAD_LOCAL
+
+typedef struct
+{
+   stbi_batch_item *items;
+   stbi_batch_done_func *done_func;
+   void *done_user;
+#ifdef STBI_THREAD_LOCAL
+   stbi__thread_settings settings;  // of the calling thread
+#endif
+} stbi__batch;
+
+static void *stbi__batch_load_main(stbi__context *s, stbi_batch_item *it)
+{
+   int *x = &it->x, *y = &it->y, *comp = &it->channels_in_file, req_comp = it->desired_channels;
+   if (it->out && it->type != STBI_batch_8bit)
+      return stbi__errpuc("bad batch item", "Only 8-bit images can be decoded into your own memory");
+   switch (it->type) {
+      case STBI_batch_8bit:
+         if (it->out)
+            return stbi__load_into_main(s,it->out,it->out_w,it->out_h,it->out_stride,x,y,comp,req_comp) ? it->out : NULL;
+         return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+      case STBI_batch_16bit:
+         return stbi__load_and_postprocess_16bit(s,x,y,comp,req_comp);
+   #ifndef STBI_NO_LINEAR
+      case STBI_batch_float:
+         return stbi__loadf_main(s,x,y,comp,req_comp);
+      case STBI_batch_half:
+         return stbi__loadh_main(s,x,y,comp,req_comp);
+   #endif
+   }
+   return stbi__errpuc("bad batch item", "Unsupported batch item type");
+}
+
+static void stbi__batch_job(void *user, int index)
+{
+   stbi__batch *b = (stbi__batch *) user;
+   stbi_batch_item *it = &b->items[index];
+   const char *reason = stbi__g_failure_reason;
+   stbi__context s;
+#ifdef STBI_THREAD_LOCAL
+   stbi__thread_settings own;
+   stbi__get_thread_settings(&own);
+   stbi__set_thread_settings(&b->settings);
+#endif
+
+   stbi__g_failure_reason = NULL;
+   if (it->filename) {
+   #ifndef STBI_NO_STDIO
+      stbi__file file;
+      if (stbi__open_file(&s, &file, it->filename)) {
+         it->data = stbi__batch_load_main(&s, it);
+         stbi__close_file(&file);
+      } else {
+         it->data = stbi__errpuc("can't fopen", "Unable to open file");
+      }
+   #else
+      it->data = stbi__errpuc("no stdio", "Loading files by name isn't compiled in");
+   #endif
+   } else {
+      stbi__start_mem(&s, it->buffer, it->len);
+      it->data = stbi__batch_load_main(&s, it);
+   }
+   it->failure_reason = it->data ? NULL : stbi__g_failure_reason;
+   stbi__g_failure_reason = reason;
+
+#ifdef STBI_THREAD_LOCAL
+   stbi__set_thread_settings(&own);
+#endif
+   if (b->done_func)
+      b->done_func(b->done_user, it);
+}
+
+STBIDEF int stbi_load_batch(stbi_batch_item *items, int count, stbi_batch_done_func *done_func, void *done_user)
+{
+   stbi__batch b;
+   int i, loaded = 0;
+   b.items = items;
+   b.done_func = done_func;
+   b.done_user = done_user;
+#ifdef STBI_THREAD_LOCAL
+   stbi__get_thread_settings(&b.settings);
+   stbi__parallel_for(stbi__batch_job, &b, count);
+#else
+   for (i=0; i < count; ++i)
+      stbi__batch_job(&b, i);
+#endif
+   for (i=0; i < count; ++i)
+      if (items[i].data) ++loaded;
+   return loaded;
+}
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*